@@ -1,12 +1,19 @@
 #include "Arduino.h"
 #include <EEPROM.h>
-#include <Timer1.h>
 #include <Timer5.h>
 #include <TimeLib.h>
-#include <Wire.h>
-#include <LiquidCrystal_I2C.h>
 #include "eeprom_helper.h"
 #include "string_helper.h"
+#include "profiler.h"
+#include "send_window.h"
+#include "fixed_point.h"
+
+// Feature set, see feature_set.h. Single features can be overridden the same way.
+//#define CSTATION_FEATURES CSTATION_FEATURES_HEADLESS
+//#define CSTATION_FEATURE_MAGNETOMETER 0
+#include "feature_set.h"
+#include "descriptors.h"
+#include "telemetry_frame.h"
 #include <avr/pgmspace.h>
 
 enum StateQueryCode 
@@ -15,24 +22,48 @@ enum StateQueryCode
   STATE_LED, 
   STATE_TONE, 
   STATE_FAN,
-  STATE_LIGHTG4 
+  STATE_LIGHTG4,
+  STATE_ALARM_HOUR,
+  STATE_BEEP_HOURLY,
+  STATE_TIME,
+  STATE_TIME_STATUS,
+  STATE_CODES_COUNT
+};
+
+// DS_DIAG={...} parts of the DIAG_REQUEST reply
+enum DiagPart
+{
+  DIAG_LINK,
+  DIAG_TIME,
+  DIAG_EVENTS,
+  DIAG_SENSORS,
+  DIAG_TELEMETRY,
+  DIAG_RUNTIME,
+  DIAG_RULES,
+  DIAG_PARTS_COUNT
 };
 
 unsigned long getState(StateQueryCode state_code);
+bool getSensorValue(SensorId sensor, long* value);
 
 #define BAUD_RATE 38400
 
+// Tokenized log on Serial, see debug_log.h. CSTATION_DEBUG logs everything,
+// CSTATION_LOG_LEVEL picks a level (LOG_LEVEL_ERROR ... LOG_LEVEL_DEBUG).
 //#define CSTATION_DEBUG
 
-#ifdef CSTATION_DEBUG
-  #define DEBUG_WRITE(...) { Serial.print(__VA_ARGS__); }
-  #define DEBUG_WRITELN(...) { Serial.println(__VA_ARGS__); }
-  #define DEBUG_LINE_SEPARATOR "-----\r\n"
-#else
-  #define DEBUG_WRITE(...) {}
-  #define DEBUG_WRITELN(...) {}
-  #define DEBUG_LINE_SEPARATOR
+// Single server link in transparent transmission mode (AT+CIPMODE=1).
+// Server commands then come over the same link, the local command server is not started.
+//#define CSTATION_PASSTHROUGH
+
+#ifndef CSTATION_LOG_LEVEL
+  #ifdef CSTATION_DEBUG
+    #define CSTATION_LOG_LEVEL LOG_LEVEL_DEBUG
+  #else
+    #define CSTATION_LOG_LEVEL LOG_LEVEL_NONE
+  #endif
 #endif
+#include "debug_log.h"
 
 #define MAX_ATTEMPTS 5
 
@@ -40,7 +71,8 @@ unsigned long getState(StateQueryCode state_code);
 #define SENDING_INTERVAL 30000
 #define ERROR_CHECK_INTERVAL 120000
 
-#define FORECAST_UPDATE_INTERVAL 3600000
+// Unchanged forecasts cost a SET_FORECAST=#<hash> reply only
+#define FORECAST_UPDATE_INTERVAL 900000
 
 #define RESET_BTN_PIN 48
 #define CONFIG_BTN_PIN 50
@@ -50,33 +82,36 @@ unsigned long getState(StateQueryCode state_code);
 #define CONTROL_BTN_INTERRUPT 0
 #define CONTROL_BTN_INTERRUPT_MODE RISING
 
+#include "sleep_controller.h"
+SleepController *sleep_controller;
+#include "soft_timer.h"
+SoftTimers *soft_timers;
 #include "indication_controller.h"
 IndicationController *ind_controller;
 #include "tone_controller.h"
 ToneController *tone_controller;
+#include "twi_queue.h"
+TWIQueue *twi_queue;
+#if CSTATION_FEATURE_LCD
+#include "lcd_display.h"
+#endif
 #include "lcd_controller.h"
 LCDController *lcd_controller;
 #include "guard_controller.h"
 GuardController *guard_controller;
+#include "event_queue.h"
+EventQueue *event_queue;
+#include "rule_engine.h"
+RuleEngine *rule_engine;
+#include "state_publisher.h"
+StatePublisher *state_publisher;
+#include "time_sync_controller.h"
+TimeSyncController *time_sync;
+#include "link_buffers.h"
+LinkBuffers *link_buffers;
 
 byte errors_count = 0;
 
-const byte controls_count = 13;
-const char control_0[] PROGMEM = "DC_INFO={'CODE':'tone','PREFIX':'TONE','PARAM':[{'NAME':'Led indication','SKIP':1,'VALUE':'L','TYPE':'BOOL'},{'NAME':'Frequency','TYPE':'UINT','DEFAULT':500},{'NAME':'Period','TYPE':'UINT'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['0']}]}";
-const char control_1[] PROGMEM = "DC_INFO={'CODE':'melody','PREFIX':'MEL','PARAM':[{'NAME':'Write to buffer','SKIP':1,'VALUE':'B','TYPE':'BOOL'},{'NAME':'Code as index','SKIP':1,'VALUE':'I','TYPE':'BOOL'},{'NAME':'Code','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['0']}]}";
-const char control_2[] PROGMEM = "DC_INFO={'CODE':'led','PREFIX':'LED_SET','PARAM':[{'NAME':'Led state','TYPE':'BOOL'}]}";
-const char control_3[] PROGMEM = "DC_INFO={'CODE':'state','PREFIX':'STATES_REQUEST','LISTEN':1,'PARAM':[{'VALUE':1,'SKIP':1}]}";
-const char control_4[] PROGMEM = "DC_INFO={'CODE':'reset','PREFIX':'SERV_RST','PARAM':[{'VALUE':1,'SKIP':1}]}";
-const char control_5[] PROGMEM = "DC_INFO={'CODE':'config','PREFIX':'SERV_CONF','PARAM':[{'VALUE':1,'SKIP':1}]}";
-const char control_6[] PROGMEM = "DC_INFO={'CODE':'displaystate','PREFIX':'SET_DISPLAY_ST','PARAM':[{'NAME':'Display state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]}";
-const char control_7[] PROGMEM = "DC_INFO={'CODE':'fanstate','PREFIX':'SET_FAN_ST','PARAM':[{'NAME':'Fan state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]}";
-const char control_8[] PROGMEM = "DC_INFO={'CODE':'lightstate','PREFIX':'SET_LIGHT_ST','PARAM':[{'NAME':'Light state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]}";
-const char control_9[] PROGMEM = "DC_INFO={'CODE':'settime','PREFIX':'SET_TIME','PARAM':[{'NAME':'Timestamp','TYPE':'TIMESTAMP'}],'BUTTONS':[{'NAME':'Request','PARAMSET':['R']}]}";
-const char control_10[] PROGMEM = "DC_INFO={'CODE':'alarmmode','PREFIX':'SET_ALARM','PARAM':[{'NAME':'Hourly beep','TYPE':'BOOL'},{'NAME':'Alarm','TYPE':'BOOL'},{'NAME':'Alarm hour','TYPE':'UINT'}]}";
-const char control_11[] PROGMEM = "DC_INFO={'CODE':'lcd','PREFIX':'SERV_LT','PARAM':[{'NAME':'Display text','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['']}]}";
-const char control_12[] PROGMEM = "DC_INFO={'CODE':'setforecast','PREFIX':'SET_FORECAST','PARAM':[{'NAME':'Forecast','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Request','PARAMSET':['R']}]}";
-const char* const controls_list[] PROGMEM = {control_0, control_1, control_2, control_3, control_4, control_5, control_6, control_7, control_8, control_9, control_10, control_11, control_12};
-
 volatile bool reset_btn_pressed = false;
 volatile bool reset_btn_long_pressed = false;
 volatile bool config_btn_pressed = false;
@@ -84,19 +119,26 @@ volatile bool signal_btn_pressed = false;
 volatile bool signal_btn_sended = false;
 volatile bool need_auto_state_lcd_update = false;
 volatile bool time_return_wait = true;
-volatile bool forecast_return_wait = true;
+// Forecasts are only requested for the LCD page
+volatile bool forecast_return_wait = CSTATION_FEATURE_LCD;
 
 unsigned long int last_forecast_uptime;
 
-time_t time_sync_provider()
-{
-  time_return_wait = true;
-  return 0;
-}
+unsigned long int forecast_request_millis = 0;
+unsigned long int forecast_response_ms = 0;
+unsigned long int forecast_unchanged_count = 0;
+bool forecast_shown = false;
+uint16_t forecast_hash = 0;
+unsigned long int commands_count = 0;
+unsigned long int commands_micros = 0;
 
 void setup()
 {
+#if CSTATION_LOG_LEVEL > LOG_LEVEL_NONE
+  DebugLog::begin();
+#else
   Serial.begin(BAUD_RATE);
+#endif
   pinMode(TONE_PIN, OUTPUT);
   digitalWrite(TONE_PIN, HIGH);
   pinMode(RESET_BTN_PIN, INPUT);
@@ -104,16 +146,25 @@ void setup()
   pinMode(SIGNAL_BTN_PIN, INPUT);
   pinMode(CONTROL_BTN_PIN, INPUT);
   attachInterrupt(CONTROL_BTN_INTERRUPT, ControlBTN_Rising, CONTROL_BTN_INTERRUPT_MODE);
-  setSyncInterval(TIME_SYNC_INTERVAL);
-  setSyncProvider(time_sync_provider);
+  // The module boots while the rest is initialized, StartConnection() waits for it
+  initESP();
+  espStartBootReset();
+  sleep_controller = SleepController::Instance();
+  time_sync = TimeSyncController::Instance();
+  soft_timers = SoftTimers::Instance();
+  soft_timers->begin();
+  twi_queue = TWIQueue::Instance();
+  twi_queue->begin();
   lcd_controller = LCDController::Instance();
-  lcd_controller->initLCD();
   ind_controller = IndicationController::Instance();
   tone_controller = ToneController::Instance();
   guard_controller = GuardController::Instance();
-  initESP();
+  event_queue = EventQueue::Instance();
+  rule_engine = RuleEngine::Instance();
+  state_publisher = StatePublisher::Instance();
+  link_buffers = LinkBuffers::Instance();
   initSensors();
-  DEBUG_WRITELN("Starting...\r\n");
+  LOG_INFO(LOG_STARTING);
   reset_btn_pressed = false;
   reset_btn_long_pressed = true;
   config_btn_pressed = false;
@@ -121,19 +172,60 @@ void setup()
   signal_btn_sended = true;
   need_auto_state_lcd_update = false;
   time_return_wait = true;
-  forecast_return_wait = true;
+  forecast_return_wait = CSTATION_FEATURE_LCD;
   last_forecast_uptime = 0;
 }
 
 void loop()
 {
+  loopProcess();
+  sleep_controller->sleep(loopIdleTime(), loopWorkPending);
+}
+
+// Shortest time until something in loopProcess() is due
+unsigned long loopIdleTime()
+{
+  if (loopWorkPending() || reset_btn_long_pressed || time_return_wait || forecast_return_wait) return 0;
+  unsigned long idle = guard_controller->idleTime();
+  idle = SleepController::shorter(idle, time_sync->idleTime());
+  idle = SleepController::shorter(idle, lcd_controller->idleTime());
+  idle = SleepController::shorter(idle, tone_controller->idleTime());
+  idle = SleepController::shorter(idle, ind_controller->idleTime());
+  idle = SleepController::shorter(idle, rule_engine->idleTime());
+  idle = SleepController::shorter(idle, sensorsIdleTime());
+  idle = SleepController::shorter(idle, connectionIdleTime());
+  if (!isReconnecting()) {
+#if CSTATION_FEATURE_LCD
+    idle = SleepController::shorter(idle, SleepController::remaining(last_forecast_uptime, FORECAST_UPDATE_INTERVAL + 1));
+#endif
+    idle = SleepController::shorter(idle, state_publisher->idleTime());
+    idle = SleepController::shorter(idle, time_sync->syncIdleTime());
+  }
+  return idle;
+}
+
+// Work that ISRs flag without a deadline, checked after every wake-up
+bool loopWorkPending()
+{
+  return reset_btn_pressed || config_btn_pressed || need_auto_state_lcd_update || event_queue->hasLocalEvents() || espDataPending();
+}
+
+void loopProcess()
+{
+  PROFILE_FUNCTION(PROF_LOOP);
+
   guard_controller->timerProcess(reset_btn_pressed);
+  time_sync->timerProcess();
   lcd_controller->timerProcess();
   tone_controller->timerProcess();
   ind_controller->timerProcess();
+  sensorsProcess();
+  // Local automations first, they don't wait for the link
+  rule_engine->process(event_queue->takeLocalEvents());
 
+#if CSTATION_FEATURE_CONFIG_MODE
   if (config_btn_pressed) {
-    DEBUG_WRITELN("Config BTN pressed. Entering configuration mode\r\n");
+    LOG_INFO(LOG_CONFIG_BUTTON);
     StartConfiguringMode();
     config_btn_pressed = false;
     reset_btn_pressed = false;
@@ -142,6 +234,7 @@ void loop()
     signal_btn_sended = true;
     return;
   }
+#endif
   if (reset_btn_pressed) {
     reset_btn_pressed = false;
     tone_controller->StopTone();
@@ -149,7 +242,7 @@ void loop()
     lcd_controller->clearLCDText(LCD_PAGE_OUTER);
   }
   if (reset_btn_long_pressed) {
-    DEBUG_WRITELN("Reset initiated. Resetting...\r\n");
+    LOG_INFO(LOG_RESET_BUTTON);
     StartConnection(true);
     reset_btn_pressed = false;
     reset_btn_long_pressed = false;
@@ -163,55 +256,49 @@ void loop()
     lcd_controller->updateLCDAutoState();
   }
   
+  reconnectProcess();
+  flushEvents();
   executeCommands();
+  sendStateChanges();
   sensorsSending();
 
+  if (isReconnecting()) return;
+
+  // Commands are cut out of the AT replies by link_buffers and run in executeCommands()
+  if (time_sync->isSyncDue()) time_return_wait = true;
   if (time_return_wait) {
     time_return_wait = false;
-    delay(100);
-    if (sendTimeRequestSignal()) {
-      delay(500);
-      executeCommands();
-    }
+    time_sync->requestSent(sendTimeRequestSignal());
   }
+#if CSTATION_FEATURE_LCD
   if ((millis() - last_forecast_uptime) > FORECAST_UPDATE_INTERVAL) {
 	  forecast_return_wait = true;
   }
   if (forecast_return_wait) {
     forecast_return_wait = false;
-    delay(100);
-    last_forecast_uptime = millis();
-    if (sendForecastRequestSignal()) {
-      delay(1200);
-      executeCommands();
-    }
+    last_forecast_uptime = forecast_request_millis = millis();
+    if (!sendForecastRequestSignal(forecast_shown ? "#" + String(forecast_hash, HEX) : "1")) forecast_request_millis = 0;
   }
+#endif
 }
 
 void ControlBTN_Rising() 
 {
+  PROFILE_FUNCTION(PROF_BUTTON_ISR);
   if (digitalRead(CONTROL_BTN_PIN) == HIGH) {
     if (!reset_btn_pressed) reset_btn_pressed = digitalRead(RESET_BTN_PIN) == HIGH;
+#if CSTATION_FEATURE_CONFIG_MODE
     if (!config_btn_pressed) config_btn_pressed = digitalRead(CONFIG_BTN_PIN) == HIGH;
+#endif
     if (!signal_btn_pressed) signal_btn_pressed = digitalRead(SIGNAL_BTN_PIN) == HIGH;
     signal_btn_sended = !signal_btn_pressed;
+    if (signal_btn_pressed) event_queue->post(EVENT_BUTTON);
   }
 }
 
 bool sendControlsInfo(unsigned connection_id)
 {
-  char* reply;
-  bool rok;
-  char bufr[256];
-
-  for(byte i=0; i<controls_count; i++) {
-    strlcpy_P(bufr, (char*)pgm_read_word(&(controls_list[i])), 256);
-    reply = sendMessage(connection_id, bufr, MAX_ATTEMPTS);
-    rok = StringHelper::replyIsOK(reply);
-    if (!rok) return rok;
-  }
-
-  return rok;
+  return sendMessageList(connection_id, Descriptors::composeControlInfo, CONTROLS_COUNT);
 }
 
 unsigned long getState(StateQueryCode state_code)
@@ -221,123 +308,293 @@ unsigned long getState(StateQueryCode state_code)
     case STATE_TONE:     return tone_controller->isToneRunning();
     case STATE_FAN:      return ind_controller->getFanState();
     case STATE_LIGHTG4:  return ind_controller->getLightG4State();
+    case STATE_ALARM_HOUR:   return lcd_controller->getAlarmHour();
+    case STATE_BEEP_HOURLY:  return lcd_controller->getHourlyBeep();
+    case STATE_TIME:         return now();
+    case STATE_TIME_STATUS:  return time_sync->getStatus();
   }
   return 0;
 }
 
-void executeInputMessage(char *input_message)
+// Appends "KEY":"value" to a DS_DIAG={...} part, the key is a PSTR()
+void appendDiagField(char* buffer, unsigned size, const char* key, const char* value)
 {
-  char *messages;
-  unsigned connection_id = 0;
-  messages = readTCPMessage( 1000, &connection_id, true, input_message);
+  if (buffer[strlen(buffer)-1] != '{') strlcat(buffer, ", ", size);
+  strlcat(buffer, "\"", size);
+  strlcat_P(buffer, key, size);
+  strlcat(buffer, "\":\"", size);
+  strlcat(buffer, value, size);
+  strlcat(buffer, "\"", size);
+}
 
+void appendDiagField(char* buffer, unsigned size, const char* key, unsigned long value)
+{
+  char digits[12];
+  appendDiagField(buffer, size, key, ultoa(value, digits, DEC));
+}
+
+// MessageComposer for the DIAG_REQUEST reply: the counters go out in several
+// DS_DIAG={...} parts, each small enough for one send window buffer
+void composeDiagnostics(byte index, char* buffer, unsigned size)
+{
+  char digits[12];
+  strlcpy_P(buffer, PSTR("DS_DIAG={"), size);
+  switch(index) {
+    case DIAG_LINK:
+      appendDiagField(buffer, size, PSTR("UART_BAUD"), getESPBaudRate());
+      appendDiagField(buffer, size, PSTR("SEND_BURST"), getSendBurstRate());
+      appendDiagField(buffer, size, PSTR("RECONNECT_MS"), getReconnectDuration());
+      appendDiagField(buffer, size, PSTR("BOOT_LINK_MS"), getBootLinkMillis());
+      appendDiagField(buffer, size, PSTR("BOOT_TELEMETRY_MS"), getBootTelemetryMillis());
+      appendDiagField(buffer, size, PSTR("CMD_PER_SEC"), getCommandsRate());
+      break;
+    case DIAG_TIME:
+      appendDiagField(buffer, size, PSTR("TIME_RESPONSE_MS"), time_sync->getRoundTrip());
+      appendDiagField(buffer, size, PSTR("TIME_DRIFT_PPM"), FixedPoint(time_sync->getDriftPPB(), 3).toString(1).c_str());
+      appendDiagField(buffer, size, PSTR("TIME_ERROR_MS"), ltoa(time_sync->getLastError(), digits, DEC));
+#if CSTATION_FEATURE_LCD
+      appendDiagField(buffer, size, PSTR("FORECAST_RESPONSE_MS"), forecast_response_ms);
+      appendDiagField(buffer, size, PSTR("FORECAST_UNCHANGED"), forecast_unchanged_count);
+#endif
+      appendDiagField(buffer, size, PSTR("TIMER_TICK_MAX_US"), soft_timers->getTickMaxMicros());
+      appendDiagField(buffer, size, PSTR("TIMER_CALLBACKS"), soft_timers->getCallbacksCount());
+      break;
+    case DIAG_EVENTS:
+      appendDiagField(buffer, size, PSTR("EVENT_LATENCY_MS"), event_queue->getLastLatency());
+      appendDiagField(buffer, size, PSTR("EVENT_LATENCY_MAX_MS"), event_queue->getMaxLatency());
+      appendDiagField(buffer, size, PSTR("EVENTS_LATE"), event_queue->getLateCount());
+      appendDiagField(buffer, size, PSTR("EVENTS_DROPPED"), event_queue->getDroppedCount());
+      appendDiagField(buffer, size, PSTR("TWI_JOBS"), twi_queue->getJobsCount());
+      appendDiagField(buffer, size, PSTR("TWI_ERRORS"), twi_queue->getErrorsCount());
+      break;
+    case DIAG_SENSORS:
+      appendDiagField(buffer, size, PSTR("NOISE_RATE"), getNoiseRate());
+      appendDiagField(buffer, size, PSTR("NOISE_MASKED"), getNoiseMasked());
+      appendDiagField(buffer, size, PSTR("NOISE_HIST"), getNoiseHistogram().c_str());
+      appendDiagField(buffer, size, PSTR("SENSORS_OFFLINE"), ultoa(getOfflineSensors(), digits, HEX));
+#if CSTATION_FEATURE_MAGNETOMETER
+      appendDiagField(buffer, size, PSTR("MAG_SAMPLES"), getMagneticSamples());
+      appendDiagField(buffer, size, PSTR("MAG_OVERRUNS"), getMagneticOverruns());
+      appendDiagField(buffer, size, PSTR("MAG_ANOMALIES"), getMagneticAnomalies());
+#endif
+      break;
+    case DIAG_TELEMETRY:
+      appendDiagField(buffer, size, PSTR("LINK_FRAMES"), link_buffers->getFramesCount());
+      appendDiagField(buffer, size, PSTR("LINK_DROPPED"), link_buffers->getDroppedCount());
+      appendDiagField(buffer, size, PSTR("LINK_OVERSIZED"), link_buffers->getOversizedCount());
+      appendDiagField(buffer, size, PSTR("LINK_QUEUE_MAX"), link_buffers->getQueueMax());
+      appendDiagField(buffer, size, PSTR("TELEMETRY_FORMAT"), isTelemetryBinary() ? "B" : "T");
+      appendDiagField(buffer, size, PSTR("TELEMETRY_BYTES"), getTelemetryBytes());
+      appendDiagField(buffer, size, PSTR("TELEMETRY_SEND_MS"), getTelemetrySendMillis());
+      break;
+    case DIAG_RUNTIME:
+      appendDiagField(buffer, size, PSTR("IDLE_PERCENT"), sleep_controller->getIdlePercent());
+      appendDiagField(buffer, size, PSTR("IDLE_WAKES"), sleep_controller->getWakesCount());
+      appendDiagField(buffer, size, PSTR("IDLE_EARLY_WAKES"), sleep_controller->getEarlyWakesCount());
+      appendDiagField(buffer, size, PSTR("STATE_PUSHES"), state_publisher->getPushesCount());
+      appendDiagField(buffer, size, PSTR("STATE_PUSH_FIELDS"), state_publisher->getPushedFieldsCount());
+      break;
+    case DIAG_RULES:
+      appendDiagField(buffer, size, PSTR("RULES_COUNT"), rule_engine->getRulesCount());
+      appendDiagField(buffer, size, PSTR("RULES_STATUS"), rule_engine->getStatus());
+      appendDiagField(buffer, size, PSTR("RULES_FIRED"), rule_engine->getFiredCount());
+      appendDiagField(buffer, size, PSTR("RULES_EVAL_MAX_US"), rule_engine->getEvalMaxMicros());
+      break;
+  }
+  strlcat(buffer, "}", size);
+}
+
+void executeInputMessage(char *messages, unsigned connection_id)
+{
+  PROFILE_FUNCTION(PROF_EXECUTE_INPUT);
   if (messages && !config_btn_pressed && !reset_btn_pressed && !reset_btn_long_pressed) {
-    DEBUG_WRITELN("Query found. Executing...");
+    LOG_DEBUG(LOG_QUERY, connection_id, strlen(messages));
     char* param;
     char* message;
     char* fpos = messages-1;
 
     do {
+      unsigned long int command_start = micros();
       message = fpos + 1;
       fpos = (char*) memchr(message, '\n', strlen(message));
       if (fpos != NULL) *fpos = 0;
 
-      if ((param = StringHelper::getMessageParam(message, "SERV_RST=1", true))) 
-      {
-        StartConnection(true);
-        reset_btn_pressed = false;
-        reset_btn_long_pressed = false;
-        config_btn_pressed = false;
-        delay(1000);
-      } else if ((param = StringHelper::getMessageParam(message, "SERV_CONF=1", true))) {
-        StartConfiguringMode();
-        reset_btn_pressed = false;
-        reset_btn_long_pressed = false;
-        config_btn_pressed = false;
-        delay(1000);
-      } else if ((param = StringHelper::getMessageParam(message, "STATES_REQUEST=1", true))) {
-        String states_str = "DS_STATE={";
-        states_str = states_str + "\"LED\":\""+(getState(STATE_LED) ? "on" : "off")+"\", ";
-        states_str = states_str + "\"TONE\":\""+(getState(STATE_TONE) ? "on" : "off")+"\", ";
-        states_str = states_str + "\"FAN\":\""+(getState(STATE_FAN) ? "on" : "off")+"\", ";
-        states_str = states_str + "\"G4_LIGHT\":\""+(getState(STATE_LIGHTG4) ? "on" : "off")+"\", ";
-        states_str = states_str + "\"ALARM_HOUR\":\""+String(lcd_controller->getAlarmHour())+"\", ";
-        states_str = states_str + "\"BEEP_HOURLY\":\""+(lcd_controller->getHourlyBeep() ? "on" : "off")+"\", ";
-        states_str = states_str + "\"TIME\":\""+String(now())+"\", ";
-        states_str = states_str + "\"SYNC_INTERVAL\":\""+String(TIME_SYNC_INTERVAL)+"\", ";
-        states_str = states_str + "\"SENDING_INTERVAL\":\""+String(SENDING_INTERVAL)+"\", ";
-        states_str = states_str + "\"ERROR_CHECK_INTERVAL\":\""+String(ERROR_CHECK_INTERVAL)+"\", ";
-        states_str = states_str + "\"TIME_STATUS\":\""+String(timeStatus())+"\"";
-        states_str += "}";
-        delay(50);
-        sendMessage(connection_id, states_str, MAX_ATTEMPTS);
-        delay(100);
-      } else if ((param = StringHelper::getMessageParam(message, "LED_SET=", true))) {
-        byte led_s = StringHelper::readIntFromString(param, 0);
-        tone_controller->setLedControl(false);
-        if (led_s) {
-          ind_controller->SetProgLedState(1);
-        } else {
-          ind_controller->SetProgLedState(0);
-        }
-      } else if ((param = StringHelper::getMessageParam(message, "TONE=", true))) {
-        tone_controller->RunCommand(param);
-      } else if ((param = StringHelper::getMessageParam(message, "MEL=", true))) {
-        tone_controller->RunMelodyCommand(param);
-      } else if ((param = StringHelper::getMessageParam(message, "SERV_LT=", true))) {
-        if (param[0]) {
-          lcd_controller->setLCDText(param, LCD_PAGE_OUTER);
-          lcd_controller->fixPage(LCD_PAGE_OUTER);
-        } else {
-          lcd_controller->unfixPage();
-          lcd_controller->clearLCDText(LCD_PAGE_OUTER);
-        }
-      } else if ((param = StringHelper::getMessageParam(message, "SET_DISPLAY_ST=", true))) {
-        byte new_d_state = StringHelper::readIntFromString(param, 0);
-        if (new_d_state<2) lcd_controller->setLCDState(new_d_state!=0); else lcd_controller->setLCDAutoState();
-      } else if ((param = StringHelper::getMessageParam(message, "SET_FAN_ST=", true))) {
-        byte new_d_state = StringHelper::readIntFromString(param, 0);
-        if (new_d_state<2) ind_controller->setFanState(new_d_state!=0); else ind_controller->setFanAutoState();
-      } else if ((param = StringHelper::getMessageParam(message, "SET_LIGHT_ST=", true))) {
-        byte new_d_state = StringHelper::readIntFromString(param, 0);
-        if (new_d_state<2) ind_controller->setLightG4State(new_d_state!=0); else ind_controller->setLightG4AutoState();
-      } else if ((param = StringHelper::getMessageParam(message, "SET_TIME=", true))) {
-        if (param[0]=='R') {
-          time_return_wait = true;
-        } else {
-          time_t timestamp = StringHelper::readIntFromString(param, 0);
-          setTime(timestamp);
-          lcd_controller->redrawTimePage();
-        }
-      }  else if ((param = StringHelper::getMessageParam(message, "SET_FORECAST=", true))) {
-        if (param[0]=='R') {
-          forecast_return_wait = true;
-        } else {
-          StringHelper::degStrConvert(param);
-          lcd_controller->setLCDText(param, LCD_PAGE_FORECAST);
-        }
-      } else if ((param = StringHelper::getMessageParam(message, "SET_ALARM=", true))) {
-        bool b0 = param[0]=='1';
-        bool b1 = false;
-        unsigned b2 = 255;
-        if (param[1]==',') param+=2;
-        b1 = param[0]=='1';
-        if (param[1]==',') param+=2;
-        b2 = StringHelper::readIntFromString(param, 0);
-        lcd_controller->setHourlyBeep(b0);
-        if (b1) lcd_controller->setAlarmHour(b2);
+      switch (Descriptors::findControl(message, &param)) {
+        case CONTROL_RESET:
+          if (param[0]!='1') break;
+          requestReconnect();
+          reset_btn_pressed = false;
+          reset_btn_long_pressed = false;
+          config_btn_pressed = false;
+          break;
+#if CSTATION_FEATURE_CONFIG_MODE
+        case CONTROL_CONFIG:
+          if (param[0]!='1') break;
+          StartConfiguringMode();
+          reset_btn_pressed = false;
+          reset_btn_long_pressed = false;
+          config_btn_pressed = false;
+          break;
+#endif
+        case CONTROL_STATE:
+          if (param[0]!='1') break;
+          {
+            String states_str = F("DS_STATE={");
+            states_str += StatePublisher::composeFields(STATE_FIELDS_ALL);
+            states_str += F(", \"SYNC_INTERVAL\":\"");
+            states_str += String(time_sync->getInterval());
+            states_str += F("\", \"SENDING_INTERVAL\":\"");
+            states_str += String(SENDING_INTERVAL);
+            states_str += F("\", \"ERROR_CHECK_INTERVAL\":\"");
+            states_str += String(ERROR_CHECK_INTERVAL);
+            states_str += F("\"}");
+            sendMessage(connection_id, states_str, MAX_ATTEMPTS);
+          }
+          break;
+        case CONTROL_DIAGNOSTICS:
+          if (param[0]!='1') break;
+          sendMessageList(connection_id, composeDiagnostics, DIAG_PARTS_COUNT);
+          break;
+        case CONTROL_LED:
+          {
+            byte led_s = StringHelper::readIntFromString(param, 0);
+            tone_controller->setLedControl(false);
+            if (led_s) {
+              ind_controller->SetProgLedState(1);
+            } else {
+              ind_controller->SetProgLedState(0);
+            }
+          }
+          break;
+#if CSTATION_FEATURE_BUZZER
+        case CONTROL_TONE:
+          tone_controller->RunCommand(param);
+          break;
+        case CONTROL_MELODY:
+          tone_controller->RunMelodyCommand(param);
+          break;
+#endif
+        case CONTROL_RULES:
+          rule_engine->RunCommand(param);
+          break;
+#if CSTATION_FEATURE_LCD
+        case CONTROL_LCD_TEXT:
+          if (param[0]) {
+            lcd_controller->setLCDText(param, LCD_PAGE_OUTER);
+            lcd_controller->fixPage(LCD_PAGE_OUTER);
+          } else {
+            lcd_controller->unfixPage();
+            lcd_controller->clearLCDText(LCD_PAGE_OUTER);
+          }
+          break;
+        case CONTROL_DISPLAY_STATE:
+          {
+            byte new_d_state = StringHelper::readIntFromString(param, 0);
+            if (new_d_state<2) lcd_controller->setLCDState(new_d_state!=0); else lcd_controller->setLCDAutoState();
+          }
+          break;
+#endif
+        case CONTROL_FAN_STATE:
+          {
+            byte new_d_state = StringHelper::readIntFromString(param, 0);
+            if (new_d_state<2) ind_controller->setFanState(new_d_state!=0); else ind_controller->setFanAutoState();
+          }
+          break;
+        case CONTROL_LIGHT_STATE:
+          {
+            byte new_d_state = StringHelper::readIntFromString(param, 0);
+            if (new_d_state<2) ind_controller->setLightG4State(new_d_state!=0); else ind_controller->setLightG4AutoState();
+          }
+          break;
+        case CONTROL_SET_TIME:
+          if (param[0]=='R') {
+            time_return_wait = true;
+          } else {
+            time_t timestamp = StringHelper::readIntFromString(param, 0);
+            time_sync->setServerTime(timestamp, TimeSyncController::readMillisFraction(param));
+            lcd_controller->redrawTimePage();
+            state_publisher->markDirty(STATE_TIME);
+          }
+          break;
+#if CSTATION_FEATURE_LCD
+        case CONTROL_SET_FORECAST:
+          if (param[0]=='R') {
+            forecast_return_wait = true;
+          } else {
+            if (forecast_request_millis) {
+              forecast_response_ms = millis() - forecast_request_millis;
+              forecast_request_millis = 0;
+            }
+            if (param[0]=='#') {
+              // Not modified: the hash of the forecast already on the page
+              if (forecast_shown && strtoul(param+1, NULL, 16) == forecast_hash) forecast_unchanged_count++;
+              break;
+            }
+            forecast_hash = StringHelper::crc16(param);
+            forecast_shown = true;
+            StringHelper::degStrConvert(param);
+            lcd_controller->setLCDText(param, LCD_PAGE_FORECAST);
+          }
+          break;
+        case CONTROL_ALARM_MODE:
+          {
+            bool b0 = param[0]=='1';
+            bool b1 = false;
+            unsigned b2 = 255;
+            if (param[1]==',') param+=2;
+            b1 = param[0]=='1';
+            if (param[1]==',') param+=2;
+            b2 = StringHelper::readIntFromString(param, 0);
+            lcd_controller->setHourlyBeep(b0);
+            if (b1) lcd_controller->setAlarmHour(b2);
+          }
+          break;
+#endif
+        case CONTROL_SET_FORMAT:
+          setTelemetryFormat(param[0]=='1');
+          break;
+        case CONTROL_STATE_SUBSCRIBE:
+          state_publisher->subscribe(param[0]=='1');
+          break;
+        default:
+          break;
       }
-      delay (100);
+      commands_count++;
+      commands_micros += micros() - command_start;
 
     } while (fpos != NULL && strlen(fpos+1) > 0);
   }
 }
 
+unsigned long getCommandsRate()
+{
+  if (!commands_count || !commands_micros) return 0;
+  return 1000000UL / (commands_micros / commands_count + 1);
+}
+
 void executeCommands() 
 {
-  executeInputMessage(NULL);
+  // Commands are only queued by getReply(), they run here one link buffer at a time
+  unsigned connection_id = 0;
+  char* messages;
+  for(byte i=0; i<LINK_BUFFERS_COUNT && (messages = readTCPMessage( 1000, &connection_id )); i++) {
+    executeInputMessage(messages, connection_id);
+    link_buffers->release(messages);
+  }
 }
 
+ISR(TWI_vect)
+{
+  twi_queue->interruptHandler();
+}
+
+#if CSTATION_LOG_LEVEL > LOG_LEVEL_NONE
+ISR(USART0_UDRE_vect)
+{
+  DebugLog::interruptHandler();
+}
+#endif
+
 void ON_PresenceDetected()
 {
   need_auto_state_lcd_update = true;
@@ -0,0 +1,107 @@
+#ifndef BH1750_SENSOR_H
+#define BH1750_SENSOR_H
+
+#define BH1750_ADDR 0x23
+
+#define BH1750_POWER_ON 0x01
+#define BH1750_CONTINUOUS_HIGH_RES_MODE 0x10
+
+// The sensor converts continuously, a sample is one result read on the bus, ms
+#define BH1750_SAMPLE_LATENCY 10
+// First high resolution conversion after the mode is set, ms
+#define BH1750_CONVERSION_TIME 180
+
+// BH1750 light meter in continuous high resolution mode on the TWI queue,
+// the last result is read on sample()
+class BH1750Sensor
+{
+  private:
+    TWIJob job;
+    byte command;
+    byte data[2];
+    bool sample_pending;
+    bool has_value;
+    uint16_t level;
+    unsigned long mode_millis;
+
+  public:
+    BH1750Sensor()
+    {
+      job.status = TWI_JOB_IDLE;
+      sample_pending = false;
+      has_value = false;
+      level = 0;
+      mode_millis = 0;
+    }
+
+    bool isConverting()
+    {
+      return millis() - mode_millis < BH1750_CONVERSION_TIME;
+    }
+
+    bool begin()
+    {
+      job.address = BH1750_ADDR;
+      job.write_data = &command;
+      job.write_length = 1;
+      job.read_data = data;
+      job.read_length = 0;
+      job.callback = NULL;
+      job.context = NULL;
+      command = BH1750_POWER_ON;
+      if (!twi_queue->execute(&job, TWI_PRIORITY_HIGH)) return false;
+      command = BH1750_CONTINUOUS_HIGH_RES_MODE;
+      if (!twi_queue->execute(&job, TWI_PRIORITY_HIGH)) return false;
+      // Reads only from now on, the DONE of the mode command is no result
+      job.write_length = 0;
+      job.read_length = 2;
+      job.status = TWI_JOB_IDLE;
+      mode_millis = millis();
+      return true;
+    }
+
+    // ms until process() has something to do
+    unsigned long idleTime()
+    {
+      if (!job.read_length) return SLEEP_IDLE_MAX;
+      if (!twi_queue->isBusy(&job) && job.status == TWI_JOB_DONE) return 0;
+      if (!sample_pending) return SLEEP_IDLE_MAX;
+      return isConverting() ? SleepController::remaining(mode_millis, BH1750_CONVERSION_TIME) : 0;
+    }
+
+    void sample()
+    {
+      sample_pending = true;
+    }
+
+    // True when a new result was read
+    bool process()
+    {
+      if (twi_queue->isBusy(&job) || !job.read_length) return false;
+      bool updated = job.status == TWI_JOB_DONE;
+      if (updated) {
+        // Counts to lux: raw/1.2
+        level = (((uint16_t)data[0]<<8 | data[1]) * 5UL) / 6;
+        has_value = true;
+        job.status = TWI_JOB_IDLE;
+      }
+      // Nothing to read before the first conversion is over
+      if (sample_pending && !isConverting() && twi_queue->submit(&job, TWI_PRIORITY_HIGH)) {
+        sample_pending = false;
+      }
+      return updated;
+    }
+
+    bool hasValue()
+    {
+      return has_value;
+    }
+
+    // Illuminance in lux
+    uint16_t readLightLevel()
+    {
+      return level;
+    }
+};
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef BMP180_SENSOR_H
+#define BMP180_SENSOR_H
+
+#define BMP180_ADDR 0x77
+
+#define BMP180_REG_CALIBRATION 0xAA
+#define BMP180_REG_CONTROL 0xF4
+#define BMP180_REG_RESULT 0xF6
+
+#define BMP180_COMMAND_TEMPERATURE 0x2E
+#define BMP180_COMMAND_PRESSURE 0x34
+
+#define BMP180_OVERSAMPLING 3
+#define BMP180_VALUE_MAX_AGE 20000
+// From sample() to a new value: both conversions and their bus jobs, ms
+#define BMP180_SAMPLE_LATENCY 40
+
+#define BMP180_STATE_IDLE 0
+#define BMP180_STATE_TEMPERATURE 1
+#define BMP180_STATE_TEMPERATURE_READ 2
+#define BMP180_STATE_PRESSURE 3
+#define BMP180_STATE_PRESSURE_READ 4
+
+// BMP180 driver with the integer compensation from the datasheet (no float math).
+// A conversion starts on sample() and runs in the background on the TWI queue,
+// process() is called from loop().
+class BMP180Sensor
+{
+  private:
+    int16_t AC1, AC2, AC3, VB1, VB2, MB, MC, MD;
+    uint16_t AC4, AC5, AC6;
+    long B5;
+
+    TWIJob job;
+    byte command[2];
+    byte data[22];
+    byte state;
+    unsigned long int state_millis;
+    bool sample_pending;
+
+    bool has_value;
+    unsigned long int value_millis;
+    long temperature;
+    long pressure;
+
+    void setJob(const byte* write_data, byte write_length, byte read_length)
+    {
+      job.address = BMP180_ADDR;
+      job.write_data = write_data;
+      job.write_length = write_length;
+      job.read_data = data;
+      job.read_length = read_length;
+      job.callback = NULL;
+      job.context = NULL;
+    }
+
+    bool submitCommand(byte value)
+    {
+      command[0] = BMP180_REG_CONTROL;
+      command[1] = value;
+      setJob(command, 2, 0);
+      return twi_queue->submit(&job, TWI_PRIORITY_HIGH);
+    }
+
+    bool submitRead(byte length)
+    {
+      command[0] = BMP180_REG_RESULT;
+      setJob(command, 1, length);
+      return twi_queue->submit(&job, TWI_PRIORITY_HIGH);
+    }
+
+    void nextState(byte next_state)
+    {
+      state = next_state;
+      state_millis = millis();
+    }
+
+    // Temperature in 0.01 degC
+    long computeTemperature(long UT)
+    {
+      long X1 = ((UT - AC6) * AC5) >> 15;
+      long X2 = ((long)MC << 11) / (X1 + MD);
+      B5 = X1 + X2;
+      return (B5 * 10 + 8) >> 4;
+    }
+
+    // Pressure in Pa, needs a preceding computeTemperature()
+    long computePressure(long UP, byte oss)
+    {
+      long B6 = B5 - 4000;
+      long X1 = (VB2 * ((B6 * B6) >> 12)) >> 11;
+      long X2 = (AC2 * B6) >> 11;
+      long X3 = X1 + X2;
+      long B3 = ((((long)AC1 * 4 + X3) << oss) + 2) >> 2;
+      X1 = (AC3 * B6) >> 13;
+      X2 = (VB1 * ((B6 * B6) >> 12)) >> 16;
+      X3 = ((X1 + X2) + 2) >> 2;
+      unsigned long B4 = ((unsigned long)AC4 * (unsigned long)(X3 + 32768)) >> 15;
+      unsigned long B7 = ((unsigned long)UP - B3) * (50000 >> oss);
+      long p = B7 < 0x80000000 ? (B7 * 2) / B4 : (B7 / B4) * 2;
+      X1 = (p >> 8) * (p >> 8);
+      X1 = (X1 * 3038) >> 16;
+      X2 = (-7357 * p) >> 16;
+      return p + ((X1 + X2 + 3791) >> 4);
+    }
+
+  public:
+    BMP180Sensor()
+    {
+      B5 = 0;
+      job.status = TWI_JOB_IDLE;
+      state = BMP180_STATE_IDLE;
+      state_millis = 0;
+      sample_pending = false;
+      has_value = false;
+      value_millis = 0;
+      temperature = 0;
+      pressure = 0;
+    }
+
+    bool begin()
+    {
+      command[0] = BMP180_REG_CALIBRATION;
+      setJob(command, 1, 22);
+      if (!twi_queue->execute(&job, TWI_PRIORITY_HIGH)) return false;
+      AC1 = (data[0]<<8) | data[1];
+      AC2 = (data[2]<<8) | data[3];
+      AC3 = (data[4]<<8) | data[5];
+      AC4 = (data[6]<<8) | data[7];
+      AC5 = (data[8]<<8) | data[9];
+      AC6 = (data[10]<<8) | data[11];
+      VB1 = (data[12]<<8) | data[13];
+      VB2 = (data[14]<<8) | data[15];
+      MB = (data[16]<<8) | data[17];
+      MC = (data[18]<<8) | data[19];
+      MD = (data[20]<<8) | data[21];
+      return true;
+    }
+
+    // ms until process() has something to do, finished bus jobs wake loop() anyway
+    unsigned long idleTime()
+    {
+      if (twi_queue->isBusy(&job)) return SLEEP_IDLE_MAX;
+      switch(state) {
+        case BMP180_STATE_IDLE:
+          return sample_pending ? 0 : SLEEP_IDLE_MAX;
+        case BMP180_STATE_TEMPERATURE:
+          return SleepController::remaining(state_millis, 5);
+        case BMP180_STATE_PRESSURE:
+          return SleepController::remaining(state_millis, 26);
+      }
+      return 0;
+    }
+
+    // Temperature and pressure conversion, started by the next process()
+    void sample()
+    {
+      sample_pending = true;
+    }
+
+    void process()
+    {
+      if (twi_queue->isBusy(&job)) return;
+      if (state != BMP180_STATE_IDLE && job.status == TWI_JOB_ERROR) {
+        nextState(BMP180_STATE_IDLE);
+        return;
+      }
+      unsigned long int elapsed = millis() - state_millis;
+      switch(state) {
+        case BMP180_STATE_IDLE:
+          if (sample_pending && submitCommand(BMP180_COMMAND_TEMPERATURE)) {
+            sample_pending = false;
+            nextState(BMP180_STATE_TEMPERATURE);
+          }
+          break;
+        case BMP180_STATE_TEMPERATURE:
+          if (elapsed >= 5 && submitRead(2)) nextState(BMP180_STATE_TEMPERATURE_READ);
+          break;
+        case BMP180_STATE_TEMPERATURE_READ:
+          temperature = computeTemperature(((unsigned)data[0]<<8) | data[1]);
+          if (submitCommand(BMP180_COMMAND_PRESSURE + (BMP180_OVERSAMPLING<<6))) {
+            nextState(BMP180_STATE_PRESSURE);
+          }
+          break;
+        case BMP180_STATE_PRESSURE:
+          // Conversion time for oversampling 3
+          if (elapsed >= 26 && submitRead(3)) nextState(BMP180_STATE_PRESSURE_READ);
+          break;
+        case BMP180_STATE_PRESSURE_READ:
+          pressure = computePressure((((unsigned long)data[0]<<16) | ((unsigned long)data[1]<<8) | data[2]) >> (8 - BMP180_OVERSAMPLING), BMP180_OVERSAMPLING);
+          has_value = true;
+          value_millis = millis();
+          nextState(BMP180_STATE_IDLE);
+          break;
+      }
+    }
+
+    bool hasValue()
+    {
+      return has_value;
+    }
+
+    bool isFresh()
+    {
+      return has_value && millis() - value_millis < BMP180_VALUE_MAX_AGE;
+    }
+
+    // Temperature in 0.01 degC
+    long getTemperature()
+    {
+      return temperature;
+    }
+
+    // Pressure in Pa
+    long getPressure()
+    {
+      return pressure;
+    }
+
+    // mmHg*1000 from Pa, rounded: P*7.50063755 = (P*15 + P*0.0012751)/2
+    static long toMillimetersHg(long P)
+    {
+      return (P * 15 + (P * 12751) / 10000000 + 1) >> 1;
+    }
+};
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef DEBUG_LOG_H
+#define DEBUG_LOG_H
+
+// Tokenized log on Serial (USART0), decoded on the host by
+// tools/debug_log/log_decode.py. A call only packs the message id, millis()
+// and its numeric arguments into a ring buffer, the UART data register empty
+// interrupt sends it out, so logging costs a few us instead of the ms a
+// printed line takes at the UART speed. Record layout:
+//   sync     0xA5
+//   id       index in LOG_MESSAGES
+//   length   level << 5 | bytes after this one
+//   time     millis(), 4 bytes little endian
+//   args     one zigzag varint per argument, as many as the format has
+// Records that do not fit are dropped and counted, LOG_DROPPED reports them
+// once there is room again. Calls below CSTATION_LOG_LEVEL are compiled out.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#define LOG_BAUD_RATE 115200
+// Power of two up to 256, indices wrap as bytes
+#define LOG_BUFFER_SIZE 256
+#define LOG_RECORD_SYNC 0xA5
+#define LOG_ARGS_MAX 3
+
+// X(id, printf format with integer conversions only)
+#define LOG_MESSAGES(X) \
+  X(LOG_DROPPED,             "%u log records dropped") \
+  X(LOG_STARTING,            "Starting...") \
+  X(LOG_CONFIG_BUTTON,       "Config BTN pressed. Entering configuration mode") \
+  X(LOG_RESET_BUTTON,        "Reset initiated. Resetting...") \
+  X(LOG_QUERY,               "Query from link %u, %u bytes. Executing...") \
+  X(LOG_CONFIG_MODE,         "Starting configuration mode") \
+  X(LOG_MODULE_RESET,        "Reset the module") \
+  X(LOG_HOST_MODE,           "Change to host mode") \
+  X(LOG_HOST_NETWORK,        "Configuring a network") \
+  X(LOG_NETWORK_CONNECT,     "Connect to a network") \
+  X(LOG_HOST_IP,             "Get ip address of the esp") \
+  X(LOG_MULTIPLE_CONNECTIONS,"Set for multiple connections") \
+  X(LOG_SERVER_RETRY,        "Can't start the server. Let's try again") \
+  X(LOG_CONFIG_WAITING,      "Waiting for the configuration programm at the wifi-host") \
+  X(LOG_SETUP_SSID,          "SSID written to EEPROM, %u chars") \
+  X(LOG_SETUP_PASSW,         "PASSW written to EEPROM, %u chars") \
+  X(LOG_SETUP_SERVER,        "Server address written to EEPROM, %u chars") \
+  X(LOG_SETUP_STATION,       "Station ID written to EEPROM: %u") \
+  X(LOG_SETUP_I2C,           "I2C addr written to EEPROM: %u") \
+  X(LOG_NEED_SETUP,          "Need to set SSID, password and server ip") \
+  X(LOG_CONNECT_RETRY,       "Can't connect to server. Let's try again") \
+  X(LOG_CONNECTED,           "Connected successfully!") \
+  X(LOG_CLIENT_MODE,         "Change to client mode") \
+  X(LOG_CLIENT_IP,           "Get ip address assigned by the router") \
+  X(LOG_CONNECTIONS_MODE,    "Set the connections mode") \
+  X(LOG_SERVER_CONNECT,      "Connect to the server") \
+  X(LOG_PASSTHROUGH_RETRY,   "Can't enter passthrough mode. Let's try again") \
+  X(LOG_SEND_ID,             "Send identification Number") \
+  X(LOG_SEND_SENSORS,        "Send sensors info") \
+  X(LOG_SEND_CONTROLS,       "Send controls info") \
+  X(LOG_RECONNECT,           "Reconnect requested") \
+  X(LOG_LINK_STATUS,         "Link status: %u") \
+  X(LOG_RECONNECTED,         "Reconnected in %u ms") \
+  X(LOG_PASSTHROUGH_ON,      "Passthrough mode started") \
+  X(LOG_PASSTHROUGH_OFF,     "Leaving passthrough mode") \
+  X(LOG_PASSTHROUGH_CLOSED,  "Passthrough link closed by the module") \
+  X(LOG_BAUD_TRY,            "Trying UART speed %u") \
+  X(LOG_BAUD_SET,            "UART speed set to %u") \
+  X(LOG_BAUD_FALLBACK,       "Too much framing errors. Falling back to a lower UART speed") \
+  X(LOG_SERVER_START,        "Start the server") \
+  X(LOG_SERVER_CLOSE,        "Closing the server") \
+  X(LOG_SEND_MESSAGE,        "Sending to %u message of %u bytes") \
+  X(LOG_SEND_FRAME,          "Sending to %u frame of %u bytes") \
+  X(LOG_SEND_RETRY,          "Sending Error: Retry") \
+  X(LOG_SENDBUF_UNSUPPORTED, "AT+CIPSENDBUF is not supported") \
+  X(LOG_TCP_MESSAGE,         "TCP message from link %u, %u bytes") \
+  X(LOG_LINK_OVERSIZED,      "Frame from link %u dropped, %u bytes do not fit the buffer") \
+  X(LOG_REPLY_TOKEN,         "Reply token found after %u bytes") \
+  X(LOG_REPLY,               "Reply of %u bytes") \
+  X(LOG_BMP180_ERROR,        "Error with bmp180 connection") \
+  X(LOG_HMC5883L_ERROR,      "Error with HMC5883L connection") \
+  X(LOG_ERRORS_RECONNECT,    "Too much errors. Reconnecting...") \
+  X(LOG_FAN_NEXT,            "nextFanState: %d") \
+  X(LOG_FAN_CHANGED,         "FAN state changed. NFREQ: %d Timeout: %u") \
+  X(LOG_TONE_PERIOD,         "Tone timer period = %u") \
+  X(LOG_TONE_TIMER_STOP,     "Tone timer stopped") \
+  X(LOG_TONE_START,          "Starting tone. F=%u") \
+  X(LOG_TONE_START_REPEAT,   "Starting tone. F=%u P=%u R=%u") \
+  X(LOG_MELODY_START,        "Starting melody") \
+  X(LOG_TONE_STOP,           "Stopping tone") \
+  X(LOG_NETWORK_KEPT,        "Already on the network, join skipped") \
+  X(LOG_BOOT_TELEMETRY,      "First telemetry acknowledged %u ms after reset")
+
+#define LOG_MESSAGE_ENUM(id, format) id,
+enum LogMessage
+{
+  LOG_MESSAGES(LOG_MESSAGE_ENUM)
+  LOG_MESSAGES_COUNT
+};
+#undef LOG_MESSAGE_ENUM
+
+#if CSTATION_LOG_LEVEL > LOG_LEVEL_NONE
+
+class DebugLog
+{
+  private:
+    static byte buffer[LOG_BUFFER_SIZE];
+    static volatile byte head;
+    static volatile byte tail;
+    static unsigned dropped;
+
+    static byte putVarint(byte* data, byte pos, unsigned long value)
+    {
+      while (value >= 0x80) {
+        data[pos++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+      }
+      data[pos++] = value;
+      return pos;
+    }
+
+    static byte pack(byte* data, byte level, byte id, const long* args, byte argc)
+    {
+      unsigned long time = millis();
+      byte pos = 0;
+      data[pos++] = LOG_RECORD_SYNC;
+      data[pos++] = id;
+      pos++;
+      for(byte i=0; i<4; i++, time >>= 8) data[pos++] = time & 0xFF;
+      for(byte i=0; i<argc; i++) {
+        pos = putVarint(data, pos, ((unsigned long)args[i] << 1) ^ (unsigned long)(args[i] >> 31));
+      }
+      data[2] = (level << 5) | (pos - 3);
+      return pos;
+    }
+
+    // Called with interrupts disabled
+    static byte space()
+    {
+      return LOG_BUFFER_SIZE - 1 - (byte)(head - tail);
+    }
+
+    static bool put(const byte* data, byte length)
+    {
+      if (length > space()) return false;
+      for(byte i=0; i<length; i++) buffer[(byte)(head + i) % LOG_BUFFER_SIZE] = data[i];
+      head += length;
+      return true;
+    }
+
+    static void writeRecord(byte level, byte id, const long* args, byte argc)
+    {
+      byte record[3 + 4 + LOG_ARGS_MAX * 5];
+      byte length = pack(record, level, id, args, argc);
+      byte sreg = SREG;
+      cli();
+      if (dropped) {
+        // Only together with the record, so a full buffer does not fill up with notices
+        long count = dropped;
+        byte notice[3 + 4 + 5];
+        byte notice_length = pack(notice, LOG_LEVEL_WARN, LOG_DROPPED, &count, 1);
+        if (notice_length + length <= space()) {
+          put(notice, notice_length);
+          dropped = 0;
+        }
+      }
+      if (dropped || !put(record, length)) dropped++;
+      UCSR0B |= _BV(UDRIE0);
+      SREG = sreg;
+    }
+
+  public:
+    static void begin()
+    {
+      UCSR0A = _BV(U2X0);
+      UBRR0 = (F_CPU / 8 / LOG_BAUD_RATE) - 1;
+      UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+      UCSR0B = _BV(TXEN0);
+    }
+
+    // Safe from ISRs
+    static void write(byte level, byte id)
+    {
+      writeRecord(level, id, NULL, 0);
+    }
+    static void write(byte level, byte id, long a)
+    {
+      long args[] = {a};
+      writeRecord(level, id, args, 1);
+    }
+    static void write(byte level, byte id, long a, long b)
+    {
+      long args[] = {a, b};
+      writeRecord(level, id, args, 2);
+    }
+    static void write(byte level, byte id, long a, long b, long c)
+    {
+      long args[] = {a, b, c};
+      writeRecord(level, id, args, 3);
+    }
+
+    // USART0 data register empty: next byte out, interrupt off when the buffer is empty
+    static void interruptHandler()
+    {
+      if (head == tail) {
+        UCSR0B &= ~_BV(UDRIE0);
+        return;
+      }
+      UDR0 = buffer[tail % LOG_BUFFER_SIZE];
+      tail++;
+    }
+};
+
+byte DebugLog::buffer[LOG_BUFFER_SIZE];
+volatile byte DebugLog::head = 0;
+volatile byte DebugLog::tail = 0;
+unsigned DebugLog::dropped = 0;
+
+#define LOG_WRITE(level, ...) DebugLog::write(level, __VA_ARGS__)
+#endif
+
+#if CSTATION_LOG_LEVEL >= LOG_LEVEL_ERROR
+  #define LOG_ERROR(...) LOG_WRITE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+  #define LOG_ERROR(...) {}
+#endif
+#if CSTATION_LOG_LEVEL >= LOG_LEVEL_WARN
+  #define LOG_WARN(...) LOG_WRITE(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+  #define LOG_WARN(...) {}
+#endif
+#if CSTATION_LOG_LEVEL >= LOG_LEVEL_INFO
+  #define LOG_INFO(...) LOG_WRITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+  #define LOG_INFO(...) {}
+#endif
+#if CSTATION_LOG_LEVEL >= LOG_LEVEL_DEBUG
+  #define LOG_DEBUG(...) LOG_WRITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+  #define LOG_DEBUG(...) {}
+#endif
+
+#endif
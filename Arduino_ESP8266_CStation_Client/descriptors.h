@@ -0,0 +1,151 @@
+#ifndef DESCRIPTORS_H
+#define DESCRIPTORS_H
+
+// The one definition of the station sensors and controls. Descriptors
+// (DS_INFO/DC_INFO), telemetry field codes and command prefixes are all
+// generated from these tables. FEATURE_ROW() rows are left out of the builds
+// without that feature (feature_set.h), the ids after them move up.
+
+// X(id, code, decimals of the transmitted value, descriptor fields after CODE)
+#define SENSORS_TABLE(X) \
+  X(SENSOR_ACTIVITY,       "A", 0, "'NAME':'Activity','TIMEOUT':60,'TYPE':'ENUM','ENUMS':['off','on']") \
+  X(SENSOR_ERRORS,         "E", 0, "'NAME':'Errors','TYPE':'INT','MIN':0,'MAX':100000") \
+  X(SENSOR_TEMPERATURE,    "T", 2, "'NAME':'Temperature','TYPE':'FLOAT','MIN':-100,'MAX':100,'EM':'°C'") \
+  X(SENSOR_PRESSURE,       "P", 3, "'NAME':'Pressure','TYPE':'FLOAT','MIN':500,'MAX':1000,'EM':'mm'") \
+  X(SENSOR_HUMIDITY,       "H", 1, "'NAME':'Humidity','TYPE':'FLOAT','MIN':0,'MAX':100,'EM':'%'") \
+  X(SENSOR_ILLUMINANCE,    "L", 0, "'NAME':'Illuminance','TYPE':'FLOAT','MIN':0,'MAX':200000,'EM':'lux'") \
+  X(SENSOR_PRESENCE,       "R", 0, "'NAME':'Presence','TIMEOUT':10,'TYPE':'ENUM','ENUMS':['no','yes']") \
+  FEATURE_ROW(CSTATION_FEATURE_MAGNETOMETER, X(SENSOR_MAGNETIC_X,     "Mx", 0, "'NAME':'Magnetic field Vector X','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'")) \
+  FEATURE_ROW(CSTATION_FEATURE_MAGNETOMETER, X(SENSOR_MAGNETIC_Y,     "My", 0, "'NAME':'Magnetic field Vector Y','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'")) \
+  FEATURE_ROW(CSTATION_FEATURE_MAGNETOMETER, X(SENSOR_MAGNETIC_Z,     "Mz", 0, "'NAME':'Magnetic field Vector Z','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'")) \
+  X(SENSOR_NOISE,          "N", 0, "'NAME':'Noise','TIMEOUT':5,'TYPE':'ENUM','ENUMS':['no','yes']") \
+  X(SENSOR_OUTER_SIGNAL,   "O", 0, "'NAME':'Outer signal','TYPE':'ENUM','ENUMS':['no','yes']") \
+  X(SENSOR_SIGNAL_BUTTON,  "B", 0, "'NAME':'Signal button','TIMEOUT':5,'TYPE':'ENUM','ENUMS':['no','yes']") \
+  FEATURE_ROW(CSTATION_FEATURE_MAGNETOMETER, X(SENSOR_MAGNETIC_EVENT, "Ma", 0, "'NAME':'Magnetic anomaly','TIMEOUT':5,'TYPE':'ENUM','ENUMS':['no','yes']")) \
+  X(SENSOR_NOISE_LEVEL,    "NL", 0, "'NAME':'Noise level','TYPE':'INT','MIN':0,'MAX':100,'EM':'%'") \
+  X(SENSOR_BOOT_TIME,      "BT", 0, "'NAME':'Boot to telemetry','TYPE':'INT','MIN':0,'MAX':600000,'EM':'ms'")
+
+// X(id, code, command prefix, descriptor fields after PREFIX)
+#define CONTROLS_TABLE(X) \
+  FEATURE_ROW(CSTATION_FEATURE_BUZZER, X(CONTROL_TONE,            "tone", "TONE", "'PARAM':[{'NAME':'Led indication','SKIP':1,'VALUE':'L','TYPE':'BOOL'},{'NAME':'Frequency','TYPE':'UINT','DEFAULT':500},{'NAME':'Period','TYPE':'UINT'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['0']}]")) \
+  FEATURE_ROW(CSTATION_FEATURE_BUZZER, X(CONTROL_MELODY,          "melody", "MEL", "'PARAM':[{'NAME':'Write to buffer','SKIP':1,'VALUE':'B','TYPE':'BOOL'},{'NAME':'Code as index','SKIP':1,'VALUE':'I','TYPE':'BOOL'},{'NAME':'Code','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['0']}]")) \
+  X(CONTROL_LED,             "led", "LED_SET", "'PARAM':[{'NAME':'Led state','TYPE':'BOOL'}]") \
+  X(CONTROL_STATE,           "state", "STATES_REQUEST", "'LISTEN':1,'PARAM':[{'VALUE':1,'SKIP':1}]") \
+  X(CONTROL_DIAGNOSTICS,     "diag", "DIAG_REQUEST", "'LISTEN':1,'PARAM':[{'VALUE':1,'SKIP':1}]") \
+  X(CONTROL_RESET,           "reset", "SERV_RST", "'PARAM':[{'VALUE':1,'SKIP':1}]") \
+  FEATURE_ROW(CSTATION_FEATURE_CONFIG_MODE, X(CONTROL_CONFIG,          "config", "SERV_CONF", "'PARAM':[{'VALUE':1,'SKIP':1}]")) \
+  FEATURE_ROW(CSTATION_FEATURE_LCD, X(CONTROL_DISPLAY_STATE,   "displaystate", "SET_DISPLAY_ST", "'PARAM':[{'NAME':'Display state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]")) \
+  X(CONTROL_FAN_STATE,       "fanstate", "SET_FAN_ST", "'PARAM':[{'NAME':'Fan state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]") \
+  X(CONTROL_LIGHT_STATE,     "lightstate", "SET_LIGHT_ST", "'PARAM':[{'NAME':'Light state ON','TYPE':'BOOL'}],'BUTTONS':[{'NAME':'Set auto','PARAMSET':['2']}]") \
+  X(CONTROL_SET_TIME,        "settime", "SET_TIME", "'PARAM':[{'NAME':'Timestamp','TYPE':'TIMESTAMP'}],'BUTTONS':[{'NAME':'Request','PARAMSET':['R']}]") \
+  FEATURE_ROW(CSTATION_FEATURE_LCD, X(CONTROL_ALARM_MODE,      "alarmmode", "SET_ALARM", "'PARAM':[{'NAME':'Hourly beep','TYPE':'BOOL'},{'NAME':'Alarm','TYPE':'BOOL'},{'NAME':'Alarm hour','TYPE':'UINT'}]")) \
+  FEATURE_ROW(CSTATION_FEATURE_LCD, X(CONTROL_LCD_TEXT,        "lcd", "SERV_LT", "'PARAM':[{'NAME':'Display text','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Reset','PARAMSET':['']}]")) \
+  FEATURE_ROW(CSTATION_FEATURE_LCD, X(CONTROL_SET_FORECAST,    "setforecast", "SET_FORECAST", "'PARAM':[{'NAME':'Forecast','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Request','PARAMSET':['R']}]")) \
+  X(CONTROL_SET_FORMAT,      "format", "SET_FORMAT", "'PARAM':[{'NAME':'Binary telemetry','TYPE':'BOOL'}]") \
+  X(CONTROL_STATE_SUBSCRIBE, "statesub", "STATES_SUBSCRIBE", "'PARAM':[{'NAME':'Push state changes','TYPE':'BOOL'}]") \
+  X(CONTROL_RULES,           "rules", "SET_RULES", "'PARAM':[{'NAME':'Rules chunk (+hex)','TYPE':'STRING'}],'BUTTONS':[{'NAME':'Enable','PARAMSET':['1']},{'NAME':'Clear','PARAMSET':['0']}]")
+
+#define DESCRIPTOR_ID(id, ...) id,
+enum SensorId { SENSORS_TABLE(DESCRIPTOR_ID) SENSORS_COUNT };
+enum ControlId { CONTROLS_TABLE(DESCRIPTOR_ID) CONTROLS_COUNT };
+#undef DESCRIPTOR_ID
+
+#define SENSOR_STRINGS(id, code, decimals, fields) \
+  const char id##_code[] PROGMEM = code; \
+  const char id##_fields[] PROGMEM = fields;
+#define CONTROL_STRINGS(id, code, prefix, fields) \
+  const char id##_code[] PROGMEM = code; \
+  const char id##_prefix[] PROGMEM = prefix; \
+  const char id##_fields[] PROGMEM = fields;
+SENSORS_TABLE(SENSOR_STRINGS)
+CONTROLS_TABLE(CONTROL_STRINGS)
+#undef SENSOR_STRINGS
+#undef CONTROL_STRINGS
+
+#define DESCRIPTOR_CODE(id, ...) id##_code,
+#define DESCRIPTOR_PREFIX(id, code, prefix, fields) id##_prefix,
+#define DESCRIPTOR_FIELDS(id, ...) id##_fields,
+#define DESCRIPTOR_DECIMALS(id, code, decimals, fields) decimals,
+const char* const sensor_codes[] PROGMEM = { SENSORS_TABLE(DESCRIPTOR_CODE) };
+const char* const sensor_fields[] PROGMEM = { SENSORS_TABLE(DESCRIPTOR_FIELDS) };
+const byte sensor_decimals[] PROGMEM = { SENSORS_TABLE(DESCRIPTOR_DECIMALS) };
+const char* const control_codes[] PROGMEM = { CONTROLS_TABLE(DESCRIPTOR_CODE) };
+const char* const control_prefixes[] PROGMEM = { CONTROLS_TABLE(DESCRIPTOR_PREFIX) };
+const char* const control_fields[] PROGMEM = { CONTROLS_TABLE(DESCRIPTOR_FIELDS) };
+#undef DESCRIPTOR_CODE
+#undef DESCRIPTOR_PREFIX
+#undef DESCRIPTOR_FIELDS
+#undef DESCRIPTOR_DECIMALS
+
+const char descriptor_sensor_head[] PROGMEM = "DS_INFO={'CODE':'";
+const char descriptor_control_head[] PROGMEM = "DC_INFO={'CODE':'";
+const char descriptor_prefix_head[] PROGMEM = "','PREFIX':'";
+const char descriptor_fields_head[] PROGMEM = "',";
+const char descriptor_decimals_head[] PROGMEM = ",'DEC':";
+
+class Descriptors
+{
+  public:
+
+    // MessageComposer for sendMessageList()
+    static void composeSensorInfo(byte index, char* buffer, unsigned size)
+    {
+      strlcpy_P(buffer, descriptor_sensor_head, size);
+      strlcat_P(buffer, (char*)pgm_read_word(&(sensor_codes[index])), size);
+      strlcat_P(buffer, descriptor_fields_head, size);
+      strlcat_P(buffer, (char*)pgm_read_word(&(sensor_fields[index])), size);
+      byte decimals = sensorDecimals((SensorId) index);
+      if (decimals) {
+        // Scale of the integer values in binary telemetry frames
+        char digit[2] = {(char)('0' + decimals), 0};
+        strlcat_P(buffer, descriptor_decimals_head, size);
+        strlcat(buffer, digit, size);
+      }
+      strlcat(buffer, "}", size);
+    }
+
+    // MessageComposer for sendMessageList()
+    static void composeControlInfo(byte index, char* buffer, unsigned size)
+    {
+      strlcpy_P(buffer, descriptor_control_head, size);
+      strlcat_P(buffer, (char*)pgm_read_word(&(control_codes[index])), size);
+      strlcat_P(buffer, descriptor_prefix_head, size);
+      strlcat_P(buffer, (char*)pgm_read_word(&(control_prefixes[index])), size);
+      strlcat_P(buffer, descriptor_fields_head, size);
+      strlcat_P(buffer, (char*)pgm_read_word(&(control_fields[index])), size);
+      strlcat(buffer, "}", size);
+    }
+
+    static byte sensorDecimals(SensorId sensor)
+    {
+      return pgm_read_byte(&(sensor_decimals[sensor]));
+    }
+
+    // Telemetry key like "'T':"
+    static String sensorKey(SensorId sensor)
+    {
+      char code[4];
+      strlcpy_P(code, (char*)pgm_read_word(&(sensor_codes[sensor])), sizeof(code));
+      return "'" + String(code) + "':";
+    }
+
+    // Finds the control whose "PREFIX=" starts the message and cuts the parameter at the line end
+    static ControlId findControl(char* message, char** param)
+    {
+      for(byte i=0; i<CONTROLS_COUNT; i++) {
+        const char* prefix = (char*)pgm_read_word(&(control_prefixes[i]));
+        unsigned prefix_len = strlen_P(prefix);
+        if (strncmp_P(message, prefix, prefix_len)==0 && message[prefix_len]=='=') {
+          char* value = message + prefix_len + 1;
+          char* line_end = strchr(value, '\r');
+          if (line_end) *line_end = 0;
+          *param = value;
+          return (ControlId) i;
+        }
+      }
+      *param = NULL;
+      return CONTROLS_COUNT;
+    }
+};
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef DHT22_SENSOR_H
+#define DHT22_SENSOR_H
+
+// DHT22 driver decoded from pin change interrupts: after the start pulse
+// every falling edge is timestamped in the ISR and the gap to the previous
+// one gives the bit value (~78us for 0, ~120us for 1). Interrupts are never
+// disabled for the transfer and nothing busy-waits; sample() asks for a
+// conversion, loop() drives the state machine through process() and picks
+// the result up when it's ready.
+
+#define DHT22_STATE_IDLE 0
+#define DHT22_STATE_START 1
+#define DHT22_STATE_READING 2
+
+// In millis() ticks, 2 ticks give at least 1 ms of low level
+#define DHT22_START_LOW_MIN 2
+#define DHT22_START_LOW_MAX 20
+#define DHT22_READ_TIMEOUT 10
+// Shortest gap between two conversions the sensor accepts
+#define DHT22_READ_INTERVAL 2500
+// From sample() to a new value: start pulse, transfer and loop() slack, ms
+#define DHT22_SAMPLE_LATENCY 20
+#define DHT22_VALUE_MAX_AGE 10000
+#define DHT22_BIT_THRESHOLD 100
+// Response start, first bit start, then one falling edge after each of the 40 bits
+#define DHT22_EDGES 42
+
+class DHT22Sensor
+{
+  private:
+    byte pin;
+    volatile uint8_t* pin_input;
+    byte pin_mask;
+
+    volatile byte state;
+    volatile byte edges;
+    volatile unsigned long int last_edge_micros;
+    volatile byte data[5];
+    unsigned long int state_millis;
+    bool sample_pending;
+
+    bool has_value;
+    unsigned long int value_millis;
+    int humidity;
+    int temperature;
+    unsigned long int errors;
+
+    void enablePinInterrupt(bool enable)
+    {
+      if (enable) {
+        *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+        PCIFR = _BV(digitalPinToPCICRbit(pin));
+      } else {
+        *digitalPinToPCMSK(pin) &= ~_BV(digitalPinToPCMSKbit(pin));
+      }
+    }
+
+    void finishReading()
+    {
+      enablePinInterrupt(false);
+      state = DHT22_STATE_IDLE;
+      state_millis = millis();
+      byte sum = data[0] + data[1] + data[2] + data[3];
+      if (edges < DHT22_EDGES || sum != data[4]) {
+        errors++;
+        return;
+      }
+      humidity = (data[0]<<8) | data[1];
+      temperature = ((data[2] & 0x7F)<<8) | data[3];
+      if (data[2] & 0x80) temperature = -temperature;
+      has_value = true;
+      value_millis = state_millis;
+    }
+
+  public:
+    DHT22Sensor(byte sensor_pin)
+    {
+      pin = sensor_pin;
+      pin_input = NULL;
+      pin_mask = 0;
+      state = DHT22_STATE_IDLE;
+      edges = 0;
+      last_edge_micros = 0;
+      state_millis = 0;
+      sample_pending = false;
+      has_value = false;
+      value_millis = 0;
+      humidity = 0;
+      temperature = 0;
+      errors = 0;
+    }
+
+    void begin()
+    {
+      pin_input = portInputRegister(digitalPinToPort(pin));
+      pin_mask = digitalPinToBitMask(pin);
+      pinMode(pin, INPUT_PULLUP);
+      *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+      // First conversion only after the sensor power-up time
+      state_millis = millis();
+    }
+
+    // Pin change ISR
+    void pinChanged()
+    {
+      if (state != DHT22_STATE_READING || (*pin_input & pin_mask)) return;
+      unsigned long int edge_micros = micros();
+      byte edge = edges;
+      if (edge >= 2 && edge < DHT22_EDGES && edge_micros - last_edge_micros > DHT22_BIT_THRESHOLD) {
+        byte bit = edge - 2;
+        data[bit>>3] |= 0x80 >> (bit & 7);
+      }
+      last_edge_micros = edge_micros;
+      edges = edge + 1;
+      if (edges >= DHT22_EDGES) enablePinInterrupt(false);
+    }
+
+    // ms until process() has something to do
+    unsigned long idleTime()
+    {
+      switch(state) {
+        case DHT22_STATE_IDLE:
+          return sample_pending ? SleepController::remaining(state_millis, DHT22_READ_INTERVAL) : SLEEP_IDLE_MAX;
+        case DHT22_STATE_START:
+          return SleepController::remaining(state_millis, DHT22_START_LOW_MIN);
+        case DHT22_STATE_READING:
+          return edges >= DHT22_EDGES ? 0 : SleepController::remaining(state_millis, DHT22_READ_TIMEOUT + 1);
+      }
+      return 0;
+    }
+
+    // Conversion as soon as DHT22_READ_INTERVAL has passed since the last one
+    void sample()
+    {
+      sample_pending = true;
+    }
+
+    // Called from loop(): starts the requested conversion and collects it
+    void process()
+    {
+      unsigned long int elapsed = millis() - state_millis;
+      switch(state) {
+        case DHT22_STATE_IDLE:
+          if (sample_pending && elapsed >= DHT22_READ_INTERVAL) {
+            sample_pending = false;
+            for(byte i=0; i<5; i++) data[i] = 0;
+            edges = 0;
+            digitalWrite(pin, LOW);
+            pinMode(pin, OUTPUT);
+            state = DHT22_STATE_START;
+            state_millis = millis();
+          }
+          break;
+        case DHT22_STATE_START:
+          if (elapsed > DHT22_START_LOW_MAX) {
+            // loop() was held up too long, the sensor may have given up on this start pulse
+            pinMode(pin, INPUT_PULLUP);
+            state = DHT22_STATE_IDLE;
+            state_millis = millis() - DHT22_READ_INTERVAL + DHT22_START_LOW_MAX;
+            sample_pending = true;
+          } else if (elapsed >= DHT22_START_LOW_MIN) {
+            state = DHT22_STATE_READING;
+            enablePinInterrupt(true);
+            pinMode(pin, INPUT_PULLUP);
+            state_millis = millis();
+          }
+          break;
+        case DHT22_STATE_READING:
+          if (edges >= DHT22_EDGES || elapsed > DHT22_READ_TIMEOUT) finishReading();
+          break;
+      }
+    }
+
+    // Any valid reading so far
+    bool hasValue()
+    {
+      return has_value;
+    }
+
+    // Valid reading from one of the last conversions
+    bool isFresh()
+    {
+      return has_value && millis() - value_millis < DHT22_VALUE_MAX_AGE;
+    }
+
+    // Relative humidity in 0.1 %
+    int getHumidity()
+    {
+      return humidity;
+    }
+
+    // Temperature in 0.1 degC
+    int getTemperature()
+    {
+      return temperature;
+    }
+
+    unsigned long getErrors()
+    {
+      return errors;
+    }
+};
+
+#endif
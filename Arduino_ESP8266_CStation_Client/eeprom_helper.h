@@ -34,6 +34,12 @@ class EEPROM_Helper
       EEPROM.write(addr, wrbyte);
     }
 
+    // Skips the write (and its wear) when the cell already holds the value
+    static void updateByte(unsigned addr, byte wrbyte)
+    {
+      EEPROM.update(addr, wrbyte);
+    }
+
     static void readAutoState(unsigned addr, bool* is_auto, bool* is_on)
     {
       byte saved_state = EEPROM.read(addr);
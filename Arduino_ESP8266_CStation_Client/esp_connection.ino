@@ -19,12 +19,37 @@
 
 #define CONNECTION_ESP_PIN 26
 
+#define ESP_BAUD_INDEX_ADDR 23
+
+#define PASSTHROUGH_GUARD_TIME 1100
+
+// Reconnect tiers, each one only entered when the previous can't help
+#define RECONNECT_IDLE 0
+#define RECONNECT_CHECK 1 // AT+CIPSTATUS
+#define RECONNECT_LINK 2 // CIPSTART and handshake only
+#define RECONNECT_WIFI 3 // Rejoin the access point
+#define RECONNECT_RESET 4 // Full module reset
+// One CIPSTART per step, the backoff between steps is the retry wait
+#define RECONNECT_LINK_ATTEMPTS 4
+#define RECONNECT_BACKOFF_MIN 1000
+#define RECONNECT_BACKOFF_MAX 64000
+#define ESP_BAUD_PROBES 3
+// Module boot after AT+RST, polled for "ready" or an OK to AT
+#define ESP_READY_TIMEOUT 4000
+#define ESP_READY_POLL 250
+#define ESP_FRAMING_ERRORS_MAX 3
+// 0x00 or 0xFF bytes in a row that only a wrong speed or line noise produce
+#define ESP_GARBAGE_RUN 2
+
 // FOR ARDUINO MEGA
 // Arduino TX2 for RX
 // Arduino RX2 for TX
-// Baud rate can be up to 38400
+// Link starts at BAUD_RATE after every module reset and is raised by negotiateBaudRate()
 #define espSerial Serial2
 
+const byte esp_baud_rates_count = 4;
+const unsigned long esp_baud_rates[] PROGMEM = {230400, 115200, 57600, BAUD_RATE};
+
 char reply[REPLY_BUFFER];
 
 char wifi_ssid[WIFI_SSID_MAXLEN];
@@ -36,11 +61,47 @@ bool connected_to_wifi = false;
 bool connected_to_server = false;
 bool in_configuration_mode = false;
 bool transmittion_mode = false;
+bool passthrough_active = false;
+unsigned long int passthrough_last_write = 0;
+// Cleared by a "CLOSED" line from the module, set again by enterPassthrough()
+bool passthrough_link_up = false;
+char passthrough_send_ok[] = "SEND OK";
+char passthrough_link_closed[] = "CLOSED";
+
+byte reconnect_state = RECONNECT_IDLE;
+byte reconnect_link_failures = 0;
+unsigned long int reconnect_backoff = RECONNECT_BACKOFF_MIN;
+unsigned long int reconnect_next_millis = 0;
+unsigned long int reconnect_started_millis = 0;
+unsigned long int reconnect_last_duration = 0;
+
+// AT+RST already sent by espStartBootReset()
+bool esp_boot_reset_pending = false;
+// From reset to the first completed handshake, ms
+unsigned long int boot_link_millis = 0;
+
+// Cleared when the module rejects AT+CIPSENDBUF on a good link, set again by a module reset
+bool send_buffer_supported = true;
+bool telemetry_binary = false;
+unsigned long int send_burst_bytes = 0;
+unsigned long int send_burst_millis = 0;
 byte connection_id = 0;
 char temp[5];
 
+unsigned long esp_baud_rate = BAUD_RATE;
+// Speed the module was last set to, kept in EEPROM for an MCU only reset
+byte esp_baud_index = 0;
+// Fastest speed negotiateBaudRate() tries, lowered by a fallback until the next boot
+byte esp_baud_first = 0;
+byte esp_framing_errors = 0;
+
 void initESP() {
   espSerial.begin(BAUD_RATE);
+  esp_baud_rate = BAUD_RATE;
+  esp_framing_errors = 0;
+  esp_baud_first = 0;
+  esp_baud_index = EEPROM_Helper::readByte(ESP_BAUD_INDEX_ADDR);
+  if (esp_baud_index >= esp_baud_rates_count) esp_baud_index = 0;
 
   wifi_ssid[0] = 0;
   wifi_passw[0] = 0;
@@ -53,6 +114,23 @@ void initESP() {
   }
 }
 
+// Resets the module without waiting for it: it boots and rejoins its saved
+// network while setup() initializes the rest, espResetModule() takes over
+void espStartBootReset()
+{
+  unsigned long saved_rate = pgm_read_dword(&esp_baud_rates[esp_baud_index]);
+  // The module may still run at a negotiated speed if only the MCU was reset
+  if (saved_rate != BAUD_RATE) {
+    setESPBaudRate(saved_rate);
+    espSerial.print("AT+RST\r\n");
+    setESPBaudRate(BAUD_RATE);
+  }
+  espSerial.print("AT+RST\r\n");
+  espSerial.flush();
+  esp_boot_reset_pending = true;
+}
+
+#if CSTATION_FEATURE_CONFIG_MODE
 void StartConfiguringMode()
 {
   bool rok = true;
@@ -70,24 +148,18 @@ void StartConfiguringMode()
   connected_to_server = false;
   in_configuration_mode = false;
 
-  DEBUG_WRITELN("Starting configuration mode");
+  LOG_INFO(LOG_CONFIG_MODE);
   lcd_controller->setLCDLines("Configuration", "      MODE");
   delay(1000);
   do {
       lcd_controller->updateLCDAutoState();
 
-      DEBUG_WRITELN("Reset the module");
+      LOG_INFO(LOG_MODULE_RESET);
       lcd_controller->setLCDText("Reset");
-      attempts = 0;
-      do {
-        espSerial.print("AT+RST\r\n");
-        reply = getReply( 4000, false );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
+      rok = espResetModule();
       if (!rok) continue;
       
-      DEBUG_WRITELN("Change to host mode");
+      LOG_INFO(LOG_HOST_MODE);
       lcd_controller->setLCDText("Host mode ->");
       attempts = 0;
       do {
@@ -98,7 +170,7 @@ void StartConfiguringMode()
       } while (!rok && attempts<MAX_ATTEMPTS);
       if (!rok) continue;
       
-      DEBUG_WRITELN("Configuring a network");
+      LOG_INFO(LOG_HOST_NETWORK);
       lcd_controller->setLCDLines("Set Network","Parameters");
       attempts = 0;
       do {
@@ -118,7 +190,7 @@ void StartConfiguringMode()
       if (!rok) continue;
       
       if (strlen(wifi_ssid)>0 || strlen(wifi_passw)>0) {
-        DEBUG_WRITELN("Connect to a network");
+        LOG_INFO(LOG_NETWORK_CONNECT);
         lcd_controller->setLCDText("WIFI Network ->");
         espSerial.print("AT+CWJAP=\"");
         espSerial.print(wifi_ssid);
@@ -128,7 +200,7 @@ void StartConfiguringMode()
         getReply( 6000, true );
       }
 
-      DEBUG_WRITELN("Get ip address of the esp");
+      LOG_INFO(LOG_HOST_IP);
       lcd_controller->setLCDLines("Getting IP","address");
       attempts = 0;
       do {
@@ -157,7 +229,7 @@ void StartConfiguringMode()
       }
       ipAddress[buffpos] = 0;
 
-      DEBUG_WRITELN("Set for multiple connections");
+      LOG_INFO(LOG_MULTIPLE_CONNECTIONS);
       lcd_controller->setLCDLines("Configuring","the connection");
       attempts = 0;
       do {
@@ -170,15 +242,13 @@ void StartConfiguringMode()
 
       rok = startServer(1, CLIENT_PORT);
       if (!rok) {
-        DEBUG_WRITELN("Can't start the server. Let's try again");
+        LOG_ERROR(LOG_SERVER_RETRY);
         lcd_controller->setLCDLines("Error: Can't", "start server");
         delay(5000);
         continue;
       }
 
-      DEBUG_WRITE("You need to connect to wifi-host "); DEBUG_WRITELN(HOST_WIFI_SSID);
-      DEBUG_WRITE("Then use configuration programm to connect to "); DEBUG_WRITELN(ipAddress);
-      DEBUG_WRITELN("and perform setup operations...");
+      LOG_INFO(LOG_CONFIG_WAITING);
       
       delay(500);
       lcd_controller->setLCDLines("Waiting at host:", HOST_WIFI_SSID);
@@ -193,7 +263,7 @@ void StartConfiguringMode()
     reset_btn_pressed = false;
     while (!reset_btn_pressed) {
       unsigned tcp_connection_id = 0;
-      char* message = readTCPMessage( 1000, &tcp_connection_id, false, NULL );
+      char* message = readTCPMessage( 1000, &tcp_connection_id );
       char* param;
       if (message) {
        
@@ -202,31 +272,34 @@ void StartConfiguringMode()
           
           rok = StringHelper::readLineToStr(param, wifi_ssid, WIFI_SSID_MAXLEN, line_pos, &line_pos);
           EEPROM_Helper::writeStringToEEPROM(EEPROM_START_ADDR+1, wifi_ssid, WIFI_SSID_MAXLEN);
-          DEBUG_WRITE("SSID written to EEPROM:"); DEBUG_WRITELN(wifi_ssid);
+          LOG_INFO(LOG_SETUP_SSID, strlen(wifi_ssid));
           
           rok = StringHelper::readLineToStr(param, wifi_passw, WIFI_PASSWORD_MAXLEN, line_pos, &line_pos);
           EEPROM_Helper::writeStringToEEPROM(EEPROM_START_ADDR+WIFI_SSID_MAXLEN+2, wifi_passw, WIFI_PASSWORD_MAXLEN);
-          DEBUG_WRITE("PASSW written to EEPROM:"); DEBUG_WRITELN(wifi_passw);
+          LOG_INFO(LOG_SETUP_PASSW, strlen(wifi_passw));
           
           rok = StringHelper::readLineToStr(param, server_ip_addr, WIFI_SERVER_ADDRESS_MAXLEN, line_pos, &line_pos);
           EEPROM_Helper::writeStringToEEPROM(EEPROM_START_ADDR+WIFI_SSID_MAXLEN+WIFI_PASSWORD_MAXLEN+3, server_ip_addr, WIFI_SERVER_ADDRESS_MAXLEN);
-          DEBUG_WRITE("Server address written to EEPROM:"); DEBUG_WRITELN(server_ip_addr);
+          LOG_INFO(LOG_SETUP_SERVER, strlen(server_ip_addr));
           
           station_id = StringHelper::readIntFromString(param, line_pos, &line_pos);
           EEPROM_Helper::writeByte(EEPROM_START_ADDR, station_id);
-          DEBUG_WRITE("Station ID written to EEPROM:"); DEBUG_WRITELN(station_id);
+          LOG_INFO(LOG_SETUP_STATION, station_id);
 
           byte i2c_addr = StringHelper::readIntFromString(param, line_pos);
+          link_buffers->release(message);
           lcd_controller->changeLCDI2CAddr(i2c_addr);
-          DEBUG_WRITE("I2C addr written to EEPROM:"); DEBUG_WRITELN(i2c_addr);
+          LOG_INFO(LOG_SETUP_I2C, i2c_addr);
 
           tone_controller->FastToneSignal(1000, 2000);
           break;
 
         } else if ((param = StringHelper::getMessageParam(message, "SERV_RST=1", true))) {
+          link_buffers->release(message);
           break;
         }
         
+        link_buffers->release(message);
         closeConnection(5);
         startServer(1, CLIENT_PORT);
       }
@@ -238,17 +311,16 @@ void StartConfiguringMode()
     lcd_controller->unfixPage();
     lcd_controller->clearLCDText(LCD_PAGE_SYSTEM);
 }
+#endif
 
 void StartConnection(bool reconnect) 
 {
   bool rok = true;
-  byte attempts = 0;
-  char* reply;
 
+  reconnect_state = RECONNECT_IDLE;
   lcd_controller->fixPage(LCD_PAGE_SYSTEM);
   ind_controller->ConnectState(1);
   if (tone_controller->isToneRunning()) tone_controller->StopTone();
-  delay(500);
   //tone_controller->StartMelodyToneByIndex(1);
 
   if (connected_to_wifi && connected_to_server) closeConnection(CONNECTIONS_ALL);
@@ -262,71 +334,21 @@ void StartConnection(bool reconnect)
       lcd_controller->updateLCDAutoState();
 
       if (strlen(wifi_ssid)==0 || strlen(wifi_passw)==0 || strlen(server_ip_addr)==0 || !station_id) {
-        DEBUG_WRITELN("Need to set SSID, password and server ip");
+        LOG_WARN(LOG_NEED_SETUP);
         lcd_controller->setLCDLines("Need ", "SSID, PWD, SRVIP");
         delay(5000);
+#if CSTATION_FEATURE_CONFIG_MODE
         StartConfiguringMode();
         delay(1000);
         digitalWrite(CONNECTION_ESP_PIN, HIGH);
+#else
+        // Nothing to connect with until a full build has written the settings
+        rok = false;
+        continue;
+#endif
       }
 
-      DEBUG_WRITELN("Reset the module");
-      lcd_controller->setLCDText("Reset");
-      attempts = 0;
-      do {
-        espSerial.print("AT+RST\r\n");
-        reply = getReply( 4000, false );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
-      if (!rok) continue;
-      
-      DEBUG_WRITELN("Change to client mode");
-      lcd_controller->setLCDText("Client mode ->");
-      attempts = 0;
-      do {
-        espSerial.print("AT+CWMODE=1\r\n");
-        reply = getReply( 1500, true );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
-      if (!rok) continue;
-  
-      DEBUG_WRITELN("Connect to a network");
-      lcd_controller->setLCDText("WIFI Network ->");
-      attempts = 0;
-      do {
-        espSerial.print("AT+CWJAP=\"");
-        espSerial.print(wifi_ssid);
-        espSerial.print("\",\"");
-        espSerial.print(wifi_passw);
-        espSerial.print("\"\r\n");
-        reply = getReply( 6000, true );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
-      if (!rok) continue;
-  
-      DEBUG_WRITELN("Get ip address assigned by the router");
-      lcd_controller->setLCDLines("Getting IP","address");
-      attempts = 0;
-      do {
-        espSerial.print("AT+CIFSR\r\n");
-        reply = getReply( 1000, true );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
-      if (!rok) continue;
-  
-      DEBUG_WRITELN("Set for multiple connections");
-      lcd_controller->setLCDLines("Configuring","the connection");
-      attempts = 0;
-      do {
-        espSerial.print("AT+CIPMUX=1\r\n");
-        reply = getReply( 750, true );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
+      rok = espRestartModule() && espJoinWiFi();
 
     } while (!rok);
 
@@ -340,74 +362,549 @@ void StartConnection(bool reconnect)
     do {
       lcd_controller->updateLCDAutoState();
       
-      DEBUG_WRITELN("Connect to the server");
-      lcd_controller->setLCDLines("Connect to", "server");
-      connection_id++;
-      if (connection_id > MAX_CONNECTIONS) connection_id = 1;
-      attempts = 0;
-      do {
-        espSerial.print("AT+CIPSTART=");
-        espSerial.print(connection_id);
-        espSerial.print(",\"TCP\",\"");
-        espSerial.print(server_ip_addr);
-        espSerial.print("\",");
-        espSerial.print(SERVER_PORT);
-        espSerial.print("\r\n");
-        reply = getReply( 2000, true );
-        rok = StringHelper::replyIsOK(reply);
-        attempts++;
-      } while (!rok && attempts<MAX_ATTEMPTS);
+      rok = espOpenServerLink(MAX_ATTEMPTS);
       if (!rok) {
-        DEBUG_WRITELN("Can't connect to server. Let's try again");
+        LOG_ERROR(LOG_CONNECT_RETRY);
         lcd_controller->setLCDText("Error: No server");
         delay(10000);
         continue;
       }
 
-      rok = startServer(1, CLIENT_PORT);
+      rok = espStartCommandChannel();
       if (!rok) {
-        DEBUG_WRITELN("Can't start the server. Let's try again");
-        lcd_controller->setLCDLines("Error: Can't", "start server");
         delay(5000);
         continue;
       }
 
-      DEBUG_WRITELN("Send identification Number");
-      lcd_controller->setLCDText("Identification");
-      reply = sendMessage(connection_id, "DS="+String(station_id), MAX_ATTEMPTS);
-      rok = rok && StringHelper::replyIsOK(reply);
-
-      reply = sendMessage(connection_id, "DS_WIFI_SSID="+String(wifi_ssid), MAX_ATTEMPTS);
-      rok = rok && StringHelper::replyIsOK(reply);
-
-      reply = sendMessage(connection_id, "DS_WIFI_PASSW="+String(wifi_passw), MAX_ATTEMPTS);
-      rok = rok && StringHelper::replyIsOK(reply);
-
-      reply = sendMessage(connection_id, "DS_SERVER="+String(server_ip_addr), MAX_ATTEMPTS);
-      rok = rok && StringHelper::replyIsOK(reply);
-
-      DEBUG_WRITELN("Send sensors info");
-      lcd_controller->setLCDLines("Sending sensors", "info");
-      rok = rok && sendSensorsInfo(connection_id);
-      
-      DEBUG_WRITELN("Send controls info");
-      lcd_controller->setLCDLines("Sending controls", "info");
-      rok = rok && sendControlsInfo(connection_id);
-
-      reply = sendMessage(connection_id, "DS_READY=1", MAX_ATTEMPTS);
-      rok = rok && StringHelper::replyIsOK(reply);
+      rok = espSendHandshake();
 
     } while (!rok);
     
     connected_to_server = true;
+    if (!boot_link_millis) boot_link_millis = millis();
   }
 
-  DEBUG_WRITELN("Connected successfully!");
+  LOG_INFO(LOG_CONNECTED);
   lcd_controller->setLCDText("Connected!", lcd_controller->pageIsEmpty(LCD_PAGE_SENSORS) ? LCD_PAGE_SENSORS : LCD_PAGE_SYSTEM);
   lcd_controller->unfixPage();
   lcd_controller->clearLCDText(LCD_PAGE_SYSTEM);
   ind_controller->ConnectState(0);
-  delay(2000);
+}
+
+bool espRestartModule()
+{
+  bool rok;
+  byte attempts = 0;
+
+  LOG_INFO(LOG_MODULE_RESET);
+  lcd_controller->setLCDText("Reset");
+  if (!espResetModule()) return false;
+
+  lcd_controller->setLCDLines("Negotiating", "UART speed");
+  negotiateBaudRate();
+  
+  LOG_INFO(LOG_CLIENT_MODE);
+  lcd_controller->setLCDText("Client mode ->");
+  do {
+    espSerial.print("AT+CWMODE=1\r\n");
+    rok = StringHelper::replyIsOK(getReply( 1500, true ));
+    attempts++;
+  } while (!rok && attempts<MAX_ATTEMPTS);
+  return rok;
+}
+
+bool espJoinWiFi()
+{
+  bool rok;
+  byte attempts = 0;
+
+  LOG_INFO(LOG_NETWORK_CONNECT);
+  lcd_controller->setLCDText("WIFI Network ->");
+  if (espOnNetwork()) {
+    // Rejoined by the module itself after the reset
+    LOG_INFO(LOG_NETWORK_KEPT);
+  } else {
+    do {
+      espSerial.print("AT+CWJAP=\"");
+      espSerial.print(wifi_ssid);
+      espSerial.print("\",\"");
+      espSerial.print(wifi_passw);
+      espSerial.print("\"\r\n");
+      rok = StringHelper::replyIsOK(getReply( 6000, true ));
+      attempts++;
+    } while (!rok && attempts<MAX_ATTEMPTS);
+    if (!rok) return false;
+  }
+
+  LOG_INFO(LOG_CLIENT_IP);
+  lcd_controller->setLCDLines("Getting IP","address");
+  attempts = 0;
+  do {
+    espSerial.print("AT+CIFSR\r\n");
+    rok = StringHelper::replyIsOK(getReply( 1000, true ));
+    attempts++;
+  } while (!rok && attempts<MAX_ATTEMPTS);
+  if (!rok) return false;
+
+  LOG_INFO(LOG_CONNECTIONS_MODE);
+  lcd_controller->setLCDLines("Configuring","the connection");
+  attempts = 0;
+  do {
+    // Transparent transmission works with a single connection only
+    espSerial.print(isPassthroughLink() ? "AT+CIPMUX=0\r\n" : "AT+CIPMUX=1\r\n");
+    rok = StringHelper::replyIsOK(getReply( 750, true ));
+    attempts++;
+  } while (!rok && attempts<MAX_ATTEMPTS);
+  return rok;
+}
+
+bool espOpenServerLink(byte max_attempts)
+{
+  bool rok;
+  byte attempts = 0;
+
+  if (passthrough_active) leavePassthrough();
+
+  LOG_INFO(LOG_SERVER_CONNECT);
+  lcd_controller->setLCDLines("Connect to", "server");
+  // The link of an earlier attempt would stay open next to the new one
+  if (connection_id) espCloseLink(connection_id);
+  connection_id = espFreeLinkId(connection_id);
+  do {
+    espSerial.print("AT+CIPSTART=");
+    if (!isPassthroughLink()) {
+      espSerial.print(connection_id);
+      espSerial.print(",");
+    }
+    espSerial.print("\"TCP\",\"");
+    espSerial.print(server_ip_addr);
+    espSerial.print("\",");
+    espSerial.print(SERVER_PORT);
+    espSerial.print("\r\n");
+    rok = StringHelper::replyIsOK(getReply( 2000, true ));
+    attempts++;
+  } while (!rok && attempts<max_attempts);
+  return rok;
+}
+
+void espCloseLink(byte link)
+{
+  if (isPassthroughLink()) {
+    espSerial.print("AT+CIPCLOSE\r\n");
+  } else {
+    espSerial.print("AT+CIPCLOSE=");
+    espSerial.print(link);
+    espSerial.print("\r\n");
+  }
+  // ERROR when the link is gone already, fine as well
+  getReply( 800, true );
+}
+
+// preferred when AT+CIPSTATUS lists no link with that id, the first free one
+// otherwise, so the server link does not take the id of a CIPSERVER client
+byte espFreeLinkId(byte preferred)
+{
+  if (isPassthroughLink()) return preferred ? preferred : 1;
+  espSerial.print("AT+CIPSTATUS\r\n");
+  char* reply = getReply( 750, true );
+  bool used[MAX_CONNECTIONS+1];
+  memset(used, 0, sizeof(used));
+  char* pos = reply;
+  while ((pos = strstr(pos, "+CIPSTATUS:"))) {
+    pos += 11;
+    unsigned link = StringHelper::readIntFromString(pos, 0);
+    if (link <= MAX_CONNECTIONS) used[link] = true;
+  }
+  if (preferred>=1 && preferred<=MAX_CONNECTIONS && !used[preferred]) return preferred;
+  for(byte link=1; link<=MAX_CONNECTIONS; link++) {
+    if (!used[link]) return link;
+  }
+  return preferred ? preferred : 1;
+}
+
+bool espStartCommandChannel()
+{
+  if (isPassthroughLink()) {
+    if (!enterPassthrough()) {
+      LOG_ERROR(LOG_PASSTHROUGH_RETRY);
+      lcd_controller->setLCDLines("Error: Can't", "enter passthr.");
+      return false;
+    }
+  } else if (!startServer(1, CLIENT_PORT)) {
+    LOG_ERROR(LOG_SERVER_RETRY);
+    lcd_controller->setLCDLines("Error: Can't", "start server");
+    return false;
+  }
+  return true;
+}
+
+bool espSendHandshake()
+{
+  char* reply;
+  bool rok;
+
+  LOG_INFO(LOG_SEND_ID);
+  lcd_controller->setLCDText("Identification");
+  reply = sendMessage(connection_id, "DS="+String(station_id), MAX_ATTEMPTS);
+  rok = StringHelper::replyIsOK(reply);
+
+  reply = sendMessage(connection_id, "DS_WIFI_SSID="+String(wifi_ssid), MAX_ATTEMPTS);
+  rok = rok && StringHelper::replyIsOK(reply);
+
+  reply = sendMessage(connection_id, "DS_WIFI_PASSW="+String(wifi_passw), MAX_ATTEMPTS);
+  rok = rok && StringHelper::replyIsOK(reply);
+
+  reply = sendMessage(connection_id, "DS_SERVER="+String(server_ip_addr), MAX_ATTEMPTS);
+  rok = rok && StringHelper::replyIsOK(reply);
+
+  if (passthrough_active) {
+    // Commands are expected on this link instead of the local server
+    reply = sendMessage(connection_id, "DS_LINK=PT", MAX_ATTEMPTS);
+    rok = rok && StringHelper::replyIsOK(reply);
+  }
+
+  // Text telemetry until the server switches to binary frames with SET_FORMAT=1
+  telemetry_binary = false;
+  // State pushes stop with the old link, the server subscribes again if it wants them
+  state_publisher->subscribe(false);
+  reply = sendMessage(connection_id, "DS_FORMAT=B"+String(TELEMETRY_FRAME_VERSION), MAX_ATTEMPTS);
+  rok = rok && StringHelper::replyIsOK(reply);
+
+  LOG_INFO(LOG_SEND_SENSORS);
+  lcd_controller->setLCDLines("Sending sensors", "info");
+  rok = rok && sendSensorsInfo(connection_id);
+  
+  LOG_INFO(LOG_SEND_CONTROLS);
+  lcd_controller->setLCDLines("Sending controls", "info");
+  rok = rok && sendControlsInfo(connection_id);
+
+  reply = sendMessage(connection_id, "DS_READY=1", MAX_ATTEMPTS);
+  return rok && StringHelper::replyIsOK(reply);
+}
+
+// True when the module is on wifi_ssid and has an address
+bool espOnNetwork()
+{
+  byte status = espLinkStatus();
+  if (status<2 || status>4) return false;
+  espSerial.print("AT+CWJAP?\r\n");
+  char* reply = getReply( 750, true );
+  char* ssid = strstr(reply, "+CWJAP:\"");
+  if (!ssid || !StringHelper::replyIsOK(reply)) return false;
+  ssid += 8;
+  unsigned ssid_len = strlen(wifi_ssid);
+  return ssid_len && strncmp(ssid, wifi_ssid, ssid_len)==0 && ssid[ssid_len]=='"';
+}
+
+byte espLinkStatus()
+{
+  espSerial.print("AT+CIPSTATUS\r\n");
+  char* reply = getReply( 750, true );
+  char* status = strstr(reply, "STATUS:");
+  if (!status || !StringHelper::replyIsOK(reply)) return 0;
+  return StringHelper::readIntFromString(status, 7);
+}
+
+void requestReconnect()
+{
+  if (reconnect_state != RECONNECT_IDLE) return;
+  LOG_INFO(LOG_RECONNECT);
+  reconnect_state = RECONNECT_CHECK;
+  reconnect_backoff = RECONNECT_BACKOFF_MIN;
+  reconnect_started_millis = millis();
+  reconnect_next_millis = reconnect_started_millis;
+  reconnect_link_failures = 0;
+  connected_to_server = false;
+  ind_controller->ConnectState(1);
+}
+
+// ms until reconnectProcess() runs its next step
+unsigned long connectionIdleTime()
+{
+  if (reconnect_state == RECONNECT_IDLE) return SLEEP_IDLE_MAX;
+  long left = (long)(reconnect_next_millis - millis());
+  return left > 0 ? left : 0;
+}
+
+// Data from the ESP or commands waiting, safe with interrupts disabled
+bool espDataPending()
+{
+  return espSerial.available() || link_buffers->hasReady();
+}
+
+bool isReconnecting()
+{
+  return reconnect_state != RECONNECT_IDLE;
+}
+
+unsigned long getReconnectDuration()
+{
+  return reconnect_last_duration;
+}
+
+unsigned long getBootLinkMillis()
+{
+  return boot_link_millis;
+}
+
+void reconnectFailed(byte next_state)
+{
+  reconnect_state = next_state;
+  reconnect_next_millis = millis() + reconnect_backoff;
+  if (reconnect_backoff < RECONNECT_BACKOFF_MAX) reconnect_backoff *= 2;
+}
+
+void reconnectProcess()
+{
+  // Runs one escalation step per call so the rest of loop() keeps working
+  if (reconnect_state == RECONNECT_IDLE || (long)(millis() - reconnect_next_millis) < 0) return;
+
+  switch(reconnect_state) {
+    case RECONNECT_CHECK:
+      {
+        if (passthrough_active) leavePassthrough();
+        byte status = espLinkStatus();
+        LOG_INFO(LOG_LINK_STATUS, status);
+        if (status>=2 && status<=4) {
+          reconnect_state = RECONNECT_LINK;
+        } else if (status == 5) {
+          reconnect_state = RECONNECT_WIFI;
+        } else {
+          reconnect_state = RECONNECT_RESET;
+        }
+      }
+      break;
+    case RECONNECT_LINK:
+      if (espOpenServerLink(1) && espStartCommandChannel() && espSendHandshake()) {
+        connected_to_wifi = true;
+        connected_to_server = true;
+        reconnect_state = RECONNECT_IDLE;
+        reconnect_last_duration = millis() - reconnect_started_millis;
+        LOG_INFO(LOG_RECONNECTED, reconnect_last_duration);
+        lcd_controller->clearLCDText(LCD_PAGE_SYSTEM);
+        ind_controller->ConnectState(0);
+        errors_count = 0;
+      } else {
+        reconnect_link_failures++;
+        if (reconnect_link_failures < RECONNECT_LINK_ATTEMPTS) {
+          reconnectFailed(RECONNECT_LINK);
+        } else {
+          // Link keeps failing although the status looked fine: go one tier up
+          reconnect_link_failures = 0;
+          reconnectFailed(RECONNECT_WIFI);
+        }
+      }
+      break;
+    case RECONNECT_WIFI:
+      connected_to_wifi = false;
+      if (espJoinWiFi()) {
+        connected_to_wifi = true;
+        reconnect_state = RECONNECT_LINK;
+      } else {
+        reconnectFailed(RECONNECT_RESET);
+      }
+      break;
+    case RECONNECT_RESET:
+      if (espRestartModule() && espJoinWiFi()) {
+        connected_to_wifi = true;
+        reconnect_state = RECONNECT_LINK;
+      } else {
+        reconnectFailed(RECONNECT_RESET);
+      }
+      break;
+  }
+}
+
+bool isPassthroughLink()
+{
+#ifdef CSTATION_PASSTHROUGH
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool enterPassthrough()
+{
+  bool rok;
+  byte attempts = 0;
+  do {
+    espSerial.print("AT+CIPMODE=1\r\n");
+    rok = StringHelper::replyIsOK(getReply( 750, true ));
+    attempts++;
+  } while (!rok && attempts<MAX_ATTEMPTS);
+  if (!rok) return false;
+
+  espSerial.print("AT+CIPSEND\r\n");
+  rok = StringHelper::replyIsOK(getReply( 1000, true ));
+  if (rok) {
+    LOG_INFO(LOG_PASSTHROUGH_ON);
+    passthrough_active = true;
+    passthrough_link_up = true;
+    passthrough_last_write = millis();
+  }
+  return rok;
+}
+
+// The module reports a dropped transparent link with a "CLOSED" line, it
+// would rejoin the server on its own, but without the handshake
+void checkPassthroughLink(const char* text)
+{
+  const char* pos = text;
+  while ((pos = strstr(pos, "CLOSED\r\n"))) {
+    if (pos==text || pos[-1]=='\n') {
+      if (passthrough_link_up) LOG_WARN(LOG_PASSTHROUGH_CLOSED);
+      passthrough_link_up = false;
+      requestReconnect();
+      return;
+    }
+    pos++;
+  }
+}
+
+void leavePassthrough()
+{
+  if (!passthrough_active) return;
+  LOG_INFO(LOG_PASSTHROUGH_OFF);
+  // "+++" is only recognized as an escape when framed by silence
+  espSerial.flush();
+  while (millis() - passthrough_last_write < PASSTHROUGH_GUARD_TIME) {
+    readReply( 10, false );
+  }
+  espSerial.print("+++");
+  espSerial.flush();
+  delay(PASSTHROUGH_GUARD_TIME);
+  passthrough_active = false;
+  espSerial.print("AT+CIPMODE=0\r\n");
+  getReply( 750, true );
+}
+
+bool espResetModule()
+{
+  byte attempts = 0;
+  bool rok = false;
+  unsigned long saved_rate = pgm_read_dword(&esp_baud_rates[esp_baud_index]);
+  do {
+    if (esp_boot_reset_pending) {
+      esp_boot_reset_pending = false;
+    } else {
+      // The module may still run at a negotiated speed if only the MCU was reset
+      setESPBaudRate((attempts & 1) ? saved_rate : BAUD_RATE);
+      espSerial.print("AT+RST\r\n");
+      espSerial.flush();
+      // After the reset the module always comes up at BAUD_RATE
+      setESPBaudRate(BAUD_RATE);
+    }
+    rok = espWaitReady();
+    attempts++;
+  } while (!rok && attempts<MAX_ATTEMPTS);
+  esp_framing_errors = 0;
+  // The firmware may have changed, probe AT+CIPSENDBUF again
+  send_buffer_supported = true;
+  // Frames cut off by the reset would never complete
+  link_buffers->reset();
+  return rok;
+}
+
+// Up to ESP_READY_TIMEOUT for the module to come up after AT+RST. "ready" may
+// have gone by unread during setup(), so AT is polled as well.
+bool espWaitReady()
+{
+  unsigned long int start = millis();
+  do {
+    char* reply = getReplyToken( ESP_READY_POLL, "ready", true );
+    if (strstr(reply, "ready")) return true;
+    espSerial.print("AT\r\n");
+    reply = getReply( ESP_READY_POLL, true );
+    if (StringHelper::replyIsOK(reply) || strstr(reply, "ready")) return true;
+  } while (millis() - start < ESP_READY_TIMEOUT);
+  return false;
+}
+
+void setESPBaudRate(unsigned long rate)
+{
+  if (rate == esp_baud_rate) return;
+  espSerial.flush();
+  espSerial.end();
+  espSerial.begin(rate);
+  esp_baud_rate = rate;
+  while(espSerial.available()) { espSerial.read(); }
+}
+
+unsigned long getESPBaudRate()
+{
+  return esp_baud_rate;
+}
+
+bool switchESPBaudRate(unsigned long rate)
+{
+  espSerial.print("AT+UART_CUR=");
+  espSerial.print(rate);
+  espSerial.print(",8,1,0,0\r\n");
+  if (!StringHelper::replyIsOK(getReply( 750, true ))) return false;
+  delay(20);
+  setESPBaudRate(rate);
+  return true;
+}
+
+bool probeESPBaudRate()
+{
+  for(byte i=0; i<ESP_BAUD_PROBES; i++) {
+    espSerial.print("AT\r\n");
+    char* reply = getReply( 300, true );
+    if (!StringHelper::replyIsOK(reply) || !StringHelper::isCleanReply(reply)) return false;
+  }
+  return true;
+}
+
+void negotiateBaudRate()
+{
+  for(byte i=esp_baud_first; i<esp_baud_rates_count; i++) {
+    unsigned long rate = pgm_read_dword(&esp_baud_rates[i]);
+    if (rate == BAUD_RATE) break;
+    LOG_INFO(LOG_BAUD_TRY, rate);
+    esp_framing_errors = 0;
+    if (switchESPBaudRate(rate) && probeESPBaudRate()) {
+      esp_baud_index = i;
+      EEPROM_Helper::writeByte(ESP_BAUD_INDEX_ADDR, esp_baud_index);
+      LOG_INFO(LOG_BAUD_SET, esp_baud_rate);
+      return;
+    }
+    // Roll the module back blindly: it may or may not have switched
+    espSerial.print("AT+UART_CUR=");
+    espSerial.print(BAUD_RATE);
+    espSerial.print(",8,1,0,0\r\n");
+    setESPBaudRate(BAUD_RATE);
+    getReply( 300, true );
+  }
+  esp_framing_errors = 0;
+  esp_baud_index = esp_baud_rates_count-1;
+  EEPROM_Helper::writeByte(ESP_BAUD_INDEX_ADDR, esp_baud_index);
+}
+
+// garbage_runs: runs of ESP_GARBAGE_RUN 0x00/0xFF bytes in the reply text.
+// Payload bytes may be anything, so only those count as framing errors.
+void checkFramingErrors(byte garbage_runs)
+{
+  if (esp_baud_rate == BAUD_RATE) return;
+  if (!garbage_runs) {
+    esp_framing_errors = 0;
+    return;
+  }
+  esp_framing_errors++;
+  if (esp_framing_errors >= ESP_FRAMING_ERRORS_MAX) {
+    LOG_WARN(LOG_BAUD_FALLBACK);
+    esp_framing_errors = 0;
+    errors_count++;
+    // Until the next boot only, the next module reset negotiates from the slower speed
+    if (esp_baud_index+1 > esp_baud_first) esp_baud_first = esp_baud_index+1;
+    if (esp_baud_first > esp_baud_rates_count-1) esp_baud_first = esp_baud_rates_count-1;
+    esp_baud_index = esp_baud_rates_count-1;
+    espSerial.print("AT+UART_CUR=");
+    espSerial.print(BAUD_RATE);
+    espSerial.print(",8,1,0,0\r\n");
+    setESPBaudRate(BAUD_RATE);
+  }
 }
 
 bool sendTimeRequestSignal()
@@ -415,15 +912,29 @@ bool sendTimeRequestSignal()
   char* reply = sendMessage(connection_id, "DS_GETTIME=1", MAX_ATTEMPTS);
   return StringHelper::replyIsOK(reply);
 }
-bool sendForecastRequestSignal()
+// version is "1" when no forecast is shown yet, "#<hash>" of the shown one otherwise
+bool sendForecastRequestSignal(String version)
 {
-  char* reply = sendMessage(connection_id, "DS_GETFORECAST=1", MAX_ATTEMPTS);
+  char* reply = sendMessage(connection_id, "DS_GETFORECAST="+version, MAX_ATTEMPTS);
   return StringHelper::replyIsOK(reply);
 }
 
+// Changed state fields to a subscribed server, one attempt, retried with the next push
+bool sendStateChanges()
+{
+  if (!connected_to_server || isReconnecting()) return false;
+  state_publisher->update();
+  if (!state_publisher->isDue()) return false;
+  unsigned fields = state_publisher->take();
+  char* reply = sendMessage(connection_id, "DS_STATE={" + StatePublisher::composeFields(fields) + "}", 0);
+  bool rok = StringHelper::replyIsOK(reply);
+  state_publisher->pushed(fields, rok);
+  return rok;
+}
+
 bool startServer(unsigned connection, unsigned port)
 {
-  DEBUG_WRITELN("Start the server");
+  LOG_INFO(LOG_SERVER_START);
   lcd_controller->setLCDLines("Start local", "server");
   unsigned attempts = 0;
   bool rok = false;
@@ -443,15 +954,21 @@ bool startServer(unsigned connection, unsigned port)
 }
 
 bool closeConnection(unsigned connection) {
-  DEBUG_WRITELN("Closing the server");
+  LOG_INFO(LOG_SERVER_CLOSE);
   lcd_controller->setLCDLines("Close local", "server");
   unsigned attempts = 0;
   bool rok = false;
   char* reply;
+  bool single_link = passthrough_active;
+  leavePassthrough();
   do {
-    espSerial.print("AT+CIPCLOSE=");
-    espSerial.print(connection);
-    espSerial.print("\r\n");
+    if (single_link) {
+      espSerial.print("AT+CIPCLOSE\r\n");
+    } else {
+      espSerial.print("AT+CIPCLOSE=");
+      espSerial.print(connection);
+      espSerial.print("\r\n");
+    }
     reply = getReply( 800, true );
     rok = StringHelper::replyIsOK(reply);
     attempts++;
@@ -462,11 +979,25 @@ bool closeConnection(unsigned connection) {
 
 char* sendMessage(unsigned connection_id, String message, unsigned max_attempts)
 {
-  DEBUG_WRITE("Sending to "); DEBUG_WRITE(connection_id);  DEBUG_WRITELN(" message:");
-  DEBUG_WRITELN(message.c_str());
-  DEBUG_WRITELN(DEBUG_LINE_SEPARATOR);
+  PROFILE_FUNCTION(PROF_SEND_MESSAGE);
+
+  LOG_DEBUG(LOG_SEND_MESSAGE, connection_id, message.length());
   
+  // Pending urgent events go out ahead of this message
+  if (!transmittion_mode) flushEvents();
+
   message = message + "\r\n";
+
+  if (passthrough_active) {
+    if (!passthrough_link_up) {
+      errors_count++;
+      return passthrough_link_closed;
+    }
+    espSerial.print(message.c_str());
+    passthrough_last_write = millis();
+    return passthrough_send_ok;
+  }
+
   unsigned attempts = 0;
   unsigned written = 0;
   unsigned str_length = message.length();
@@ -489,7 +1020,7 @@ char* sendMessage(unsigned connection_id, String message, unsigned max_attempts)
       errors_count++;
       if (max_attempts && attempts<max_attempts) {
         attempts++;
-        DEBUG_WRITELN("Sending Error: Retry");
+        LOG_WARN(LOG_SEND_RETRY);
         continue;
       }
     }
@@ -501,7 +1032,7 @@ char* sendMessage(unsigned connection_id, String message, unsigned max_attempts)
       errors_count++;
       if (max_attempts && attempts<max_attempts) {
         attempts++;
-        DEBUG_WRITELN("Sending Error: Retry");
+        LOG_WARN(LOG_SEND_RETRY);
         continue;
       }
     }
@@ -515,123 +1046,333 @@ char* sendMessage(unsigned connection_id, String message, unsigned max_attempts)
   return reply;
 }
 
-char* readReply(unsigned int wait, bool skip_on_ok)
+char* sendFrame(unsigned connection_id, const byte* data, byte length, unsigned max_attempts)
 {
-  char* result = NULL;
-  if(espSerial.available())
-  {
-    result = getReply( wait, skip_on_ok );
+  PROFILE_FUNCTION(PROF_SEND_FRAME);
+
+  LOG_DEBUG(LOG_SEND_FRAME, connection_id, length);
+
+  if (!transmittion_mode) flushEvents();
+
+  if (passthrough_active) {
+    if (!passthrough_link_up) {
+      errors_count++;
+      return passthrough_link_closed;
+    }
+    espSerial.write(data, length);
+    passthrough_last_write = millis();
+    return passthrough_send_ok;
   }
-  return result;
+
+  // Binary frames carry their own length, no line end and no splitting
+  unsigned attempts = 0;
+  char* reply = NULL;
+  bool rok = false;
+
+  transmittion_mode = true;
+
+  do {
+    espSerial.print("AT+CIPSEND=");
+    espSerial.print(connection_id, DEC);
+    espSerial.print(",");
+    espSerial.print(length, DEC);
+    espSerial.print("\r\n");
+    reply = getReply( 5000, true );
+    rok = StringHelper::replyIsOK(reply);
+    if (rok) {
+      espSerial.write(data, length);
+      reply = getReply( 5000, true );
+      rok = StringHelper::replyIsOK(reply);
+    }
+    if (!rok) {
+      errors_count++;
+      LOG_WARN(LOG_SEND_RETRY);
+    }
+    attempts++;
+  } while (!rok && attempts<=max_attempts);
+
+  transmittion_mode = false;
+
+  return reply;
 }
 
-bool checkReplyQuery(char* message, unsigned* connect_start)
+void setTelemetryFormat(bool binary)
 {
-  bool foundConnect = false;
-  int i;
-  int reply_len = strlen(message);
-  
-  for (i=0; i<reply_len-5; i++)
-  {
-    if ( (message[i]=='+') && (message[i+1]=='I') && (message[i+2]=='P') && (message[i+3]=='D') && (message[i+4]==',') ) { 
-      foundConnect = true;
-      break;
+  telemetry_binary = binary;
+}
+
+bool isTelemetryBinary()
+{
+  return telemetry_binary;
+}
+
+bool sendMessageList(unsigned connection_id, MessageComposer compose, byte count)
+{
+  bool rok = false;
+  unsigned long int burst_start = millis();
+  send_burst_bytes = 0;
+
+  if (!passthrough_active && send_buffer_supported) {
+    rok = sendMessageListPipelined(connection_id, compose, count);
+  }
+  if (passthrough_active || !send_buffer_supported) {
+    // Stop-and-wait for passthrough links and for firmware without AT+CIPSENDBUF
+    char bufr[SEND_WINDOW_BUFFER];
+    rok = true;
+    for(byte i=0; i<count && rok; i++) {
+      compose(i, bufr, SEND_WINDOW_BUFFER);
+      send_burst_bytes += strlen(bufr) + 2;
+      rok = StringHelper::replyIsOK(sendMessage(connection_id, bufr, MAX_ATTEMPTS));
     }
   }
 
-  if (foundConnect && connect_start) {
-    *connect_start = i;
-  }
+  send_burst_millis = millis() - burst_start;
+  return rok;
+}
 
-  return foundConnect;
+unsigned long getSendBurstRate()
+{
+  // Bytes per second of the last descriptor burst
+  return send_burst_millis ? send_burst_bytes*1000/send_burst_millis : 0;
 }
 
-char* readTCPMessage(unsigned int wait, unsigned* tcp_connection_id, bool from_reply_buffer, char* from_reply)
+// Prompt reply of AT+CIPSENDBUF ends with "<segment id>,<last sent segment id>\r\n\r\nOK\r\n>",
+// acks of earlier segments ("<link>,<segment>,SEND OK") may come before it
+bool readSegmentId(const char* reply, const char* prompt, unsigned* segment)
 {
-  char *message = from_reply ? from_reply : readReply( wait, false );
+  const char* ok = prompt;
+  do {
+    if (ok == reply) return false;
+    ok--;
+  } while (strncmp(ok, "OK\r\n", 4)!=0 || (ok>reply && ok[-1]!='\n'));
+  const char* line_end = ok;
+  while (line_end>reply && (line_end[-1]=='\r' || line_end[-1]=='\n')) line_end--;
+  const char* line = line_end;
+  while (line>reply && line[-1]!='\n') line--;
+
+  unsigned next_pos = 0;
+  unsigned long id = StringHelper::readIntFromString(line, 0, &next_pos);
+  if (!next_pos || line[next_pos]!=',') return false;
+  unsigned last_pos = next_pos+1;
+  StringHelper::readIntFromString(line, last_pos, &next_pos);
+  if (next_pos==last_pos || line+next_pos!=line_end) return false;
+  *segment = id;
+  return true;
+}
 
-  if (!message && from_reply_buffer) {
-    message = reply;
+// One attempt at sending the slot message, counted in slot->attempts
+bool sendBufferedSegment(unsigned connection_id, MessageComposer compose, SendSlot* slots, byte slot_num)
+{
+  SendSlot* slot = &slots[slot_num];
+  char bufr[SEND_WINDOW_BUFFER];
+  compose(slot->index, bufr, SEND_WINDOW_BUFFER);
+  unsigned len = strlen(bufr);
+  slot->attempts++;
+
+  espSerial.print("AT+CIPSENDBUF=");
+  espSerial.print(connection_id, DEC);
+  espSerial.print(",");
+  espSerial.print(len+2, DEC);
+  espSerial.print("\r\n");
+  // Acks of earlier segments may arrive mixed with the prompt, so nothing is drained here
+  char* reply = getReplyToken( 2000, ">", false );
+  applySendAcks(reply, connection_id, slots, SEND_WINDOW_SIZE);
+  char* prompt = strrchr(reply, '>');
+  if (!prompt) {
+    errors_count++;
+    // "link is not valid" and the like are errors of the link, not of the command
+    if (strstr(reply, "ERROR") && !strstr(reply, "link") && espLinkStatus()==3) {
+      LOG_WARN(LOG_SENDBUF_UNSUPPORTED);
+      send_buffer_supported = false;
+    }
+    return false;
   }
 
-  if (message) {
-    unsigned i;
-    int reply_len = strlen(message);
-    bool foundConnect = checkReplyQuery(message, &i);
+  if (!readSegmentId(reply, prompt, &slot->segment)) {
+    // The module waits for the data anyway, the slot times out and goes again
+    errors_count++;
+    slot->segment = SEND_SEGMENT_UNKNOWN;
+  }
 
-    if (foundConnect)
-    {
-      bool start = false;
-      bool done = false;
-      if (tcp_connection_id) *tcp_connection_id = 0;
-      for (; i<reply_len && message[i]!=':'; i++) {
-        if (tcp_connection_id && !done) {
-          if (!start && message[i] == ',') {
-            start = true;
-          } else if (start && message[i]>='0' && message[i]<='9') {
-            *tcp_connection_id = StringHelper::readIntFromString(message, i);
-            done = true;
-          }
-        }
-      };
-      i++;
-      
-      if (i<reply_len) 
-      {
-        message = message+i;
-        DEBUG_WRITE("TCP message:"); DEBUG_WRITELN(message);
-        if (from_reply_buffer) {
-          reply[0] = 0;
+  espSerial.print(bufr);
+  espSerial.print("\r\n");
+  slot->state = SEND_SLOT_WAIT;
+  slot->sent_millis = millis();
+  send_burst_bytes += len + 2;
+  return true;
+}
+
+void applySendAcks(char* text, unsigned connection_id, SendSlot* slots, byte slots_count)
+{
+  // Asynchronous confirmations look like "<link id>,<segment id>,SEND OK" or "...,SEND FAIL"
+  char* pos = text;
+  while ((pos = strstr(pos, "SEND "))) {
+    char* line = pos;
+    while (line>text && line[-1]!='\n') line--;
+    unsigned next_pos = 0;
+    unsigned link = StringHelper::readIntFromString(line, 0, &next_pos);
+    if (next_pos && line[next_pos]==',' && link==connection_id) {
+      unsigned segment = StringHelper::readIntFromString(line, next_pos+1);
+      bool sent_ok = strncmp(pos, "SEND OK", 7)==0;
+      for(byte i=0; i<slots_count; i++) {
+        if (slots[i].state==SEND_SLOT_WAIT && slots[i].segment==segment) {
+          slots[i].state = sent_ok ? SEND_SLOT_FREE : SEND_SLOT_FAILED;
         }
-        return message;
       }
     }
+    pos += 5;
+  }
+}
+
+bool sendMessageListPipelined(unsigned connection_id, MessageComposer compose, byte count)
+{
+  SendSlot slots[SEND_WINDOW_SIZE];
+  byte next_index = 0;
+  bool rok = true;
+  unsigned long int start = millis();
+
+  for(byte i=0; i<SEND_WINDOW_SIZE; i++) {
+    slots[i].state = SEND_SLOT_FREE;
+    slots[i].attempts = 0;
+  }
+
+  transmittion_mode = true;
+
+  while (rok) {
+    bool in_flight = false;
+    for(byte i=0; i<SEND_WINDOW_SIZE && rok; i++) {
+      SendSlot* slot = &slots[i];
+      if (slot->state==SEND_SLOT_WAIT && millis()-slot->sent_millis > SEND_WINDOW_TIMEOUT) {
+        slot->state = SEND_SLOT_FAILED;
+      }
+      if (slot->state==SEND_SLOT_FAILED) {
+        // Retransmit only what was not confirmed
+        errors_count++;
+        LOG_WARN(LOG_SEND_RETRY);
+        rok = slot->attempts<MAX_ATTEMPTS;
+      } else if (slot->state==SEND_SLOT_FREE && next_index<count) {
+        slot->index = next_index++;
+        slot->attempts = 0;
+        // Left failed until the send below succeeds
+        slot->state = SEND_SLOT_FAILED;
+      } else {
+        in_flight = in_flight || slot->state!=SEND_SLOT_FREE;
+        continue;
+      }
+      if (rok) sendBufferedSegment(connection_id, compose, slots, i);
+      rok = rok && send_buffer_supported;
+      in_flight = true;
+    }
+    if (rok && !in_flight && next_index>=count) break;
+    if (rok && millis()-start > SEND_WINDOW_DEADLINE) rok = false;
+    if (rok) applySendAcks(getReply( 20, false ), connection_id, slots, SEND_WINDOW_SIZE);
+  }
+
+  transmittion_mode = false;
+  return rok;
+}
+
+char* readReply(unsigned int wait, bool skip_on_ok)
+{
+  char* result = NULL;
+  if(espSerial.available())
+  {
+    result = getReply( wait, skip_on_ok );
+  }
+  return result;
+}
+
+char* readTCPMessage(unsigned int wait, unsigned* tcp_connection_id)
+{
+  if (passthrough_active) {
+    // Server commands come as a raw stream on the server link
+    char *message = readReply( wait, false );
+    if (message && message[0]) {
+      if (tcp_connection_id) *tcp_connection_id = connection_id;
+      LOG_DEBUG(LOG_TCP_MESSAGE, connection_id, strlen(message));
+      return message;
+    }
+    return NULL;
   }
 
-  return NULL;
+  // Frames are collected by every getReply(), only wait when none is complete yet
+  if (!link_buffers->hasReady()) readReply( wait, false );
+
+  char* message = link_buffers->take(tcp_connection_id);
+  if (message) {
+    LOG_DEBUG(LOG_TCP_MESSAGE, tcp_connection_id ? *tcp_connection_id : 0, strlen(message));
+  }
+  return message;
 }
 
 char* getReply(unsigned int wait, bool skip_on_ok)
 {
+  return getReplyToken(wait, skip_on_ok ? "OK" : NULL, true);
+}
+
+char* getReplyToken(unsigned int wait, const char* token, bool drain_tail)
+{
+  PROFILE_FUNCTION(PROF_GET_REPLY);
   char c;
   int tempPos = 0;
   int lastPos = 0;
+  int token_len = token ? strlen(token) : 0;
+  byte garbage_bytes = 0;
+  byte garbage_runs = 0;
   unsigned long int rtime = millis()+wait;
-  bool foundOK = false;
-  while( rtime > millis() && (!skip_on_ok || !foundOK))
+  bool foundToken = false;
+  bool frameComplete = false;
+  while( rtime > millis() && !foundToken && !frameComplete)
   {
+    // Keep the background sensor reads going while the ESP is busy
+    sensorsProcess();
     lastPos = tempPos;
     while(espSerial.available())
     {
       c = espSerial.read(); 
-      if (tempPos < REPLY_BUFFER) { reply[tempPos] = c; tempPos++; }
+      byte kind = passthrough_active ? LINK_TEXT : link_buffers->feed(c);
+      if (kind == LINK_TEXT) {
+        if ((byte)c == 0x00 || (byte)c == 0xFF) {
+          if (++garbage_bytes == ESP_GARBAGE_RUN && garbage_runs < 255) garbage_runs++;
+          // A NUL would cut the reply text short
+          if (!c) continue;
+        } else {
+          garbage_bytes = 0;
+        }
+        if (tempPos < REPLY_BUFFER-1) { reply[tempPos] = c; tempPos++; }
+      } else if (kind == LINK_FRAME_START) {
+        // "+IPD" is already in the reply text
+        tempPos = tempPos>4 ? tempPos-4 : 0;
+        if (lastPos > tempPos) lastPos = tempPos;
+      } else if (kind == LINK_FRAME_END && !token) {
+        // Incoming data ends with its +IPD frame, no need to wait out the timeout
+        frameComplete = true;
+      }
     }
     reply[tempPos] = 0;
-    if (skip_on_ok && tempPos>lastPos) {
-      if (lastPos>1) lastPos-=2;
-      for (; lastPos<tempPos-1; lastPos++)
-      {
-        if ( (reply[lastPos]=='O') && (reply[lastPos+1]=='K') ) { 
-          foundOK = true;
+    // Server commands in passthrough mode end with their line, the timeout is only the upper bound
+    if (passthrough_active && !token && tempPos>lastPos && reply[tempPos-1]=='\n') frameComplete = true;
+    if (token && tempPos>lastPos) {
+      lastPos = lastPos>token_len ? lastPos-token_len : 0;
+      if (strstr(reply+lastPos, token)) {
+        foundToken = true;
+        if (drain_tail) {
+          // Skip the rest of the reply text, but keep any +IPD frame in it
           delay(30);
-          while(espSerial.available()) { espSerial.read(); }
-          DEBUG_WRITELN("Found OK");
-          break;
+          while(espSerial.available()) {
+            c = espSerial.read();
+            if (!passthrough_active) link_buffers->feed(c);
+          }
         }
+        LOG_DEBUG(LOG_REPLY_TOKEN, tempPos);
       }
     }
   }
 
-  if (!in_configuration_mode && checkReplyQuery(reply, NULL)) {
-    executeInputMessage(reply);
-    reply[0] = 0;
-  }
+  if (tempPos || garbage_runs) checkFramingErrors(garbage_runs);
+  if (passthrough_active && tempPos) checkPassthroughLink(reply);
 
-  DEBUG_WRITELN(DEBUG_LINE_SEPARATOR); 
-  if (reply[0]) {
-    DEBUG_WRITELN(reply); DEBUG_WRITELN(DEBUG_LINE_SEPARATOR);
-  }
+  if (reply[0]) LOG_DEBUG(LOG_REPLY, tempPos);
 
   return reply;
 }
-
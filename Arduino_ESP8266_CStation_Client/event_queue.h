@@ -0,0 +1,212 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#define EVENT_PRESENCE 0x01
+#define EVENT_NOISE    0x02
+#define EVENT_OUTER    0x04
+#define EVENT_BUTTON   0x08
+#define EVENT_MAGNETIC 0x10
+#define EVENT_TYPES 5
+
+#define EVENT_COALESCE_WINDOW 20
+#define EVENT_RETRY_INTERVAL 200
+#define EVENT_MAX_ATTEMPTS 3
+#define EVENT_LATENCY_TARGET 250
+
+class EventQueue
+{
+  private:
+    /* pending events, posted from ISRs */
+    volatile byte pending;
+    /* the same events for on-device consumers, taken regardless of the link */
+    volatile byte local_pending;
+    volatile unsigned long int edge_millis[EVENT_TYPES];
+    /* events of the frame being sent and the ones of them posted again meanwhile */
+    volatile byte in_flight;
+    volatile byte reposted;
+    unsigned long int flight_edge_millis;
+
+    byte attempts;
+    unsigned long int next_try_millis;
+
+    /* edge-to-ack statistics */
+    unsigned long int latency_last;
+    unsigned long int latency_max;
+    unsigned long int sent_count;
+    unsigned long int late_count;
+    unsigned long int dropped_count;
+
+    EventQueue()
+    {
+      pending = 0;
+      local_pending = 0;
+      for(byte i=0; i<EVENT_TYPES; i++) edge_millis[i] = 0;
+      in_flight = 0;
+      reposted = 0;
+      flight_edge_millis = 0;
+      attempts = 0;
+      next_try_millis = 0;
+      latency_last = 0;
+      latency_max = 0;
+      sent_count = 0;
+      late_count = 0;
+      dropped_count = 0;
+    }
+
+  public:
+    static EventQueue *_self_controller;
+
+    static EventQueue* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new EventQueue();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // From ISRs and from loop(): edges of already pending events just coalesce,
+    // unless the event is being sent, then it is a new edge for the next frame
+    void post(byte events)
+    {
+      uint8_t sreg = SREG;
+      cli();
+      unsigned long int curr_millis = millis();
+      if (!pending) next_try_millis = curr_millis + EVENT_COALESCE_WINDOW;
+      for(byte i=0; i<EVENT_TYPES; i++) {
+        if ((events & (~pending | in_flight)) & (1<<i)) edge_millis[i] = curr_millis;
+      }
+      reposted |= events & in_flight;
+      pending |= events;
+      local_pending |= events;
+      SREG = sreg;
+      // loop() may be asleep on a deadline computed before this event
+      sleep_controller->wake();
+    }
+
+    bool isDue()
+    {
+      noInterrupts();
+      unsigned long int try_millis = next_try_millis;
+      byte events = pending;
+      interrupts();
+      return events && (long)(millis() - try_millis) >= 0;
+    }
+
+    // ms until the pending events are due
+    unsigned long idleTime()
+    {
+      noInterrupts();
+      unsigned long int try_millis = next_try_millis;
+      byte events = pending;
+      interrupts();
+      if (!events) return SLEEP_IDLE_MAX;
+      long left = (long)(try_millis - millis());
+      return left > 0 ? left : 0;
+    }
+
+    bool hasLocalEvents()
+    {
+      return local_pending;
+    }
+
+    // Events posted since the last call, for the rule engine
+    byte takeLocalEvents()
+    {
+      noInterrupts();
+      byte events = local_pending;
+      local_pending = 0;
+      interrupts();
+      return events;
+    }
+
+    byte getPending()
+    {
+      return pending;
+    }
+
+    // Events already reported by other means (e.g. periodic telemetry)
+    void discard(byte events)
+    {
+      noInterrupts();
+      pending &= ~events;
+      interrupts();
+    }
+
+    // Called before an event frame goes out
+    void begin(byte events)
+    {
+      noInterrupts();
+      in_flight = events;
+      reposted = 0;
+      flight_edge_millis = millis();
+      for(byte i=0; i<EVENT_TYPES; i++) {
+        if ((events & (1<<i)) && (long)(edge_millis[i] - flight_edge_millis) < 0) flight_edge_millis = edge_millis[i];
+      }
+      interrupts();
+    }
+
+    // Called after the event frame of begin() went out. Returns the events that
+    // left the queue (sent or out of attempts); the ones posted again while
+    // the frame was on its way stay queued for the next frame.
+    byte complete(byte events, bool sended)
+    {
+      unsigned long int curr_millis = millis();
+      unsigned long int latency = curr_millis - flight_edge_millis;
+      byte left = 0;
+      noInterrupts();
+      byte renewed = reposted & events;
+      in_flight = 0;
+      reposted = 0;
+      bool drop = !sended && ++attempts >= EVENT_MAX_ATTEMPTS;
+      if (sended || drop) {
+        left = events & ~renewed;
+        pending &= ~left;
+        attempts = 0;
+      }
+      next_try_millis = curr_millis + (sended || drop ? 0 : EVENT_RETRY_INTERVAL);
+      interrupts();
+
+      if (sended) {
+        latency_last = latency;
+        if (latency_last > latency_max) latency_max = latency_last;
+        if (latency_last > EVENT_LATENCY_TARGET) late_count++;
+        sent_count++;
+      } else if (drop) {
+        dropped_count++;
+      }
+      return left;
+    }
+
+    unsigned long getLastLatency()
+    {
+      return latency_last;
+    }
+
+    unsigned long getMaxLatency()
+    {
+      return latency_max;
+    }
+
+    unsigned long getLateCount()
+    {
+      return late_count;
+    }
+
+    unsigned long getDroppedCount()
+    {
+      return dropped_count;
+    }
+};
+
+EventQueue *EventQueue::_self_controller = NULL;
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef FEATURE_SET_H
+#define FEATURE_SET_H
+
+// Compile time feature sets. CSTATION_FEATURES picks one of the sets below
+// and a single CSTATION_FEATURE_* can still be set to 0 or 1 with -D to
+// override it. A disabled subsystem leaves its rows out of SENSORS_TABLE and
+// CONTROLS_TABLE, its command handlers out of executeInputMessage() and its
+// code and buffers out of the build; the controllers the rest of the sketch
+// talks to are replaced with empty stand-ins that compile to nothing.
+// tools/feature_size/feature_size.sh builds every set and reports its size.
+
+// No set is 0: #if reads an unknown (misspelled) name as 0, which then hits the #error
+// Everything
+#define CSTATION_FEATURES_FULL 1
+// No LCD, buzzer or guard mode: a sensor box reporting to the server
+#define CSTATION_FEATURES_HEADLESS 2
+// Headless without the magnetometer and the configuration mode, the
+// connection settings already in EEPROM from a full build
+#define CSTATION_FEATURES_MINIMAL 3
+
+#ifndef CSTATION_FEATURES
+  #define CSTATION_FEATURES CSTATION_FEATURES_FULL
+#endif
+
+// Literal 0/1 only, FEATURE_ROW() pastes them into macro names
+#if CSTATION_FEATURES == CSTATION_FEATURES_FULL
+  #define FEATURES_DEFAULT_LCD 1
+  #define FEATURES_DEFAULT_BUZZER 1
+  #define FEATURES_DEFAULT_GUARD 1
+  #define FEATURES_DEFAULT_MAGNETOMETER 1
+  #define FEATURES_DEFAULT_CONFIG_MODE 1
+#elif CSTATION_FEATURES == CSTATION_FEATURES_HEADLESS
+  #define FEATURES_DEFAULT_LCD 0
+  #define FEATURES_DEFAULT_BUZZER 0
+  #define FEATURES_DEFAULT_GUARD 0
+  #define FEATURES_DEFAULT_MAGNETOMETER 1
+  #define FEATURES_DEFAULT_CONFIG_MODE 1
+#elif CSTATION_FEATURES == CSTATION_FEATURES_MINIMAL
+  #define FEATURES_DEFAULT_LCD 0
+  #define FEATURES_DEFAULT_BUZZER 0
+  #define FEATURES_DEFAULT_GUARD 0
+  #define FEATURES_DEFAULT_MAGNETOMETER 0
+  #define FEATURES_DEFAULT_CONFIG_MODE 0
+#else
+  #error "Unknown CSTATION_FEATURES"
+#endif
+
+// LCD pages, alarm hour and hourly beep, forecast requests
+#ifndef CSTATION_FEATURE_LCD
+  #define CSTATION_FEATURE_LCD FEATURES_DEFAULT_LCD
+#endif
+// Tones and the melody player
+#ifndef CSTATION_FEATURE_BUZZER
+  #define CSTATION_FEATURE_BUZZER FEATURES_DEFAULT_BUZZER
+#endif
+// The built-in melodies, without them only the custom one in EEPROM plays
+#ifndef CSTATION_FEATURE_MELODIES
+  #define CSTATION_FEATURE_MELODIES CSTATION_FEATURE_BUZZER
+#endif
+// Watch mode toggled by the reset button
+#ifndef CSTATION_FEATURE_GUARD
+  #define CSTATION_FEATURE_GUARD FEATURES_DEFAULT_GUARD
+#endif
+// HMC5883L field vector and anomaly detector
+#ifndef CSTATION_FEATURE_MAGNETOMETER
+  #define CSTATION_FEATURE_MAGNETOMETER FEATURES_DEFAULT_MAGNETOMETER
+#endif
+// ESP access point and DS_SETUP server for the connection settings
+#ifndef CSTATION_FEATURE_CONFIG_MODE
+  #define CSTATION_FEATURE_CONFIG_MODE FEATURES_DEFAULT_CONFIG_MODE
+#endif
+
+#if CSTATION_FEATURE_MELODIES && !CSTATION_FEATURE_BUZZER
+  #error "CSTATION_FEATURE_MELODIES needs CSTATION_FEATURE_BUZZER"
+#endif
+
+// Table row kept only when the feature is enabled: FEATURE_ROW(CSTATION_FEATURE_LCD, X(...))
+#define FEATURE_ROW(feature, ...) FEATURE_ROW_EXPANDED(feature, __VA_ARGS__)
+#define FEATURE_ROW_EXPANDED(feature, ...) FEATURE_ROW_##feature(__VA_ARGS__)
+#define FEATURE_ROW_0(...)
+#define FEATURE_ROW_1(...) __VA_ARGS__
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+// Decimal fixed point number: value = raw / 10^decimals.
+// Formatting rounds half away from zero like String(float, digits).
+class FixedPoint
+{
+  public:
+    long raw;
+    byte decimals;
+
+    FixedPoint(long value, byte value_decimals)
+    {
+      raw = value;
+      decimals = value_decimals;
+    }
+
+    static unsigned long pow10(byte n)
+    {
+      unsigned long result = 1;
+      while (n--) result *= 10;
+      return result;
+    }
+
+    // round(a*b/c) for a*b that does not fit 32 bits; (a%c)*b must fit
+    static unsigned long mulDivRound(unsigned long a, unsigned long b, unsigned long c)
+    {
+      return (a / c) * b + ((a % c) * b + c / 2) / c;
+    }
+
+    // Raw value rescaled to the given number of decimals
+    long scaled(byte digits) const
+    {
+      if (digits >= decimals) return raw * (long)pow10(digits - decimals);
+      unsigned long div = pow10(decimals - digits);
+      unsigned long abs_raw = raw < 0 ? -raw : raw;
+      long result = (abs_raw + div / 2) / div;
+      return raw < 0 ? -result : result;
+    }
+
+    String toString(byte digits) const
+    {
+      long value = scaled(digits);
+      unsigned long abs_value = value < 0 ? -value : value;
+      unsigned long div = pow10(digits);
+      String result = raw < 0 ? "-" : "";
+      result = result + String(abs_value / div);
+      if (digits) {
+        String fraction = String(abs_value % div);
+        result = result + ".";
+        for(byte i=fraction.length(); i<digits; i++) result = result + "0";
+        result = result + fraction;
+      }
+      return result;
+    }
+};
+
+#endif
@@ -3,8 +3,10 @@
 
 #define WATCH_MODE_DELAY_TIME 30000
 #define WATCH_MODE_DELAY_TIME_ALERT 90000
-#define WATCH_MODE_BLINK_INTERVAL1 500000L
-#define WATCH_MODE_BLINK_INTERVAL2 1000000L
+#define WATCH_MODE_BLINK_INTERVAL1 500
+#define WATCH_MODE_BLINK_INTERVAL2 1000
+
+#if CSTATION_FEATURE_GUARD
 
 class GuardController 
 {
@@ -14,9 +16,16 @@ class GuardController
   	bool is_watch_delay, is_alert_delay;
   	volatile bool has_presence;
   	unsigned long int watch_delay_millis;
+  	SoftTimer blink_timer;
+
+    static void blinkTimerSignal(void* context)
+    {
+      ((GuardController*)context)->periodTimerSignal();
+    }
 
     GuardController() 
     {
+      SoftTimers::init(&blink_timer, blinkTimerSignal, this);
       watch_mode = false;
       is_watch_delay = false;
       is_alert_delay = false;
@@ -61,8 +70,7 @@ class GuardController
   			has_presence = false;
   			watch_delay_millis = millis();
   			ind_controller->setBlue(false);
-  			startTimer1(WATCH_MODE_BLINK_INTERVAL1);
-  			resetTimer1();
+  			soft_timers->start(&blink_timer, WATCH_MODE_BLINK_INTERVAL1);
   			tone_controller->FastToneSignal(1000, 200);
   		} else {
   			watch_mode = false;
@@ -70,7 +78,7 @@ class GuardController
   			is_alert_delay = false;
   			has_presence = false;
   			watch_delay_millis = 0;
-  			pauseTimer1();
+  			soft_timers->stop(&blink_timer);
   			ind_controller->setBlue(false);
   			ind_controller->setLight(false);
   			tone_controller->StopTone();
@@ -82,6 +90,11 @@ class GuardController
   	{
   		has_presence = true;
   	}
+
+  	bool isWatchMode()
+  	{
+  		return watch_mode;
+  	}
 	
     void timerProcess(bool reset_btn_pressed)
     {
@@ -91,9 +104,7 @@ class GuardController
 					is_watch_delay = false;
 					is_alert_delay = false;
 					has_presence = false;
-					pauseTimer1();
-					startTimer1(WATCH_MODE_BLINK_INTERVAL2);
-					resetTimer1();
+					soft_timers->start(&blink_timer, WATCH_MODE_BLINK_INTERVAL2);
 					tone_controller->StopTone();
 					tone_controller->FastToneSignal(500, 1200);
 					ind_controller->setLight(false);
@@ -105,9 +116,7 @@ class GuardController
 					has_presence = false;
 					watch_delay_millis = millis();
 					ind_controller->setLight(true);
-					pauseTimer1();
-					startTimer1(WATCH_MODE_BLINK_INTERVAL1);
-					resetTimer1();
+					soft_timers->start(&blink_timer, WATCH_MODE_BLINK_INTERVAL1);
 					tone_controller->StopTone();
 					tone_controller->StartTone(800, 500);
 				}
@@ -115,13 +124,39 @@ class GuardController
 		}
 	    if (reset_btn_pressed) toggleWatchMode();
     }
+
+    // ms until timerProcess() has something to do
+    unsigned long idleTime()
+    {
+      if (!watch_mode) return SLEEP_IDLE_MAX;
+      if (!is_watch_delay) return has_presence ? 0 : SLEEP_IDLE_MAX;
+      return SleepController::remaining(watch_delay_millis, (is_alert_delay ? WATCH_MODE_DELAY_TIME_ALERT : WATCH_MODE_DELAY_TIME) + 1);
+    }
 };
 
-ISR(timer1Event)
+#else
+
+// Stand-in for builds without the watch mode, the calls compile to nothing
+class GuardController
 {
-  resetTimer1();
-  GuardController::Instance()->periodTimerSignal();
-}
+  public:
+    static GuardController *_self_controller;
+
+    static GuardController* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new GuardController();
+      }
+      return _self_controller;
+    }
+
+    void fixPresence() {}
+    bool isWatchMode() { return false; }
+    void timerProcess(bool reset_btn_pressed) {}
+    unsigned long idleTime() { return SLEEP_IDLE_MAX; }
+};
+
+#endif
 
 GuardController *GuardController::_self_controller = NULL;
 
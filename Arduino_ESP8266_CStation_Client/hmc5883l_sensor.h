@@ -0,0 +1,176 @@
+#ifndef HMC5883L_SENSOR_H
+#define HMC5883L_SENSOR_H
+
+#define HMC5883L_ADDR 0x1E
+
+#define HMC5883L_REG_CONFIG_A 0x00
+#define HMC5883L_REG_OUT_X_M 0x03
+#define HMC5883L_REG_IDENT_A 0x0A
+
+// 2 samples averaged, 30 Hz output rate, normal measurement
+#define HMC5883L_CONFIG_A 0x34
+// Range +-1.3 Ga, 0.92 mG per digit
+#define HMC5883L_CONFIG_B 0x20
+#define HMC5883L_MODE_CONTINUOUS 0x00
+#define HMC5883L_MG_PER_DIGIT_X100 92
+
+// Native output rate, one read per sample
+#define HMC5883L_SAMPLE_INTERVAL 33
+#define HMC5883L_RING_SIZE 8
+
+// HMC5883L magnetometer in continuous mode on the TWI queue. Every output
+// sample is read in the background; the TWI completion callback stores it
+// in a ring buffer and loop() drains it through nextSample().
+class HMC5883LSensor
+{
+  private:
+    TWIJob job;
+    byte command[4];
+    byte data[6];
+    unsigned long int read_millis;
+    bool has_value;
+    long axis[3];
+
+    /* raw X, Y, Z samples, written from the TWI ISR */
+    int16_t ring[HMC5883L_RING_SIZE][3];
+    volatile byte ring_head;
+    volatile byte ring_count;
+    volatile unsigned long int overruns;
+    unsigned long int samples;
+
+    // TWI ISR
+    static void sampleRead(TWIJob* done_job)
+    {
+      if (done_job->status == TWI_JOB_DONE) ((HMC5883LSensor*)done_job->context)->pushSample();
+    }
+
+    void pushSample()
+    {
+      if (ring_count >= HMC5883L_RING_SIZE) {
+        // loop() fell behind, drop the oldest sample
+        ring_head = (ring_head + 1) % HMC5883L_RING_SIZE;
+        ring_count--;
+        overruns++;
+      }
+      int16_t* sample = ring[(ring_head + ring_count) % HMC5883L_RING_SIZE];
+      sample[0] = (data[0]<<8) | data[1];
+      sample[2] = (data[2]<<8) | data[3];
+      sample[1] = (data[4]<<8) | data[5];
+      ring_count++;
+    }
+
+    // Raw counts to mG, rounded half away from zero like String(float, 0)
+    static long toMilliGauss(int16_t value)
+    {
+      long scaled = (long)value * HMC5883L_MG_PER_DIGIT_X100;
+      return (scaled + (scaled < 0 ? -50 : 50)) / 100;
+    }
+
+  public:
+    HMC5883LSensor()
+    {
+      job.status = TWI_JOB_IDLE;
+      read_millis = 0;
+      has_value = false;
+      axis[0] = axis[1] = axis[2] = 0;
+      ring_head = 0;
+      ring_count = 0;
+      overruns = 0;
+      samples = 0;
+    }
+
+    bool begin()
+    {
+      job.address = HMC5883L_ADDR;
+      job.write_data = command;
+      job.read_data = data;
+      job.callback = NULL;
+      job.context = NULL;
+
+      command[0] = HMC5883L_REG_IDENT_A;
+      job.write_length = 1;
+      job.read_length = 3;
+      if (!twi_queue->execute(&job, TWI_PRIORITY_HIGH) || data[0]!='H' || data[1]!='4' || data[2]!='3') return false;
+
+      command[0] = HMC5883L_REG_CONFIG_A;
+      command[1] = HMC5883L_CONFIG_A;
+      command[2] = HMC5883L_CONFIG_B;
+      command[3] = HMC5883L_MODE_CONTINUOUS;
+      job.write_length = 4;
+      job.read_length = 0;
+      if (!twi_queue->execute(&job, TWI_PRIORITY_HIGH)) return false;
+
+      // Reads of the X, Z, Y output registers from now on
+      command[0] = HMC5883L_REG_OUT_X_M;
+      job.write_length = 1;
+      job.read_length = 6;
+      job.callback = sampleRead;
+      job.context = this;
+      read_millis = millis();
+      return true;
+    }
+
+    // ms until process() has something to do, 0 while samples wait in the buffer
+    unsigned long idleTime()
+    {
+      if (job.read_length != 6) return SLEEP_IDLE_MAX;
+      if (ring_count) return 0;
+      return SleepController::remaining(read_millis, HMC5883L_SAMPLE_INTERVAL);
+    }
+
+    // Called from loop(): keeps one read in flight per output sample
+    void process()
+    {
+      if (twi_queue->isBusy(&job) || job.read_length != 6) return;
+      unsigned long int elapsed = millis() - read_millis;
+      if (elapsed >= HMC5883L_SAMPLE_INTERVAL) {
+        // Keep the sample rate, but don't catch up on reads missed while loop() was held up
+        read_millis = elapsed < 2*HMC5883L_SAMPLE_INTERVAL ? read_millis + HMC5883L_SAMPLE_INTERVAL : millis();
+        twi_queue->submit(&job, TWI_PRIORITY_HIGH);
+      }
+    }
+
+    // Oldest buffered sample in mG, false when the buffer is empty
+    bool nextSample(long* x, long* y, long* z)
+    {
+      int16_t sample[3];
+      noInterrupts();
+      if (!ring_count) {
+        interrupts();
+        return false;
+      }
+      for(byte i=0; i<3; i++) sample[i] = ring[ring_head][i];
+      ring_head = (ring_head + 1) % HMC5883L_RING_SIZE;
+      ring_count--;
+      interrupts();
+      for(byte i=0; i<3; i++) axis[i] = toMilliGauss(sample[i]);
+      *x = axis[0];
+      *y = axis[1];
+      *z = axis[2];
+      has_value = true;
+      samples++;
+      return true;
+    }
+
+    bool hasValue()
+    {
+      return has_value;
+    }
+
+    unsigned long getSamplesCount()
+    {
+      return samples;
+    }
+
+    unsigned long getOverruns()
+    {
+      return overruns;
+    }
+
+    // Last drained field vector in mG
+    long getX() { return axis[0]; }
+    long getY() { return axis[1]; }
+    long getZ() { return axis[2]; }
+};
+
+#endif
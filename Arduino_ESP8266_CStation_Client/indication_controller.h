@@ -22,12 +22,16 @@
 #define FAN_MAX_PERIOD_OFF_LENGTH 180000
 #define FAN_MIN_PERIOD_ON_LENGTH 90000
 #define FAN_MAX_PERIOD_ON_LENGTH 25000
-#define FAN_COUNTER_PER_MINUTE_FOR_PERM_ON 10.0
-#define FAN_COUNTER_PER_MINUTE_FOR_MAX 8.0
-#define FAN_COUNTER_PER_MINUTE_FOR_MIN 2.0
-#define FAN_COUNTER_PER_MINUTE_FOR_PERM_OFF 0.9
-#define FAN_MIN_TIMEOUT_CUT 0.2
-#define FAN_MAX_TIMEOUT_CUT 1.0
+// Presence counter rates in tenths per minute
+#define FAN_COUNTER_PER_MINUTE_FOR_PERM_ON 100
+#define FAN_COUNTER_PER_MINUTE_FOR_MAX 80
+#define FAN_COUNTER_PER_MINUTE_FOR_MIN 20
+#define FAN_COUNTER_PER_MINUTE_FOR_PERM_OFF 9
+// Period lengths above are whole seconds
+#define FAN_PERIOD_STEP 1000
+// Timeout cut in percent
+#define FAN_MIN_TIMEOUT_CUT 20
+#define FAN_MAX_TIMEOUT_CUT 100
 
 class IndicationController 
 {
@@ -131,6 +135,12 @@ class IndicationController
       light_g4_state = state;
       digitalWrite(LIGHT_PIN, state ? HIGH : LOW);
     }
+    // Light switched by a rule: in auto mode it goes off after LIGHT_AUTO_TIMEOUT_LENGTH as usual
+    void switchLight(bool state)
+    {
+      setLight(state);
+      light_last_time_state = millis();
+    }
     void setFan(bool state)
     {
       fan_state = state;
@@ -244,44 +254,64 @@ class IndicationController
       }
     }
 
+    // ms until timerProcess() has something to do
+    unsigned long idleTime()
+    {
+      unsigned long idle = SLEEP_IDLE_MAX;
+      if (fan_auto_state) {
+        unsigned long fan_idle = SleepController::remaining(fan_last_time_state, (unsigned long)fan_curr_timeout + 1);
+        if (fan_idle < idle) idle = fan_idle;
+      }
+      if (light_g4_auto_state) {
+        if (light_need_update) return 0;
+        if (light_g4_state) {
+          unsigned long light_idle = SleepController::remaining(light_last_time_state, LIGHT_AUTO_TIMEOUT_LENGTH + 1);
+          if (light_idle < idle) idle = light_idle;
+        }
+      }
+      return idle;
+    }
+
     void nextFanState(bool nextstate, unsigned long old_timeout_inc) 
     {
-      DEBUG_WRITE("nextFanState:");DEBUG_WRITELN(fan_increment);
+      PROFILE_FUNCTION(PROF_NEXT_FAN_STATE);
+      LOG_DEBUG(LOG_FAN_NEXT, fan_increment);
       
       unsigned long last_fan_curr_timeout = fan_curr_timeout;
       long custom_increment = fan_increment;
       if (light_g4_state) custom_increment-=3;
       if (getState(STATE_TONE)) custom_increment-=6;
       if (custom_increment<0) custom_increment = 0;
-      float nfreq = fan_curr_timeout/60000.0;
-      if (nfreq<=0) nfreq = 1;
-      nfreq = custom_increment / nfreq;
-      if (!nextstate && nfreq>=FAN_COUNTER_PER_MINUTE_FOR_PERM_ON) {
+      // Any count above 255 is far beyond FAN_COUNTER_PER_MINUTE_FOR_PERM_ON, clamping keeps the math in 32 bits
+      if (custom_increment>255) custom_increment = 255;
+      // nfreq = custom_increment*60000/fan_curr_timeout, kept as the fraction nfreq_num/nfreq_den (in tenths)
+      unsigned long nfreq_den = fan_curr_timeout ? fan_curr_timeout : 60000;
+      unsigned long nfreq_num = custom_increment * 600000UL;
+      if (!nextstate && nfreq_num>=FAN_COUNTER_PER_MINUTE_FOR_PERM_ON*nfreq_den) {
         nextstate = true;
-      } else if (nextstate && nfreq<=FAN_COUNTER_PER_MINUTE_FOR_PERM_OFF) {
+      } else if (nextstate && nfreq_num<=FAN_COUNTER_PER_MINUTE_FOR_PERM_OFF*nfreq_den) {
         nextstate = false;
       }
-      if (nfreq<FAN_COUNTER_PER_MINUTE_FOR_MIN) nfreq = FAN_COUNTER_PER_MINUTE_FOR_MIN;
-      if (nfreq>FAN_COUNTER_PER_MINUTE_FOR_MAX) nfreq = FAN_COUNTER_PER_MINUTE_FOR_MAX;
-      nfreq = (nfreq-FAN_COUNTER_PER_MINUTE_FOR_MIN)/(FAN_COUNTER_PER_MINUTE_FOR_MAX - FAN_COUNTER_PER_MINUTE_FOR_MIN);
+      if (nfreq_num<FAN_COUNTER_PER_MINUTE_FOR_MIN*nfreq_den) nfreq_num = FAN_COUNTER_PER_MINUTE_FOR_MIN*nfreq_den;
+      if (nfreq_num>FAN_COUNTER_PER_MINUTE_FOR_MAX*nfreq_den) nfreq_num = FAN_COUNTER_PER_MINUTE_FOR_MAX*nfreq_den;
+      nfreq_num -= FAN_COUNTER_PER_MINUTE_FOR_MIN*nfreq_den;
+      nfreq_den *= FAN_COUNTER_PER_MINUTE_FOR_MAX - FAN_COUNTER_PER_MINUTE_FOR_MIN;
       if (nextstate) {
-        fan_curr_timeout = round(nfreq * (FAN_MIN_PERIOD_ON_LENGTH - FAN_MAX_PERIOD_ON_LENGTH)) + FAN_MAX_PERIOD_ON_LENGTH;
+        fan_curr_timeout = FixedPoint::mulDivRound(nfreq_num * ((FAN_MIN_PERIOD_ON_LENGTH - FAN_MAX_PERIOD_ON_LENGTH) / FAN_PERIOD_STEP), FAN_PERIOD_STEP, nfreq_den) + FAN_MAX_PERIOD_ON_LENGTH;
       } else {
-        fan_curr_timeout = round(nfreq * (FAN_MAX_PERIOD_OFF_LENGTH - FAN_MIN_PERIOD_OFF_LENGTH)) + FAN_MIN_PERIOD_OFF_LENGTH;
+        fan_curr_timeout = FixedPoint::mulDivRound(nfreq_num * ((FAN_MAX_PERIOD_OFF_LENGTH - FAN_MIN_PERIOD_OFF_LENGTH) / FAN_PERIOD_STEP), FAN_PERIOD_STEP, nfreq_den) + FAN_MIN_PERIOD_OFF_LENGTH;
       }
       if (old_timeout_inc) {
-        float old_state_k = 1 - old_timeout_inc / last_fan_curr_timeout;
+        long old_state_k = last_fan_curr_timeout ? 100 - (long)(old_timeout_inc / last_fan_curr_timeout) * 100 : 0;
         if (old_state_k<FAN_MIN_TIMEOUT_CUT) old_state_k = FAN_MIN_TIMEOUT_CUT;
         if (old_state_k>FAN_MAX_TIMEOUT_CUT) old_state_k = FAN_MAX_TIMEOUT_CUT;
-        fan_curr_timeout = round(fan_curr_timeout * old_state_k);
+        fan_curr_timeout = ((unsigned long)fan_curr_timeout * old_state_k + 50) / 100;
       }
       fan_last_time_state = millis();
-      fan_increment = floor(fan_increment*0.75);
+      fan_increment = (fan_increment * 3) >> 2;
       setFan(nextstate);
 
-      DEBUG_WRITELN("FAN state changed"); 
-      DEBUG_WRITE("NFREQ:");DEBUG_WRITELN(nfreq);
-      DEBUG_WRITE("Timeout:");DEBUG_WRITELN(fan_curr_timeout);
+      LOG_DEBUG(LOG_FAN_CHANGED, FixedPoint::mulDivRound(nfreq_num, 1000, nfreq_den), fan_curr_timeout);
     }
 
     void updateLightLevel(uint16_t lux)
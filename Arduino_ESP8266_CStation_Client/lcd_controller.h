@@ -14,6 +14,8 @@
 #define LCD_AUTO_TURNOFF_MSTIME 100000
 #define LCD_AUTO_TURNPAGE_MSTIME 7000
 #define LCD_AUTO_UPDTIME_MSTIME 30000
+// Clock redraw latency while idle
+#define LCD_CLOCK_IDLE_STEP 10
 
 #define LCD_PAGES_COUNT 5
 #define LCD_PAGE_SYSTEM 0
@@ -27,10 +29,12 @@
 
 #define NO_HOUR 255
 
+#if CSTATION_FEATURE_LCD
+
 class LCDController 
 {
   private:
-    LiquidCrystal_I2C *lcd;
+    LCDDisplay *lcd;
     byte lcd_addr;
     
     bool fixed_page;
@@ -80,22 +84,21 @@ class LCDController
         lcd_addr = LCD_I2C_ADDR;
         EEPROM_Helper::writeByte(LCD_I2C_ADDR_ADDR, lcd_addr);
       }
-      lcd = new LiquidCrystal_I2C(lcd_addr, 16, 2);
+      lcd = new LCDDisplay(lcd_addr);
       initLCD();
     }
 
     void changeLCDI2CAddr(byte new_lcd_addr)
     {
       if (!lcd_addr || lcd_addr==0xFF) return;
-      lcd->clear();
+      // The old display may still have a line job queued
+      while (lcd->isBusy()) twi_queue->process();
       delete lcd;
       lcd_addr = new_lcd_addr;
       EEPROM_Helper::writeByte(LCD_ALARM_HOUR_ADDR, lcd_addr);
-      lcd = new LiquidCrystal_I2C(lcd_addr, 16, 2);
+      lcd = new LCDDisplay(lcd_addr);
       lcd->init();
-      lcd->backlight();
-      lcd->home(); 
-      lcd->clear(); 
+      text_changed = true;
       if (!lcd_auto_state) {
         setLCDState(lcd_ison);
       }
@@ -115,9 +118,6 @@ class LCDController
       page_num = 0;
       page_to = 0;
       lcd->init();
-      lcd->backlight();
-      lcd->home(); 
-      lcd->clear(); 
       last_auto_state = last_pager_state = millis();
 
       hourly_beep = EEPROM_Helper::readByte(LCD_HOURLY_BEEP_ADDR) == 1;
@@ -154,13 +154,14 @@ class LCDController
     void timerProcess()
     {
       unsigned long int cmilli = millis();
+      lcd->process();
       if (timeStatus()!=timeNotSet) {
         if (old_hour != hour()) {
           old_hour = hour();
           if (alarm_hour != NO_HOUR && alarm_hour == old_hour) {
             tone_controller->StartMelodyToneByIndex(0);
           } else if (old_hour >= BEEP_START_HOUR && old_hour <= BEEP_STOP_HOUR) {
-      		  tone_controller->StartMelodyToneByIndex(((old_hour - BEEP_START_HOUR) % melody_count) + 1);
+      		  tone_controller->StartMelodyToneByIndex(melody_count ? ((old_hour - BEEP_START_HOUR) % melody_count) + 1 : 0);
           }
         }
         if (old_minute != minute()) {
@@ -182,6 +183,17 @@ class LCDController
       }
     }
 
+    // ms until timerProcess() has something to do
+    unsigned long idleTime()
+    {
+      // Rows that found the bus queue full are retried soon
+      if (lcd->isDirty()) return 1;
+      unsigned long idle = SleepController::remaining(last_pager_state, LCD_AUTO_TURNPAGE_MSTIME + 1);
+      // Sleeps are at most SLEEP_IDLE_MAX long, so a new minute is only near in its last second
+      if (timeStatus()!=timeNotSet && second() == 59 && idle > LCD_CLOCK_IDLE_STEP) idle = LCD_CLOCK_IDLE_STEP;
+      return idle;
+    }
+
     void redrawTimePage() {
       old_hour = hour();
       timerProcess();
@@ -194,11 +206,7 @@ class LCDController
     {
       lcd_ison = ison;
       lcd_auto_state = false;
-      if (lcd_ison) {
-        lcd->backlight();
-      } else {
-        lcd->noBacklight();
-      }
+      lcd->setBacklight(lcd_ison);
       EEPROM_Helper::writeAutoState(LCD_STATE_ADDR, lcd_auto_state, lcd_ison);
     }
     
@@ -214,7 +222,7 @@ class LCDController
       if (lcd_auto_state) {
         last_auto_state = millis();
         if (!lcd_ison) {
-          lcd->backlight();
+          lcd->setBacklight(true);
           lcd_ison = true;
         }
       }
@@ -237,11 +245,8 @@ class LCDController
     void showCurrentPage()
     {
       if (text_changed) {
-        lcd->home(); 
-        lcd->clear(); 
-        lcd->print(line1_dyn[page_num]);
-        lcd->setCursor(0, 1);
-        lcd->print(line2_dyn[page_num]);
+        // Queued as low priority bus jobs, sensor reads go first
+        lcd->writeLines(line1_dyn[page_num], line2_dyn[page_num]);
         text_changed = false;
       }
       checkLCDAutoState();
@@ -332,13 +337,53 @@ class LCDController
     {
       if (lcd_auto_state) {
         if (lcd_ison && millis()-last_auto_state > LCD_AUTO_TURNOFF_MSTIME) {
-          lcd->noBacklight();
+          lcd->setBacklight(false);
           lcd_ison = false;
         }
       }
     }
 };
 
+#else
+
+// Stand-in for builds without the LCD, the calls compile to nothing
+class LCDController
+{
+  public:
+    static LCDController *_self_controller;
+
+    static LCDController* Instance() {
+      if(!_self_controller)
+      {
+        _self_controller = new LCDController();
+      }
+      return _self_controller;
+    }
+
+    void changeLCDI2CAddr(byte new_lcd_addr) {}
+    void initLCD() {}
+    void setAlarmHour(byte new_alarm_hour) {}
+    void setHourlyBeep(bool ison) {}
+    byte getAlarmHour() { return NO_HOUR; }
+    bool getHourlyBeep() { return false; }
+    void timerProcess() {}
+    unsigned long idleTime() { return SLEEP_IDLE_MAX; }
+    void redrawTimePage() {}
+    void setLCDState(bool ison) {}
+    void setLCDAutoState() {}
+    void updateLCDAutoState() {}
+    void fixPage(byte page_fix) {}
+    void unfixPage() {}
+    void clearLCDText(byte page) {}
+    void setLCDText(const char* text, byte page_to) {}
+    void setLCDText(const char* text) {}
+    void setLCDLines(const char* line1, const char* line2, byte page_to) {}
+    void setLCDLines(const char* line1, const char* line2) {}
+    bool pageIsEmpty(byte page) { return true; }
+};
+
+#endif
+
 LCDController *LCDController::_self_controller = NULL;
 
 #endif
@@ -0,0 +1,179 @@
+#ifndef LCD_DISPLAY_H
+#define LCD_DISPLAY_H
+
+// HD44780 16x2 behind a PCF8574 backpack (LiquidCrystal_I2C wiring) on the
+// TWI queue. A redraw rewrites both lines padded with spaces instead of
+// clearing, so no command needs a wait and each line is a single low
+// priority job.
+
+#define LCD_COLUMNS 16
+#define LCD_ROWS 2
+
+#define LCD_RS 0x01
+#define LCD_EN 0x04
+#define LCD_BACKLIGHT 0x08
+
+#define LCD_CMD_CLEAR 0x01
+#define LCD_CMD_ENTRY_MODE 0x06
+#define LCD_CMD_DISPLAY_ON 0x0C
+#define LCD_CMD_FUNCTION_4BIT_2LINE 0x28
+#define LCD_CMD_SET_DDRAM 0x80
+
+// From power on until the controller takes commands, ms
+#define LCD_POWER_UP_TIME 50
+
+// Address byte plus text, 4 expander writes per byte
+#define LCD_LINE_JOB_SIZE ((LCD_COLUMNS + 1) * 4)
+
+class LCDDisplay
+{
+  private:
+    byte address;
+    byte backlight;
+
+    TWIJob line_jobs[LCD_ROWS];
+    byte line_data[LCD_ROWS][LCD_LINE_JOB_SIZE];
+    char lines[LCD_ROWS][LCD_COLUMNS + 1];
+    bool line_dirty[LCD_ROWS];
+
+    TWIJob backlight_job;
+    byte backlight_data;
+
+    void initJob(TWIJob* job, const byte* data, byte length)
+    {
+      job->address = address;
+      job->write_data = data;
+      job->write_length = length;
+      job->read_data = NULL;
+      job->read_length = 0;
+      job->callback = NULL;
+      job->context = NULL;
+      job->status = TWI_JOB_IDLE;
+    }
+
+    byte putNibble(byte* data, byte pos, byte nibble, byte mode)
+    {
+      byte value = (nibble & 0xF0) | mode | backlight;
+      data[pos++] = value | LCD_EN;
+      data[pos++] = value;
+      return pos;
+    }
+
+    byte putByte(byte* data, byte pos, byte value, byte mode)
+    {
+      pos = putNibble(data, pos, value & 0xF0, mode);
+      return putNibble(data, pos, value << 4, mode);
+    }
+
+    // Blocking write for the power-up sequence only
+    void writeNow(byte value, byte mode, bool full_byte)
+    {
+      byte data[4];
+      byte length = full_byte ? putByte(data, 0, value, mode) : putNibble(data, 0, value, mode);
+      TWIJob job;
+      initJob(&job, data, length);
+      twi_queue->execute(&job, TWI_PRIORITY_LOW);
+    }
+
+    void submitLine(byte row)
+    {
+      if (twi_queue->isBusy(&line_jobs[row])) return;
+      byte* data = line_data[row];
+      byte pos = putByte(data, 0, LCD_CMD_SET_DDRAM | (row ? 0x40 : 0x00), 0);
+      for(byte i=0; i<LCD_COLUMNS; i++) {
+        pos = putByte(data, pos, lines[row][i], LCD_RS);
+      }
+      initJob(&line_jobs[row], data, pos);
+      if (twi_queue->submit(&line_jobs[row], TWI_PRIORITY_LOW)) line_dirty[row] = false;
+    }
+
+  public:
+    LCDDisplay(byte lcd_address)
+    {
+      address = lcd_address;
+      backlight = LCD_BACKLIGHT;
+      for(byte row=0; row<LCD_ROWS; row++) {
+        line_jobs[row].status = TWI_JOB_IDLE;
+        lines[row][0] = 0;
+        line_dirty[row] = false;
+      }
+      backlight_job.status = TWI_JOB_IDLE;
+    }
+
+    void init()
+    {
+      // HD44780 power-up: three 8-bit function sets, then switch to 4-bit mode.
+      // The power-up wait counts from the reset, the rest of setup() may have used it up.
+      unsigned long powered = millis();
+      if (powered < LCD_POWER_UP_TIME) delay(LCD_POWER_UP_TIME - powered);
+      writeNow(0x30, 0, false);
+      delay(5);
+      writeNow(0x30, 0, false);
+      delay(1);
+      writeNow(0x30, 0, false);
+      writeNow(0x20, 0, false);
+      writeNow(LCD_CMD_FUNCTION_4BIT_2LINE, 0, true);
+      writeNow(LCD_CMD_DISPLAY_ON, 0, true);
+      writeNow(LCD_CMD_CLEAR, 0, true);
+      delay(2);
+      writeNow(LCD_CMD_ENTRY_MODE, 0, true);
+      for(byte row=0; row<LCD_ROWS; row++) {
+        memset(lines[row], ' ', LCD_COLUMNS);
+        lines[row][LCD_COLUMNS] = 0;
+      }
+    }
+
+    void setBacklight(bool ison)
+    {
+      backlight = ison ? LCD_BACKLIGHT : 0;
+      if (twi_queue->isBusy(&backlight_job)) return;
+      backlight_data = backlight;
+      initJob(&backlight_job, &backlight_data, 1);
+      twi_queue->submit(&backlight_job, TWI_PRIORITY_LOW);
+    }
+
+    bool isBusy()
+    {
+      for(byte row=0; row<LCD_ROWS; row++) {
+        if (twi_queue->isBusy(&line_jobs[row])) return true;
+      }
+      return twi_queue->isBusy(&backlight_job);
+    }
+
+    // Some row is still waiting for a free job slot
+    bool isDirty()
+    {
+      for(byte row=0; row<LCD_ROWS; row++) {
+        if (line_dirty[row]) return true;
+      }
+      return false;
+    }
+
+    // Queues a redraw of the rows that changed
+    void writeLines(const char* line1, const char* line2)
+    {
+      const char* text[LCD_ROWS] = {line1, line2};
+      for(byte row=0; row<LCD_ROWS; row++) {
+        char line[LCD_COLUMNS + 1];
+        byte i;
+        for(i=0; i<LCD_COLUMNS && text[row][i]; i++) line[i] = text[row][i];
+        for(; i<LCD_COLUMNS; i++) line[i] = ' ';
+        line[LCD_COLUMNS] = 0;
+        if (strcmp(line, lines[row]) != 0) {
+          strcpy(lines[row], line);
+          line_dirty[row] = true;
+        }
+        if (line_dirty[row]) submitLine(row);
+      }
+    }
+
+    // Called from loop(): resubmits rows that found their job still busy or the queue full
+    void process()
+    {
+      for(byte row=0; row<LCD_ROWS; row++) {
+        if (line_dirty[row]) submitLine(row);
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef LINK_BUFFERS_H
+#define LINK_BUFFERS_H
+
+// Receive side of the multi-link (CIPMUX=1) connection. Every byte from the
+// ESP goes through feed(): "+IPD,<link>,<len>:" frames are cut out of the AT
+// reply stream and their payload is reassembled into a per-link buffer from
+// a small fixed pool, so a command arriving in the middle of an AT exchange
+// never ends up in (or corrupts) that exchange's reply. Complete buffers wait
+// in a FIFO until loop() takes them for execution; frames that arrive for a
+// link whose commands are still waiting are appended to the same buffer.
+// A frame that does not fit is dropped whole, a cut off command is never run.
+
+#define LINK_BUFFERS_COUNT 3
+#define LINK_BUFFER_SIZE 192
+
+#define LINK_FREE 0
+#define LINK_FILLING 1
+#define LINK_READY 2
+#define LINK_BUSY 3
+
+// feed() results
+#define LINK_TEXT 0 // AT reply text, keep it
+#define LINK_FRAME 1 // Frame header or payload, consumed
+#define LINK_FRAME_START 2 // "+IPD," recognized, drop its first 4 chars from the reply text
+#define LINK_FRAME_END 3 // Last payload byte, a frame is complete
+
+#define DEMUX_TEXT 0
+#define DEMUX_LINK 1
+#define DEMUX_LENGTH 2
+#define DEMUX_PAYLOAD 3
+
+const char link_frame_prefix[] = "+IPD,";
+
+struct LinkBuffer
+{
+  char data[LINK_BUFFER_SIZE];
+  unsigned length;
+  byte link;
+  byte state;
+};
+
+class LinkBuffers
+{
+  private:
+    LinkBuffer buffers[LINK_BUFFERS_COUNT];
+    byte queue[LINK_BUFFERS_COUNT];
+    byte queue_head;
+    byte queue_count;
+
+    /* frame demultiplexer */
+    byte demux_state;
+    byte prefix_pos;
+    unsigned header_link;
+    unsigned header_length;
+    unsigned remaining;
+    LinkBuffer* target;
+    bool target_queued;
+    unsigned payload_start;
+    bool payload_overflow;
+
+    unsigned long frames_count;
+    unsigned long dropped_count;
+    unsigned long oversized_count;
+    byte queue_max;
+
+    LinkBuffers()
+    {
+      reset();
+      frames_count = 0;
+      dropped_count = 0;
+      oversized_count = 0;
+      queue_max = 0;
+    }
+
+    LinkBuffer* findBuffer(byte link, byte state)
+    {
+      for(byte i=0; i<LINK_BUFFERS_COUNT; i++) {
+        if (buffers[i].state == state && (state == LINK_FREE || buffers[i].link == link)) return &buffers[i];
+      }
+      return NULL;
+    }
+
+    void startPayload()
+    {
+      // Waiting commands of the same link get the new frame appended
+      target = findBuffer(header_link, LINK_READY);
+      target_queued = target != NULL;
+      if (!target) {
+        target = findBuffer(header_link, LINK_FREE);
+        if (target) {
+          target->link = header_link;
+          target->length = 0;
+        } else {
+          dropped_count++;
+        }
+      }
+      if (target) {
+        payload_start = target->length;
+        if (target->length && target->data[target->length-1] != '\n' && target->length < LINK_BUFFER_SIZE-1) {
+          target->data[target->length++] = '\n';
+        }
+        target->state = LINK_FILLING;
+      }
+      payload_overflow = false;
+      remaining = header_length;
+      demux_state = DEMUX_PAYLOAD;
+    }
+
+    void finishPayload()
+    {
+      demux_state = DEMUX_TEXT;
+      frames_count++;
+      if (!target) return;
+      if (payload_overflow) {
+        LOG_WARN(LOG_LINK_OVERSIZED, header_link, header_length);
+        oversized_count++;
+        // Back to the commands already waiting, if any
+        target->length = payload_start;
+        if (!target_queued) {
+          target->state = LINK_FREE;
+          target = NULL;
+          return;
+        }
+      }
+      target->data[target->length] = 0;
+      target->state = LINK_READY;
+      if (!target_queued) {
+        queue[(queue_head + queue_count) % LINK_BUFFERS_COUNT] = target - buffers;
+        queue_count++;
+        if (queue_count > queue_max) queue_max = queue_count;
+      }
+      target = NULL;
+    }
+
+  public:
+    static LinkBuffers *_self_controller;
+
+    static LinkBuffers* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new LinkBuffers();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // Drops everything, e.g. after a module reset
+    void reset()
+    {
+      for(byte i=0; i<LINK_BUFFERS_COUNT; i++) {
+        buffers[i].state = LINK_FREE;
+        buffers[i].length = 0;
+        buffers[i].data[0] = 0;
+      }
+      queue_head = 0;
+      queue_count = 0;
+      demux_state = DEMUX_TEXT;
+      prefix_pos = 0;
+      target = NULL;
+      target_queued = false;
+    }
+
+    byte feed(char c)
+    {
+      switch(demux_state) {
+        case DEMUX_TEXT:
+          if (c == link_frame_prefix[prefix_pos]) {
+            prefix_pos++;
+            if (!link_frame_prefix[prefix_pos]) {
+              prefix_pos = 0;
+              header_link = 0;
+              header_length = 0;
+              demux_state = DEMUX_LINK;
+              return LINK_FRAME_START;
+            }
+          } else {
+            prefix_pos = c == link_frame_prefix[0] ? 1 : 0;
+          }
+          return LINK_TEXT;
+        case DEMUX_LINK:
+          if (c >= '0' && c <= '9') {
+            header_link = header_link*10 + (c - '0');
+          } else if (c == ',') {
+            demux_state = DEMUX_LENGTH;
+          } else if (c == ':') {
+            // Single connection form "+IPD,<len>:"
+            header_length = header_link;
+            header_link = 0;
+            startPayload();
+          } else {
+            demux_state = DEMUX_TEXT;
+            return LINK_TEXT;
+          }
+          break;
+        case DEMUX_LENGTH:
+          if (c >= '0' && c <= '9') {
+            header_length = header_length*10 + (c - '0');
+          } else if (c == ':') {
+            startPayload();
+          } else {
+            demux_state = DEMUX_TEXT;
+            return LINK_TEXT;
+          }
+          break;
+        case DEMUX_PAYLOAD:
+          if (target && target->length < LINK_BUFFER_SIZE-1) {
+            target->data[target->length++] = c;
+          } else if (target) {
+            payload_overflow = true;
+          }
+          remaining--;
+          break;
+      }
+      if (demux_state == DEMUX_PAYLOAD && !remaining) {
+        finishPayload();
+        return LINK_FRAME_END;
+      }
+      return LINK_FRAME;
+    }
+
+    // A frame is partly received, more bytes are due
+    bool inFrame()
+    {
+      return demux_state != DEMUX_TEXT;
+    }
+
+    bool hasReady()
+    {
+      return queue_count && buffers[queue[queue_head]].state == LINK_READY;
+    }
+
+    // Oldest complete buffer, stays reserved until release()
+    char* take(unsigned* link)
+    {
+      if (!hasReady()) return NULL;
+      LinkBuffer* buffer = &buffers[queue[queue_head]];
+      queue_head = (queue_head + 1) % LINK_BUFFERS_COUNT;
+      queue_count--;
+      buffer->state = LINK_BUSY;
+      if (link) *link = buffer->link;
+      return buffer->data;
+    }
+
+    void release(char* message)
+    {
+      for(byte i=0; i<LINK_BUFFERS_COUNT; i++) {
+        if (buffers[i].data == message) buffers[i].state = LINK_FREE;
+      }
+    }
+
+    unsigned long getFramesCount()
+    {
+      return frames_count;
+    }
+
+    // Frames lost because every buffer was in use
+    unsigned long getDroppedCount()
+    {
+      return dropped_count;
+    }
+
+    // Frames dropped because they did not fit a buffer
+    unsigned long getOversizedCount()
+    {
+      return oversized_count;
+    }
+
+    byte getQueueMax()
+    {
+      return queue_max;
+    }
+};
+
+LinkBuffers *LinkBuffers::_self_controller = NULL;
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef MAGNETIC_DETECTOR_H
+#define MAGNETIC_DETECTOR_H
+
+// Streaming anomaly detector for the magnetometer samples. The baseline is
+// an exponential moving average of the field vector and the noise level an
+// exponential moving average of the squared distance to it; a sample that is
+// further than MAG_THRESHOLD_K noise deviations (and at least
+// MAG_THRESHOLD_MIN mG) from the baseline is an anomaly. Integer math only.
+
+// Baseline keeps 4 fractional bits
+#define MAG_BASELINE_FRACTION 4
+// ~2 s time constant at 30 Hz while quiet
+#define MAG_BASELINE_SHIFT 6
+// ~8.5 s while anomalous, so a lasting change ends up in the baseline
+#define MAG_BASELINE_ANOMALY_SHIFT 8
+#define MAG_NOISE_SHIFT 6
+#define MAG_WARMUP_SAMPLES 32
+#define MAG_WARMUP_SHIFT 3
+#define MAG_THRESHOLD_K 4
+#define MAG_THRESHOLD_MIN 25
+// 1 s of quiet samples before another anomaly is reported
+#define MAG_REARM_SAMPLES 30
+// Keeps the squared distances within 32 bits
+#define MAG_DEVIATION_MAX 4000
+
+class MagneticDetector
+{
+  private:
+    long baseline[3];
+    unsigned long noise;
+    byte warmup;
+    byte quiet;
+    bool armed;
+    unsigned long anomalies;
+
+    void follow(long* value, long target, byte shift)
+    {
+      *value += ((target << MAG_BASELINE_FRACTION) - *value) >> shift;
+    }
+
+  public:
+    MagneticDetector()
+    {
+      baseline[0] = baseline[1] = baseline[2] = 0;
+      noise = 0;
+      warmup = 0;
+      quiet = 0;
+      armed = true;
+      anomalies = 0;
+    }
+
+    // Feeds one sample in mG, true when it starts a new anomaly
+    bool update(long x, long y, long z)
+    {
+      long sample[3] = {x, y, z};
+      if (!warmup) {
+        for(byte i=0; i<3; i++) baseline[i] = sample[i] << MAG_BASELINE_FRACTION;
+      }
+
+      unsigned long distance = 0;
+      for(byte i=0; i<3; i++) {
+        long d = sample[i] - (baseline[i] >> MAG_BASELINE_FRACTION);
+        if (d > MAG_DEVIATION_MAX) d = MAG_DEVIATION_MAX;
+        if (d < -MAG_DEVIATION_MAX) d = -MAG_DEVIATION_MAX;
+        distance += d * d;
+      }
+
+      if (warmup < MAG_WARMUP_SAMPLES) {
+        // Settle the baseline and noise level quickly after power-up
+        warmup++;
+        for(byte i=0; i<3; i++) follow(&baseline[i], sample[i], MAG_WARMUP_SHIFT);
+        noise += ((long)distance - (long)noise) >> MAG_WARMUP_SHIFT;
+        return false;
+      }
+
+      unsigned long threshold = noise * (MAG_THRESHOLD_K * MAG_THRESHOLD_K);
+      if (threshold < (unsigned long)MAG_THRESHOLD_MIN * MAG_THRESHOLD_MIN) threshold = (unsigned long)MAG_THRESHOLD_MIN * MAG_THRESHOLD_MIN;
+      bool anomalous = distance > threshold;
+
+      if (anomalous) {
+        for(byte i=0; i<3; i++) follow(&baseline[i], sample[i], MAG_BASELINE_ANOMALY_SHIFT);
+        quiet = 0;
+        if (armed) {
+          armed = false;
+          anomalies++;
+          return true;
+        }
+      } else {
+        for(byte i=0; i<3; i++) follow(&baseline[i], sample[i], MAG_BASELINE_SHIFT);
+        noise += ((long)distance - (long)noise) >> MAG_NOISE_SHIFT;
+        if (quiet < MAG_REARM_SAMPLES) quiet++; else armed = true;
+      }
+      return false;
+    }
+
+    unsigned long getAnomaliesCount()
+    {
+      return anomalies;
+    }
+};
+
+#endif
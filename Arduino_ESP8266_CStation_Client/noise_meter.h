@@ -0,0 +1,170 @@
+#ifndef NOISE_METER_H
+#define NOISE_METER_H
+
+// Noise activity from the NS pulse train. The ISR only sorts the gap to the
+// previous pulse into a log2 histogram (bin i holds gaps of 2^i..2^(i+1) ms,
+// the last bin everything from NOISE_ONSET_GAP up, i.e. new sounds). Once per
+// window loop() turns the histogram into the share of time that was noisy and
+// the pulse rate, both over the time the buzzer did not mask the microphone,
+// and smooths them into the reported level.
+
+#define NOISE_BINS 8
+#define NOISE_ONSET_GAP 128
+#define NOISE_WINDOW 1000
+// Time a single pulse stands for when it starts a sound
+#define NOISE_PULSE_TIME 50
+// The microphone still hears the buzzer for a moment after it stops
+#define NOISE_TONE_TAIL 100
+// Level smoothing, 1/4 of each new window
+#define NOISE_LEVEL_SHIFT 2
+
+class NoiseMeter
+{
+  private:
+    /* written from the NS ISR */
+    volatile unsigned int histogram[NOISE_BINS];
+    volatile unsigned long last_pulse_millis;
+    volatile unsigned long masked_count;
+
+    unsigned int window_histogram[NOISE_BINS];
+    unsigned long window_millis;
+    unsigned long window_audible;
+    unsigned long window_spans;
+
+    unsigned long pulses_count;
+    unsigned int level_q8;
+    unsigned long rate_q8;
+
+  public:
+    NoiseMeter()
+    {
+      for(byte i=0; i<NOISE_BINS; i++) histogram[i] = window_histogram[i] = 0;
+      last_pulse_millis = 0;
+      masked_count = 0;
+      window_millis = 0;
+      window_audible = 0;
+      window_spans = 0;
+      pulses_count = 0;
+      level_q8 = 0;
+      rate_q8 = 0;
+    }
+
+    void begin()
+    {
+      window_millis = millis();
+      window_audible = tone_controller->getAudibleMillis();
+      window_spans = tone_controller->getAudibleSpans();
+    }
+
+    // NS ISR: false when the pulse was masked by the buzzer
+    bool pulse()
+    {
+      if (tone_controller->isToneAudible(NOISE_TONE_TAIL)) {
+        masked_count++;
+        return false;
+      }
+      unsigned long curr_millis = millis();
+      unsigned long gap = curr_millis - last_pulse_millis;
+      last_pulse_millis = curr_millis;
+      byte bin = NOISE_BINS - 1;
+      if (gap < NOISE_ONSET_GAP) {
+        byte small_gap = gap;
+        for(bin=0; small_gap > 1; bin++) small_gap >>= 1;
+      }
+      histogram[bin]++;
+      return true;
+    }
+
+    // Called from loop(): closes a window every NOISE_WINDOW ms
+    void process()
+    {
+      unsigned long elapsed = millis() - window_millis;
+      if (elapsed < NOISE_WINDOW) return;
+      window_millis += elapsed;
+
+      noInterrupts();
+      for(byte i=0; i<NOISE_BINS; i++) {
+        window_histogram[i] = histogram[i];
+        histogram[i] = 0;
+      }
+      interrupts();
+
+      // Masked time: buzzer sounding plus the tail after each sound
+      unsigned long audible = tone_controller->getAudibleMillis();
+      unsigned long spans = tone_controller->getAudibleSpans();
+      unsigned long masked = (audible - window_audible) + (spans - window_spans) * NOISE_TONE_TAIL;
+      window_audible = audible;
+      window_spans = spans;
+      if (masked >= elapsed) return;
+      unsigned long listened = elapsed - masked;
+
+      // Each pulse continues the sound for about its gap, bin i stands for 1.5*2^i ms
+      unsigned long pulses = 0;
+      unsigned long noisy = 0;
+      for(byte i=0; i<NOISE_BINS; i++) {
+        pulses += window_histogram[i];
+        if (i < NOISE_BINS - 1) {
+          noisy += (unsigned long)window_histogram[i] * ((3UL << i) >> 1);
+        } else {
+          noisy += (unsigned long)window_histogram[i] * NOISE_PULSE_TIME;
+        }
+      }
+      pulses_count += pulses;
+      if (noisy > listened) noisy = listened;
+
+      unsigned long window_rate = ((pulses * 60000UL) / listened) << 8;
+      // A window closed late (e.g. after a blocking reconnect) is scaled down
+      // with its noisy share until noisy * 100 * 256 fits 32 bits
+      while (listened > 0xFFFF) {
+        listened >>= 1;
+        noisy >>= 1;
+      }
+      unsigned int window_level = (noisy * 100 * 256) / listened;
+      level_q8 = level_q8 + ((long)window_level - (long)level_q8) / (1 << NOISE_LEVEL_SHIFT);
+      rate_q8 = rate_q8 + ((long)window_rate - (long)rate_q8) / (1 << NOISE_LEVEL_SHIFT);
+    }
+
+    // ms until process() closes the window
+    unsigned long idleTime()
+    {
+      return SleepController::remaining(window_millis, NOISE_WINDOW);
+    }
+
+    // Share of the listened time that was noisy, %
+    byte getLevel()
+    {
+      return (level_q8 + 128) >> 8;
+    }
+
+    // Pulses per minute
+    unsigned long getRate()
+    {
+      return (rate_q8 + 128) >> 8;
+    }
+
+    unsigned long getPulsesCount()
+    {
+      return pulses_count;
+    }
+
+    unsigned long getMaskedCount()
+    {
+      noInterrupts();
+      unsigned long count = masked_count;
+      interrupts();
+      return count;
+    }
+
+    // Histogram of the last window, "b0,b1,...", for diagnostics
+    String getHistogram()
+    {
+      String result = "";
+      for(byte i=0; i<NOISE_BINS; i++) {
+        if (i) result = result + ",";
+        result = result + String(window_histogram[i]);
+      }
+      return result;
+    }
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Profiling markers for the simavr harness (tools/simavr_profile).
+// Each marker is a single OUT to GPIOR0: the point id on enter and
+// id|PROFILE_EXIT_FLAG on exit. The harness timestamps the writes
+// with the simulated cycle counter.
+
+#define PROFILE_EXIT_FLAG 0x80
+
+#define PROFILE_POINTS(X) \
+  X(PROF_LOOP,                "loop") \
+  X(PROF_SENSORS_SENDING,     "sensorsSending") \
+  X(PROF_NEXT_FAN_STATE,      "IndicationController::nextFanState") \
+  X(PROF_TIMER5_ISR,          "timer5Event") \
+  X(PROF_MELODY_ACTION,       "ToneController::ToneMelodyAction") \
+  X(PROF_SEND_MESSAGE,        "sendMessage") \
+  X(PROF_SEND_FRAME,          "sendFrame") \
+  X(PROF_SEND_TELEMETRY,      "sendTelemetry") \
+  X(PROF_GET_REPLY,           "getReply") \
+  X(PROF_EXECUTE_INPUT,       "executeInputMessage") \
+  X(PROF_HC_ISR,              "HC_State_Changed") \
+  X(PROF_NS_ISR,              "NS_State_Rising") \
+  X(PROF_OUTER_ISR,           "SensorOuter_State_Changed") \
+  X(PROF_BUTTON_ISR,          "ControlBTN_Rising")
+
+#define PROFILE_POINT_ENUM(id, name) id,
+enum ProfilePoint
+{
+  PROF_NONE = 0,
+  PROFILE_POINTS(PROFILE_POINT_ENUM)
+  PROF_POINTS_COUNT
+};
+#undef PROFILE_POINT_ENUM
+
+#ifndef PROFILE_HOST
+
+#ifdef CSTATION_PROFILE
+  #include <avr/io.h>
+
+  class ProfileScope
+  {
+    private:
+      byte point;
+    public:
+      ProfileScope(byte profile_point) : point(profile_point) { GPIOR0 = point; }
+      ~ProfileScope() { GPIOR0 = point | PROFILE_EXIT_FLAG; }
+  };
+
+  #define PROFILE_FUNCTION(point) ProfileScope _profile_scope(point)
+#else
+  #define PROFILE_FUNCTION(point)
+#endif
+
+#endif
+
+#endif
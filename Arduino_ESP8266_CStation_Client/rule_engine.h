@@ -0,0 +1,428 @@
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+// Local automations as bytecode rules in EEPROM, evaluated on the station so
+// they react without a server round trip. The server uploads a program with
+// SET_RULES=+<hex> chunks and enables it with SET_RULES=1 (SET_RULES=0
+// clears it); tools/rules/rules_asm.py compiles the rules text. The program
+// is validated before it is enabled and again, with its CRC, on boot.
+// Rule layout, multi-byte values little endian:
+//   size        whole rule, bytes
+//   triggers    RULE_TRIGGER_* bits the rule is evaluated on
+//   conditions  count of the conditions below, all have to hold
+//   holdoff     s before the rule may fire again
+//   condition   operand, RULE_OP_*, value (4 bytes)
+//   action      RULE_ACTION_*, argument (2 bytes); RULE_ACTION_LCD_TEXT has
+//               a length byte and the text instead
+// Operands are sensors (SensorId, scaled by 10^DEC as in the binary frame),
+// states (RULE_OPERAND_STATE + StateQueryCode) and the RULE_OPERAND_* values
+// below. A value that is not available fails its condition. Rules are run
+// straight from EEPROM in one pass without jumps, so an evaluation reads at
+// most RULES_MAX_SIZE bytes.
+
+#define RULES_ADDR 2048
+#define RULES_MAGIC 0x52
+// Magic, length, CRC-16 of the program
+#define RULES_HEADER_SIZE 4
+#define RULES_MAX_SIZE 255
+#define RULES_MAX_COUNT 16
+
+#define RULE_HEADER_SIZE 4
+#define RULE_CONDITION_SIZE 6
+#define RULE_ACTION_SIZE 3
+#define RULE_TEXT_MAX 32
+
+// Events posted to the event queue, as EVENT_* bits
+#define RULE_TRIGGER_EVENTS ((1 << EVENT_TYPES) - 1)
+// New sensor values were reported
+#define RULE_TRIGGER_SENSORS 0x20
+// The clock turned to a new minute
+#define RULE_TRIGGER_MINUTE 0x40
+#define RULE_TRIGGERS_ALL (RULE_TRIGGER_EVENTS | RULE_TRIGGER_SENSORS | RULE_TRIGGER_MINUTE)
+
+#define RULE_OPERAND_STATE 0x40
+// Minutes since midnight, needs the clock set
+#define RULE_OPERAND_MINUTE 0x80
+// 1 for Sunday to 7, needs the clock set
+#define RULE_OPERAND_WEEKDAY 0x81
+#define RULE_OPERAND_WATCH 0x82
+
+#define RULE_OP_EQ 0
+#define RULE_OP_NE 1
+#define RULE_OP_LT 2
+#define RULE_OP_LE 3
+#define RULE_OP_GT 4
+#define RULE_OP_GE 5
+// Low 16 bits first, high 16 bits last value of a range, wraps when first > last
+#define RULE_OP_IN 6
+
+#define RULE_ACTION_TONE 1
+#define RULE_ACTION_MELODY 2
+#define RULE_ACTION_STOP_TONE 3
+#define RULE_ACTION_LED 4
+#define RULE_ACTION_FAN 5
+#define RULE_ACTION_LIGHT 6
+#define RULE_ACTION_LCD_PAGE 7
+#define RULE_ACTION_LCD_TEXT 8
+
+// Argument of RULE_ACTION_LCD_PAGE going back to paging
+#define RULE_LCD_UNFIX 0xFF
+#define RULE_TONE_LENGTH 1000
+
+#define RULES_STATUS_EMPTY 0
+#define RULES_STATUS_OK 1
+#define RULES_STATUS_UPLOAD 2
+#define RULES_STATUS_INVALID 3
+
+class RuleEngine
+{
+  private:
+    byte status;
+    byte length;
+    byte rules_count;
+    byte triggers_used;
+    byte last_minute;
+    unsigned upload_length;
+    unsigned fired_once;
+    unsigned long fired_millis[RULES_MAX_COUNT];
+    unsigned long fired_count;
+    unsigned long eval_max_micros;
+
+    RuleEngine()
+    {
+      length = 0;
+      rules_count = 0;
+      triggers_used = 0;
+      last_minute = 0xFF;
+      upload_length = 0;
+      fired_once = 0;
+      fired_count = 0;
+      eval_max_micros = 0;
+      status = load();
+    }
+
+    static byte readProgram(byte pos)
+    {
+      return EEPROM_Helper::readByte(RULES_ADDR + RULES_HEADER_SIZE + pos);
+    }
+
+    static long readLong(byte pos)
+    {
+      long value = 0;
+      for(byte i=0; i<4; i++) value |= (unsigned long)readProgram(pos + i) << (8 * i);
+      return value;
+    }
+
+    static int readInt(byte pos)
+    {
+      return readProgram(pos) | (readProgram(pos + 1) << 8);
+    }
+
+    static uint16_t programCRC(byte program_length)
+    {
+      uint16_t crc = 0xFFFF;
+      for(byte i=0; i<program_length; i++) crc = _crc_xmodem_update(crc, readProgram(i));
+      return crc;
+    }
+
+    static bool isOperandValid(byte operand)
+    {
+      if (operand < RULE_OPERAND_STATE) return operand < SENSORS_COUNT;
+      if (operand < RULE_OPERAND_MINUTE) return operand > RULE_OPERAND_STATE + STATE_NONE && operand < RULE_OPERAND_STATE + STATE_CODES_COUNT;
+      return operand <= RULE_OPERAND_WATCH;
+    }
+
+    // Walks the program the way evaluate() does, counting rules and their triggers
+    static bool validate(byte program_length, byte* count, byte* triggers)
+    {
+      *count = 0;
+      *triggers = 0;
+      byte pos = 0;
+      while (pos < program_length) {
+        byte size = readProgram(pos);
+        byte rule_triggers = readProgram(pos + 1);
+        byte conditions = readProgram(pos + 2);
+        if (size < RULE_HEADER_SIZE || size > program_length - pos || *count >= RULES_MAX_COUNT) return false;
+        if (!rule_triggers || (rule_triggers & ~RULE_TRIGGERS_ALL)) return false;
+        byte end = pos + size;
+        byte at = pos + RULE_HEADER_SIZE;
+        if (conditions > (end - at) / RULE_CONDITION_SIZE) return false;
+        for(byte i=0; i<conditions; i++, at += RULE_CONDITION_SIZE) {
+          if (!isOperandValid(readProgram(at)) || readProgram(at + 1) > RULE_OP_IN) return false;
+        }
+        if (at == end) return false;
+        while (at < end) {
+          byte action = readProgram(at);
+          if (action == RULE_ACTION_LCD_TEXT) {
+            if (end - at < 2) return false;
+            byte text_length = readProgram(at + 1);
+            if (!text_length || text_length > RULE_TEXT_MAX || text_length > end - at - 2) return false;
+            at += 2 + text_length;
+            continue;
+          }
+          if (action < RULE_ACTION_TONE || action > RULE_ACTION_LCD_PAGE || end - at < RULE_ACTION_SIZE) return false;
+          unsigned argument = readInt(at + 1);
+          if (action == RULE_ACTION_MELODY && argument > melody_count) return false;
+          if (action == RULE_ACTION_LCD_PAGE && argument >= LCD_PAGES_COUNT && argument != RULE_LCD_UNFIX) return false;
+          at += RULE_ACTION_SIZE;
+        }
+        (*count)++;
+        *triggers |= rule_triggers;
+        pos = end;
+      }
+      return true;
+    }
+
+    // Program saved in EEPROM, a damaged one stays off
+    byte load()
+    {
+      if (EEPROM_Helper::readByte(RULES_ADDR) != RULES_MAGIC) return RULES_STATUS_EMPTY;
+      byte program_length = EEPROM_Helper::readByte(RULES_ADDR + 1);
+      uint16_t crc = EEPROM_Helper::readByte(RULES_ADDR + 2) | (EEPROM_Helper::readByte(RULES_ADDR + 3) << 8);
+      if (!program_length || crc != programCRC(program_length) || !validate(program_length, &rules_count, &triggers_used)) {
+        rules_count = 0;
+        triggers_used = 0;
+        return RULES_STATUS_INVALID;
+      }
+      length = program_length;
+      return RULES_STATUS_OK;
+    }
+
+    void unload()
+    {
+      EEPROM_Helper::updateByte(RULES_ADDR, 0xFF);
+      length = 0;
+      rules_count = 0;
+      triggers_used = 0;
+    }
+
+    static byte hexDigit(char c)
+    {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return 0xFF;
+    }
+
+    bool readOperand(byte operand, long* value)
+    {
+      if (operand < RULE_OPERAND_STATE) return getSensorValue((SensorId) operand, value);
+      if (operand < RULE_OPERAND_MINUTE) {
+        *value = getState((StateQueryCode) (operand - RULE_OPERAND_STATE));
+        return true;
+      }
+      if (operand == RULE_OPERAND_WATCH) {
+        *value = guard_controller->isWatchMode();
+        return true;
+      }
+      if (timeStatus() == timeNotSet) return false;
+      *value = operand == RULE_OPERAND_MINUTE ? hour() * 60 + minute() : weekday();
+      return true;
+    }
+
+    bool checkCondition(byte pos)
+    {
+      long value;
+      if (!readOperand(readProgram(pos), &value)) return false;
+      long reference = readLong(pos + 2);
+      switch(readProgram(pos + 1)) {
+        case RULE_OP_EQ: return value == reference;
+        case RULE_OP_NE: return value != reference;
+        case RULE_OP_LT: return value < reference;
+        case RULE_OP_LE: return value <= reference;
+        case RULE_OP_GT: return value > reference;
+        case RULE_OP_GE: return value >= reference;
+        case RULE_OP_IN:
+          {
+            int first = reference & 0xFFFF;
+            int last = reference >> 16;
+            if (first <= last) return value >= first && value <= last;
+            return value >= first || value <= last;
+          }
+      }
+      return false;
+    }
+
+    // Actions of a matched rule, from pos to end
+    void runActions(byte pos, byte end)
+    {
+      while (pos < end) {
+        byte action = readProgram(pos);
+        if (action == RULE_ACTION_LCD_TEXT) {
+          char text[RULE_TEXT_MAX + 1];
+          byte text_length = readProgram(pos + 1);
+          for(byte i=0; i<text_length; i++) text[i] = readProgram(pos + 2 + i);
+          text[text_length] = 0;
+          lcd_controller->setLCDText(text, LCD_PAGE_OUTER);
+          lcd_controller->fixPage(LCD_PAGE_OUTER);
+          pos += 2 + text_length;
+          continue;
+        }
+        unsigned argument = readInt(pos + 1);
+        switch(action) {
+          case RULE_ACTION_TONE:
+            tone_controller->FastToneSignal(argument, RULE_TONE_LENGTH);
+            break;
+          case RULE_ACTION_MELODY:
+            tone_controller->StartMelodyToneByIndex(argument);
+            break;
+          case RULE_ACTION_STOP_TONE:
+            tone_controller->StopTone();
+            break;
+          case RULE_ACTION_LED:
+            tone_controller->setLedControl(false);
+            ind_controller->SetProgLedState(argument ? 1 : 0);
+            break;
+          case RULE_ACTION_FAN:
+            ind_controller->setFan(argument);
+            break;
+          case RULE_ACTION_LIGHT:
+            ind_controller->switchLight(argument);
+            break;
+          case RULE_ACTION_LCD_PAGE:
+            if (argument == RULE_LCD_UNFIX) {
+              lcd_controller->unfixPage();
+            } else {
+              lcd_controller->fixPage(argument);
+            }
+            break;
+        }
+        pos += RULE_ACTION_SIZE;
+      }
+    }
+
+    void evaluate(byte triggers)
+    {
+      unsigned long start = micros();
+      byte pos = 0;
+      for(byte rule=0; pos < length; rule++) {
+        byte size = readProgram(pos);
+        byte end = pos + size;
+        if (readProgram(pos + 1) & triggers) {
+          unsigned long holdoff = readProgram(pos + 3) * 1000UL;
+          bool armed = !(fired_once & (1U << rule)) || millis() - fired_millis[rule] >= holdoff;
+          byte conditions = readProgram(pos + 2);
+          byte at = pos + RULE_HEADER_SIZE;
+          bool matched = armed;
+          for(byte i=0; matched && i<conditions; i++, at += RULE_CONDITION_SIZE) matched = checkCondition(at);
+          if (matched) {
+            runActions(pos + RULE_HEADER_SIZE + conditions * RULE_CONDITION_SIZE, end);
+            fired_once |= 1U << rule;
+            fired_millis[rule] = millis();
+            fired_count++;
+          }
+        }
+        pos = end;
+      }
+      unsigned long spent = micros() - start;
+      if (spent > eval_max_micros) eval_max_micros = spent;
+    }
+
+  public:
+    static RuleEngine *_self_controller;
+
+    static RuleEngine* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new RuleEngine();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // SET_RULES parameter: 0 clears, +<hex> appends to the upload, 1 enables it
+    void RunCommand(const char* param)
+    {
+      if (param[0] == '+') {
+        if (status != RULES_STATUS_UPLOAD) {
+          // Rules are off while the program in EEPROM is being replaced
+          unload();
+          upload_length = 0;
+          status = RULES_STATUS_UPLOAD;
+        }
+        for(const char* hex = param + 1; hexDigit(hex[0]) != 0xFF && hexDigit(hex[1]) != 0xFF; hex += 2) {
+          if (upload_length >= RULES_MAX_SIZE) {
+            status = RULES_STATUS_INVALID;
+            return;
+          }
+          EEPROM_Helper::updateByte(RULES_ADDR + RULES_HEADER_SIZE + upload_length++, (hexDigit(hex[0]) << 4) | hexDigit(hex[1]));
+        }
+      } else if (param[0] == '1') {
+        if (status != RULES_STATUS_UPLOAD) return;
+        if (!upload_length || !validate(upload_length, &rules_count, &triggers_used)) {
+          rules_count = 0;
+          triggers_used = 0;
+          status = RULES_STATUS_INVALID;
+          return;
+        }
+        uint16_t crc = programCRC(upload_length);
+        EEPROM_Helper::updateByte(RULES_ADDR + 1, upload_length);
+        EEPROM_Helper::updateByte(RULES_ADDR + 2, crc & 0xFF);
+        EEPROM_Helper::updateByte(RULES_ADDR + 3, crc >> 8);
+        // Magic last, a reset during the commit leaves no half written program
+        EEPROM_Helper::updateByte(RULES_ADDR, RULES_MAGIC);
+        length = upload_length;
+        fired_once = 0;
+        status = RULES_STATUS_OK;
+      } else if (param[0] == '0') {
+        unload();
+        status = RULES_STATUS_EMPTY;
+      }
+    }
+
+    // Called from loop() with the events posted since the last call
+    void process(byte events)
+    {
+      byte triggers = events;
+      if ((triggers_used & RULE_TRIGGER_MINUTE) && timeStatus() != timeNotSet && minute() != last_minute) {
+        if (last_minute != 0xFF) triggers |= RULE_TRIGGER_MINUTE;
+        last_minute = minute();
+      }
+      trigger(triggers);
+    }
+
+    void trigger(byte triggers)
+    {
+      if (status == RULES_STATUS_OK && (triggers & triggers_used)) evaluate(triggers);
+    }
+
+    // ms until the next minute trigger
+    unsigned long idleTime()
+    {
+      if (status != RULES_STATUS_OK || !(triggers_used & RULE_TRIGGER_MINUTE) || timeStatus() == timeNotSet) return SLEEP_IDLE_MAX;
+      return (60 - second()) * 1000UL;
+    }
+
+    byte getStatus()
+    {
+      return status;
+    }
+
+    byte getRulesCount()
+    {
+      return status == RULES_STATUS_OK ? rules_count : 0;
+    }
+
+    unsigned long getFiredCount()
+    {
+      return fired_count;
+    }
+
+    // Longest evaluation of the rules for one trigger, us
+    unsigned long getEvalMaxMicros()
+    {
+      return eval_max_micros;
+    }
+};
+
+RuleEngine *RuleEngine::_self_controller = NULL;
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SEND_WINDOW_H
+#define SEND_WINDOW_H
+
+// Pipelined sending with AT+CIPSENDBUF: up to SEND_WINDOW_SIZE segments
+// are in flight per link, each confirmed by "<link>,<segment>,SEND OK".
+
+#define SEND_WINDOW_SIZE 4
+#define SEND_WINDOW_TIMEOUT 5000
+// Whole message list, ms
+#define SEND_WINDOW_DEADLINE 30000
+#define SEND_WINDOW_BUFFER 256
+
+#define SEND_SLOT_FREE 0
+#define SEND_SLOT_WAIT 1
+#define SEND_SLOT_FAILED 2
+
+// Prompt reply that could not be parsed, no ack matches it
+#define SEND_SEGMENT_UNKNOWN 0xFFFF
+
+// Writes message <index> of a list into buffer, see Descriptors
+typedef void (*MessageComposer)(byte index, char* buffer, unsigned size);
+
+struct SendSlot
+{
+  byte state;
+  byte index; // Position in the sent message list
+  byte attempts;
+  unsigned segment; // Segment id assigned by the module
+  unsigned long int sent_millis;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef SENSOR_REGISTRY_H
+#define SENSOR_REGISTRY_H
+
+// Static registry of the sensor drivers. A driver is a row of function
+// pointers in flash with the sensors it reports (their DS_INFO descriptors
+// come from SENSORS_TABLE), its report period and its conversion latency;
+// the per-driver schedule is kept in a state array next to the table.
+// sample() is called latency + SENSOR_REPORT_WINDOW ms before the report is
+// due. When the first driver is due, one message takes every driver due
+// within the window whose conversion had its latency to finish, so drivers
+// with related periods share messages. Drivers whose begin() fails are left
+// out. NULL functions are allowed for drivers with nothing to do there.
+
+// Drivers due this close to the first one go out with it, ms
+#define SENSOR_REPORT_WINDOW 500
+
+#define SENSOR_BIT(sensor) (1UL << (sensor))
+
+struct SensorDriver
+{
+  // SENSOR_BIT() of every field the serializer adds
+  unsigned long sensors;
+  // Report period, ms
+  unsigned long period;
+  // From sample() to a new value, ms
+  unsigned int latency;
+  bool (*begin)();
+  void (*sample)();
+  void (*process)();
+  unsigned long (*idleTime)();
+  // Adds the driver fields to the message, false when there is no value to report
+  bool (*serialize)(TelemetryMessage& message);
+};
+
+struct SensorDriverState
+{
+  bool ready;
+  bool sampled;
+  unsigned long sample_millis;
+  unsigned long due_millis;
+};
+
+class SensorRegistry
+{
+  private:
+    const SensorDriver* drivers;
+    SensorDriverState* states;
+    byte count;
+
+    void readDriver(byte index, SensorDriver* driver)
+    {
+      memcpy_P(driver, &drivers[index], sizeof(SensorDriver));
+    }
+
+    // ms until the due time minus lead, 0 once it has passed
+    static unsigned long untilDue(const SensorDriverState& state, unsigned long lead)
+    {
+      long left = (long)(state.due_millis - millis()) - (long)lead;
+      return left > 0 ? left : 0;
+    }
+
+    bool isConverted(const SensorDriver& driver, const SensorDriverState& state)
+    {
+      return state.sampled && millis() - state.sample_millis >= driver.latency;
+    }
+
+    void reschedule(const SensorDriver& driver, SensorDriverState& state)
+    {
+      state.sampled = false;
+      state.due_millis += driver.period;
+      // Held up for longer than a period: no catching up
+      if (!untilDue(state, 0)) state.due_millis = millis() + driver.period;
+    }
+
+  public:
+    SensorRegistry(const SensorDriver* table, SensorDriverState* table_states, byte table_count)
+    {
+      drivers = table;
+      states = table_states;
+      count = table_count;
+    }
+
+    // First reports one period from now, or at reportAll()
+    void begin()
+    {
+      SensorDriver driver;
+      for(byte i=0; i<count; i++) {
+        readDriver(i, &driver);
+        states[i].ready = !driver.begin || driver.begin();
+        states[i].sampled = false;
+        states[i].due_millis = millis() + driver.period;
+      }
+    }
+
+    // Everything once more as soon as it can be sampled, after (re)connecting
+    void reportAll()
+    {
+      SensorDriver driver;
+      for(byte i=0; i<count; i++) {
+        readDriver(i, &driver);
+        states[i].sampled = false;
+        states[i].due_millis = millis() + driver.latency + SENSOR_REPORT_WINDOW;
+      }
+    }
+
+    // Background work of the drivers and the sample() calls that are due
+    void process()
+    {
+      SensorDriver driver;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready) continue;
+        readDriver(i, &driver);
+        if (driver.process) driver.process();
+        if (!states[i].sampled && !untilDue(states[i], driver.latency + SENSOR_REPORT_WINDOW)) {
+          if (driver.sample) driver.sample();
+          states[i].sampled = true;
+          states[i].sample_millis = millis();
+        }
+      }
+    }
+
+    // ms until process() or compose() have something to do
+    unsigned long idleTime()
+    {
+      SensorDriver driver;
+      unsigned long idle = SLEEP_IDLE_MAX;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready) continue;
+        readDriver(i, &driver);
+        if (driver.idleTime) idle = SleepController::shorter(idle, driver.idleTime());
+        if (!states[i].sampled) {
+          idle = SleepController::shorter(idle, untilDue(states[i], driver.latency + SENSOR_REPORT_WINDOW));
+        } else if (!isConverted(driver, states[i])) {
+          idle = SleepController::shorter(idle, SleepController::remaining(states[i].sample_millis, driver.latency));
+        } else {
+          idle = SleepController::shorter(idle, untilDue(states[i], 0));
+        }
+      }
+      return idle;
+    }
+
+    // A driver is due and its conversion has finished, so compose() has something to take
+    bool isDue()
+    {
+      SensorDriver driver;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready || untilDue(states[i], 0)) continue;
+        readDriver(i, &driver);
+        if (isConverted(driver, states[i])) return true;
+      }
+      return false;
+    }
+
+    // Adds the drivers that are due and converted, true when any was added
+    bool compose(TelemetryMessage& message)
+    {
+      SensorDriver driver;
+      bool added = false;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready || untilDue(states[i], SENSOR_REPORT_WINDOW)) continue;
+        readDriver(i, &driver);
+        if (!isConverted(driver, states[i])) continue;
+        if (driver.serialize(message)) added = true;
+        reschedule(driver, states[i]);
+      }
+      return added;
+    }
+
+    // Skips the reports that are due, while there is no link to send them on
+    void postpone()
+    {
+      SensorDriver driver;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready || untilDue(states[i], 0)) continue;
+        readDriver(i, &driver);
+        reschedule(driver, states[i]);
+      }
+    }
+
+    // SENSOR_BIT() of the fields whose driver failed to start
+    unsigned long getOfflineSensors()
+    {
+      unsigned long offline = 0;
+      for(byte i=0; i<count; i++) {
+        if (!states[i].ready) offline |= pgm_read_dword(&drivers[i].sensors);
+      }
+      return offline;
+    }
+};
+
+#endif
@@ -1,13 +1,18 @@
-#include <Wire.h>
-#include <SFE_BMP180.h>
-#include <DHT.h>
-#include <BH1750.h>
-#include <HMC5883L.h>
+#include "bmp180_sensor.h"
+#include "dht22_sensor.h"
+#include "bh1750_sensor.h"
+#if CSTATION_FEATURE_MAGNETOMETER
+#include "hmc5883l_sensor.h"
+#include "magnetic_detector.h"
+#endif
+#include "noise_meter.h"
+#include "sensor_registry.h"
 
 #define MAX_ERRORS 4
 
-#define DHTPIN 5
-#define DHTTYPE DHT22
+// DHT22 data line needs a pin change interrupt: A8 (PK0, PCINT16)
+#define DHTPIN A8
+#define DHT_PCINT_vect PCINT2_vect
 
 #define HC_PIN 18
 #define HC_INTERRUPT 5
@@ -21,33 +26,26 @@
 #define SENSOR_OUT_INTERRUPT 1
 #define SENSOR_OUT_INTERRUPT_MODE CHANGE
 
-volatile unsigned long int last_sending_millis, last_reset_millis;
-
-SFE_BMP180 pressure;
-DHT dht(DHTPIN, DHTTYPE);
-BH1750 lightMeter;
-HMC5883L magnetic_meter;
-
-bool setH = false;
-float oldH;
-bool H_init = false;
-bool MXYZ_init = false;
-
-const byte sensors_count = 13;
-const char sensor_0[] PROGMEM = "DS_INFO={'CODE':'A','NAME':'Activity','TIMEOUT':60,'TYPE':'ENUM','ENUMS':['off','on']}";
-const char sensor_1[] PROGMEM = "DS_INFO={'CODE':'E','NAME':'Errors','TYPE':'INT','MIN':0,'MAX':100000}";
-const char sensor_2[] PROGMEM = "DS_INFO={'CODE':'T','NAME':'Temperature','TYPE':'FLOAT','MIN':-100,'MAX':100,'EM':'°C'}";
-const char sensor_3[] PROGMEM = "DS_INFO={'CODE':'P','NAME':'Pressure','TYPE':'FLOAT','MIN':500,'MAX':1000,'EM':'mm'}";
-const char sensor_4[] PROGMEM = "DS_INFO={'CODE':'H','NAME':'Humidity','TYPE':'FLOAT','MIN':0,'MAX':100,'EM':'%'}";
-const char sensor_5[] PROGMEM = "DS_INFO={'CODE':'L','NAME':'Illuminance','TYPE':'FLOAT','MIN':0,'MAX':200000,'EM':'lux'}";
-const char sensor_6[] PROGMEM = "DS_INFO={'CODE':'R','NAME':'Presence','TIMEOUT':10,'TYPE':'ENUM','ENUMS':['no','yes']}";
-const char sensor_7[] PROGMEM = "DS_INFO={'CODE':'Mx','NAME':'Magnetic field Vector X','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'}";
-const char sensor_8[] PROGMEM = "DS_INFO={'CODE':'My','NAME':'Magnetic field Vector Y','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'}";
-const char sensor_9[] PROGMEM = "DS_INFO={'CODE':'Mz','NAME':'Magnetic field Vector Z','TYPE':'FLOAT','MIN':-10000,'MAX':10000,'EM':'deg'}";
-const char sensor_10[] PROGMEM = "DS_INFO={'CODE':'N','NAME':'Noise','TIMEOUT':5,'TYPE':'ENUM','ENUMS':['no','yes']}";
-const char sensor_11[] PROGMEM = "DS_INFO={'CODE':'O','NAME':'Outer signal','TYPE':'ENUM','ENUMS':['no','yes']}";
-const char sensor_12[] PROGMEM = "DS_INFO={'CODE':'B','NAME':'Signal button','TIMEOUT':5,'TYPE':'ENUM','ENUMS':['no','yes']}";
-const char* const sensors_list[] PROGMEM = {sensor_0, sensor_1, sensor_2, sensor_3, sensor_4, sensor_5, sensor_6, sensor_7, sensor_8, sensor_9, sensor_10, sensor_11, sensor_12};
+// Report periods, ms: slow quantities less often than fast ones
+#define PRESSURE_REPORT_PERIOD 60000
+#define HUMIDITY_REPORT_PERIOD 60000
+#define LIGHT_REPORT_PERIOD 10000
+#define NOISE_REPORT_PERIOD 10000
+#define PRESENCE_REPORT_PERIOD SENDING_INTERVAL
+#define MAGNETIC_REPORT_PERIOD SENDING_INTERVAL
+
+volatile unsigned long int last_reset_millis;
+
+BMP180Sensor pressure;
+DHT22Sensor dht(DHTPIN);
+BH1750Sensor lightMeter;
+#if CSTATION_FEATURE_MAGNETOMETER
+HMC5883LSensor magnetic_meter;
+MagneticDetector magnetic_detector;
+#endif
+NoiseMeter noise_meter;
+
+bool sensors_ready = false;
 
 volatile bool hc_info_sended = false;
 volatile bool hc_state = false;
@@ -55,33 +53,376 @@ volatile bool ns_info_sended = false;
 volatile bool ns_state = false;
 volatile bool sensor_outer_signal = false;
 volatile bool sensor_outer_signal_sended = false;
+// EVENT_PRESENCE/EVENT_NOISE/EVENT_MAGNETIC of the telemetry message being sent, taken out
+// again by a new edge so telemetryDelivered() does not mark that one sent
+volatile byte telemetry_events = 0;
+#if CSTATION_FEATURE_MAGNETOMETER
+bool magnetic_anomaly_sended = true;
+#endif
+
+bool events_flushing = false;
+
+byte telemetry_sequence = 0;
+unsigned telemetry_bytes = 0;
+unsigned long int telemetry_send_millis = 0;
+// From reset to the first acknowledged telemetry message, ms
+unsigned long int boot_telemetry_millis = 0;
 
 void HC_State_Changed() 
 {
+  PROFILE_FUNCTION(PROF_HC_ISR);
   hc_state = digitalRead(HC_PIN) == HIGH;
   if (hc_state) {
     hc_info_sended = false;
+    telemetry_events &= ~EVENT_PRESENCE;
     ON_PresenceDetected();
 	guard_controller->fixPresence();
     ind_controller->PresenceState(hc_state);
+    event_queue->post(EVENT_PRESENCE);
   }
 }
 
 void NS_State_Rising()
 {
-  if (!tone_controller->isToneRunning()) {
+  PROFILE_FUNCTION(PROF_NS_ISR);
+  if (noise_meter.pulse()) {
     ns_state = true;
     ns_info_sended = false;
+    telemetry_events &= ~EVENT_NOISE;
     ON_PresenceDetected();
     ind_controller->PresenceState(ns_state);
+    event_queue->post(EVENT_NOISE);
   }
 }
 
 void SensorOuter_State_Changed()
 {
+  PROFILE_FUNCTION(PROF_OUTER_ISR);
   sensor_outer_signal = digitalRead(SENSOR_OUT_PIN) == HIGH;
   sensor_outer_signal_sended = false;
   ind_controller->OuterState(1);
+  event_queue->post(EVENT_OUTER);
+}
+
+ISR(DHT_PCINT_vect)
+{
+  dht.pinChanged();
+}
+
+// Sensor drivers. A new sensor needs its SENSORS_TABLE entry, these functions
+// and a row in sensor_drivers[]; the send loop takes it from there.
+
+bool stationSerialize(TelemetryMessage& message)
+{
+  message.add(SENSOR_ERRORS, errors_count);
+  if (boot_telemetry_millis) message.add(SENSOR_BOOT_TIME, boot_telemetry_millis);
+  return true;
+}
+
+bool bmp180Begin()
+{
+  if (pressure.begin()) return true;
+  LOG_ERROR(LOG_BMP180_ERROR);
+  // On the sensors page until the first report, the boot goes on
+  lcd_controller->setLCDText("BMP Sensor Error", LCD_PAGE_SENSORS);
+  return false;
+}
+
+void bmp180Sample()
+{
+  pressure.sample();
+}
+
+void bmp180Process()
+{
+  pressure.process();
+}
+
+unsigned long bmp180IdleTime()
+{
+  return pressure.idleTime();
+}
+
+bool bmp180Serialize(TelemetryMessage& message)
+{
+  if (!pressure.isFresh()) return false;
+  message.add(SENSOR_TEMPERATURE, FixedPoint(pressure.getTemperature(), 2));
+  message.add(SENSOR_PRESSURE, FixedPoint(BMP180Sensor::toMillimetersHg(pressure.getPressure()), 3));
+  return true;
+}
+
+bool dht22Begin()
+{
+  dht.begin();
+  return true;
+}
+
+void dht22Sample()
+{
+  dht.sample();
+}
+
+void dht22Process()
+{
+  dht.process();
+}
+
+unsigned long dht22IdleTime()
+{
+  return dht.idleTime();
+}
+
+bool dht22Serialize(TelemetryMessage& message)
+{
+  if (!dht.isFresh()) return false;
+  message.add(SENSOR_HUMIDITY, FixedPoint(dht.getHumidity(), 1));
+  return true;
+}
+
+bool bh1750Begin()
+{
+  return lightMeter.begin();
+}
+
+void bh1750Sample()
+{
+  lightMeter.sample();
+}
+
+void bh1750Process()
+{
+  // Backlight follows every reading, not just the reported ones
+  if (lightMeter.process()) ind_controller->updateLightLevel(lightMeter.readLightLevel());
+}
+
+unsigned long bh1750IdleTime()
+{
+  return lightMeter.idleTime();
+}
+
+bool bh1750Serialize(TelemetryMessage& message)
+{
+  if (!lightMeter.hasValue()) return false;
+  uint16_t lux = lightMeter.readLightLevel();
+  message.add(SENSOR_ILLUMINANCE, lux);
+  return true;
+}
+
+bool presenceSerialize(TelemetryMessage& message)
+{
+  message.addFlag(SENSOR_PRESENCE, digitalRead(HC_PIN) == HIGH);
+  telemetryReported(EVENT_PRESENCE);
+  return true;
+}
+
+bool noiseBegin()
+{
+  noise_meter.begin();
+  return true;
+}
+
+void noiseProcess()
+{
+  noise_meter.process();
+}
+
+unsigned long noiseIdleTime()
+{
+  return noise_meter.idleTime();
+}
+
+bool noiseSerialize(TelemetryMessage& message)
+{
+  if (ns_state && !ns_info_sended) message.addFlag(SENSOR_NOISE, true);
+  telemetryReported(EVENT_NOISE);
+  message.add(SENSOR_NOISE_LEVEL, noise_meter.getLevel());
+  return true;
+}
+
+#if CSTATION_FEATURE_MAGNETOMETER
+bool hmc5883lBegin()
+{
+  if (magnetic_meter.begin()) return true;
+  LOG_ERROR(LOG_HMC5883L_ERROR);
+  lcd_controller->setLCDLines("HMC5883L Sensor", "Error", LCD_PAGE_SENSORS);
+  return false;
+}
+
+void hmc5883lProcess()
+{
+  magnetic_meter.process();
+  magneticProcess();
+}
+
+unsigned long hmc5883lIdleTime()
+{
+  return magnetic_meter.idleTime();
+}
+
+bool hmc5883lSerialize(TelemetryMessage& message)
+{
+  bool added = false;
+  if (magnetic_meter.hasValue()) {
+    message.add(SENSOR_MAGNETIC_X, magnetic_meter.getX());
+    message.add(SENSOR_MAGNETIC_Y, magnetic_meter.getY());
+    message.add(SENSOR_MAGNETIC_Z, magnetic_meter.getZ());
+    added = true;
+  }
+  if (!magnetic_anomaly_sended) {
+    message.addFlag(SENSOR_MAGNETIC_EVENT, true);
+    telemetryReported(EVENT_MAGNETIC);
+    added = true;
+  }
+  return added;
+}
+#endif
+
+// Shared messages list the fields in row order
+const SensorDriver sensor_drivers[] PROGMEM = {
+  {SENSOR_BIT(SENSOR_ERRORS) | SENSOR_BIT(SENSOR_BOOT_TIME), SENDING_INTERVAL, 0, NULL, NULL, NULL, NULL, stationSerialize},
+  {SENSOR_BIT(SENSOR_TEMPERATURE) | SENSOR_BIT(SENSOR_PRESSURE), PRESSURE_REPORT_PERIOD, BMP180_SAMPLE_LATENCY, bmp180Begin, bmp180Sample, bmp180Process, bmp180IdleTime, bmp180Serialize},
+  {SENSOR_BIT(SENSOR_HUMIDITY), HUMIDITY_REPORT_PERIOD, DHT22_SAMPLE_LATENCY, dht22Begin, dht22Sample, dht22Process, dht22IdleTime, dht22Serialize},
+  {SENSOR_BIT(SENSOR_ILLUMINANCE), LIGHT_REPORT_PERIOD, BH1750_SAMPLE_LATENCY, bh1750Begin, bh1750Sample, bh1750Process, bh1750IdleTime, bh1750Serialize},
+  {SENSOR_BIT(SENSOR_PRESENCE), PRESENCE_REPORT_PERIOD, 0, NULL, NULL, NULL, NULL, presenceSerialize},
+#if CSTATION_FEATURE_MAGNETOMETER
+  {SENSOR_BIT(SENSOR_MAGNETIC_X) | SENSOR_BIT(SENSOR_MAGNETIC_Y) | SENSOR_BIT(SENSOR_MAGNETIC_Z) | SENSOR_BIT(SENSOR_MAGNETIC_EVENT), MAGNETIC_REPORT_PERIOD, 0, hmc5883lBegin, NULL, hmc5883lProcess, hmc5883lIdleTime, hmc5883lSerialize},
+#endif
+  {SENSOR_BIT(SENSOR_NOISE) | SENSOR_BIT(SENSOR_NOISE_LEVEL), NOISE_REPORT_PERIOD, 0, noiseBegin, NULL, noiseProcess, noiseIdleTime, noiseSerialize},
+};
+#define SENSOR_DRIVERS_COUNT (sizeof(sensor_drivers) / sizeof(sensor_drivers[0]))
+
+SensorDriverState sensor_driver_states[SENSOR_DRIVERS_COUNT];
+SensorRegistry sensor_registry(sensor_drivers, sensor_driver_states, SENSOR_DRIVERS_COUNT);
+
+void sensorsProcess()
+{
+  // Background conversions, results are used by the next sensorsSending().
+  // Also called while waiting for ESP replies, so it must not send anything itself.
+  if (!sensors_ready) return;
+  twi_queue->process();
+  sensor_registry.process();
+}
+
+#if CSTATION_FEATURE_MAGNETOMETER
+void magneticProcess()
+{
+  long x, y, z;
+  while (magnetic_meter.nextSample(&x, &y, &z)) {
+    if (magnetic_detector.update(x, y, z)) {
+      magnetic_anomaly_sended = false;
+      // An anomaly while a message with the last one is on its way stays unsent
+      noInterrupts();
+      telemetry_events &= ~EVENT_MAGNETIC;
+      interrupts();
+      ON_PresenceDetected();
+      event_queue->post(EVENT_MAGNETIC);
+    }
+  }
+}
+#endif
+
+// ms until sensorsProcess(), flushEvents() or sensorsSending() have something to do
+unsigned long sensorsIdleTime()
+{
+  if (!sensors_ready) return SLEEP_IDLE_MAX;
+  unsigned long idle = twi_queue->idleTime();
+  idle = SleepController::shorter(idle, sensor_registry.idleTime());
+  if (connected_to_server && !isReconnecting()) idle = SleepController::shorter(idle, event_queue->idleTime());
+  idle = SleepController::shorter(idle, SleepController::remaining(last_reset_millis, ERROR_CHECK_INTERVAL + 1));
+  return idle;
+}
+
+unsigned long getNoiseRate()
+{
+  return noise_meter.getRate();
+}
+
+unsigned long getNoiseMasked()
+{
+  return noise_meter.getMaskedCount();
+}
+
+String getNoiseHistogram()
+{
+  return noise_meter.getHistogram();
+}
+
+#if CSTATION_FEATURE_MAGNETOMETER
+unsigned long getMagneticSamples()
+{
+  return magnetic_meter.getSamplesCount();
+}
+
+unsigned long getMagneticOverruns()
+{
+  return magnetic_meter.getOverruns();
+}
+
+unsigned long getMagneticAnomalies()
+{
+  return magnetic_detector.getAnomaliesCount();
+}
+#endif
+
+// Last value of a sensor as in the binary frame (scaled by 10^DEC), false when there is none
+bool getSensorValue(SensorId sensor, long* value)
+{
+  byte decimals = Descriptors::sensorDecimals(sensor);
+  switch(sensor) {
+    case SENSOR_ACTIVITY:
+      *value = 1;
+      return true;
+    case SENSOR_ERRORS:
+      *value = errors_count;
+      return true;
+    case SENSOR_TEMPERATURE:
+      *value = FixedPoint(pressure.getTemperature(), 2).scaled(decimals);
+      return pressure.hasValue();
+    case SENSOR_PRESSURE:
+      *value = FixedPoint(BMP180Sensor::toMillimetersHg(pressure.getPressure()), 3).scaled(decimals);
+      return pressure.hasValue();
+    case SENSOR_HUMIDITY:
+      *value = FixedPoint(dht.getHumidity(), 1).scaled(decimals);
+      return dht.hasValue();
+    case SENSOR_ILLUMINANCE:
+      *value = lightMeter.readLightLevel();
+      return lightMeter.hasValue();
+    case SENSOR_PRESENCE:
+      *value = digitalRead(HC_PIN) == HIGH;
+      return true;
+#if CSTATION_FEATURE_MAGNETOMETER
+    case SENSOR_MAGNETIC_X:
+      *value = magnetic_meter.getX();
+      return magnetic_meter.hasValue();
+    case SENSOR_MAGNETIC_Y:
+      *value = magnetic_meter.getY();
+      return magnetic_meter.hasValue();
+    case SENSOR_MAGNETIC_Z:
+      *value = magnetic_meter.getZ();
+      return magnetic_meter.hasValue();
+#endif
+    case SENSOR_NOISE:
+      *value = ns_state;
+      return true;
+    case SENSOR_OUTER_SIGNAL:
+      *value = sensor_outer_signal;
+      return true;
+    case SENSOR_SIGNAL_BUTTON:
+      *value = signal_btn_pressed;
+      return true;
+    case SENSOR_NOISE_LEVEL:
+      *value = noise_meter.getLevel();
+      return true;
+    case SENSOR_BOOT_TIME:
+      *value = boot_telemetry_millis;
+      return boot_telemetry_millis != 0;
+  }
+  return false;
+}
+
+unsigned long getOfflineSensors()
+{
+  return sensor_registry.getOfflineSensors();
 }
 
 void initSensors() 
@@ -89,66 +430,163 @@ void initSensors()
   pinMode(HC_PIN, INPUT);
   pinMode(NS_PIN, INPUT);
   pinMode(SENSOR_OUT_PIN, INPUT);
-  H_init = !!pressure.begin();
-  if (!H_init) 
-  {
-    DEBUG_WRITELN("Error with bmp180 connection\r\n");
-    lcd_controller->setLCDText("BMP Sensor Error");
-    delay(3000);
-  }
-  MXYZ_init = !!magnetic_meter.begin();
-  if (!MXYZ_init) 
-  {
-    DEBUG_WRITELN("Error with HMC5883L connection\r\n");
-    lcd_controller->setLCDLines("HMC5883L Sensor", "Error");
-    delay(3000);
-  } else {
-    magnetic_meter.setRange(HMC5883L_RANGE_1_3GA);
-    magnetic_meter.setMeasurementMode(HMC5883L_CONTINOUS);
-    magnetic_meter.setDataRate(HMC5883L_DATARATE_30HZ);
-    magnetic_meter.setSamples(HMC5883L_SAMPLES_2);
-  }
-  dht.begin();
-  lightMeter.begin();
+  sensor_registry.begin();
   attachInterrupt(HC_INTERRUPT, HC_State_Changed, HC_INTERRUPT_MODE);
   attachInterrupt(NS_INTERRUPT, NS_State_Rising, NS_INTERRUPT_MODE);
   attachInterrupt(SENSOR_OUT_INTERRUPT, SensorOuter_State_Changed, SENSOR_OUT_INTERRUPT_MODE);
-  last_sending_millis = last_reset_millis = millis();
+  last_reset_millis = millis();
+  sensors_ready = true;
 }
 
-bool sendSensorsInfo(unsigned connection_id) 
+bool flushEvents()
+{
+  // Urgent events skip the telemetry cycle; called from loop(), sensorsSending() and sendMessage()
+  if (events_flushing || !connected_to_server || isReconnecting() || !event_queue->isDue()) return false;
+
+  byte events = event_queue->getPending();
+  byte stale = 0;
+  TelemetryMessage message;
+
+  if (events & EVENT_PRESENCE) {
+    if (hc_state && !hc_info_sended) {
+      message.addFlag(SENSOR_PRESENCE, true);
+    } else stale |= EVENT_PRESENCE;
+  }
+  if (events & EVENT_NOISE) {
+    if (ns_state && !ns_info_sended) {
+      message.addFlag(SENSOR_NOISE, true);
+    } else stale |= EVENT_NOISE;
+  }
+  if (events & EVENT_BUTTON) {
+    if (signal_btn_pressed && !signal_btn_sended) {
+      message.addFlag(SENSOR_SIGNAL_BUTTON, true);
+    } else stale |= EVENT_BUTTON;
+  }
+#if CSTATION_FEATURE_MAGNETOMETER
+  if (events & EVENT_MAGNETIC) {
+    if (!magnetic_anomaly_sended) {
+      message.addFlag(SENSOR_MAGNETIC_EVENT, true);
+    } else stale |= EVENT_MAGNETIC;
+  }
+#endif
+  if (events & EVENT_OUTER) {
+    if (!sensor_outer_signal_sended) {
+      message.addFlag(SENSOR_OUTER_SIGNAL, sensor_outer_signal);
+    } else stale |= EVENT_OUTER;
+  }
+  if (stale) event_queue->discard(stale);
+  events &= ~stale;
+  if (!events) return false;
+
+  ind_controller->SensorsSendingSignalState(1);
+  if (events & EVENT_BUTTON) {
+    tone_controller->FastToneSignal(400, 1000);
+  }
+
+  events_flushing = true;
+  event_queue->begin(events);
+  char* reply = sendTelemetry(message, 0);
+  events_flushing = false;
+  bool info_sended = StringHelper::replyIsOK(reply);
+
+  // Dropped events are not retried any more, periodic telemetry still reports R and N.
+  // Events that fired again during the send stay unsent.
+  byte left = event_queue->complete(events, info_sended);
+  if (left & EVENT_PRESENCE) hc_info_sended = true;
+  if (left & EVENT_NOISE) ns_info_sended = true;
+  if (left & EVENT_BUTTON) signal_btn_sended = true;
+  if (left & EVENT_OUTER) sensor_outer_signal_sended = true;
+#if CSTATION_FEATURE_MAGNETOMETER
+  if (left & EVENT_MAGNETIC) magnetic_anomaly_sended = true;
+#endif
+
+  ind_controller->SensorsSendingSignalState(0);
+
+  return info_sended;
+}
+
+// Loop side of telemetry_events, the ISRs clear bits of the same byte
+void telemetryReported(byte events)
 {
+  noInterrupts();
+  telemetry_events |= events;
+  interrupts();
+}
+
+// Presence, noise and magnetic anomaly of the periodic message count as sent once the message is acknowledged
+void telemetryDelivered()
+{
+  noInterrupts();
+  if (telemetry_events & EVENT_PRESENCE) hc_info_sended = true;
+  if (telemetry_events & EVENT_NOISE) ns_info_sended = true;
+#if CSTATION_FEATURE_MAGNETOMETER
+  if (telemetry_events & EVENT_MAGNETIC) magnetic_anomaly_sended = true;
+#endif
+  telemetry_events = 0;
+  interrupts();
+}
+
+// Sends one telemetry message in the format the server asked for
+char* sendTelemetry(TelemetryMessage &message, unsigned max_attempts)
+{
+  PROFILE_FUNCTION(PROF_SEND_TELEMETRY);
   char* reply;
-  bool rok;
-  char bufr[128];
-
-  for(byte i=0; i<sensors_count; i++) {
-    strlcpy_P(bufr, (char*)pgm_read_word(&(sensors_list[i])), 128);
-    reply = sendMessage(connection_id, bufr, MAX_ATTEMPTS);
-    rok = StringHelper::replyIsOK(reply);
-    if (!rok) return rok;
+  unsigned long int send_start = millis();
+  if (telemetry_binary) {
+    message.frame.finish(station_id, telemetry_sequence++);
+    telemetry_bytes = message.frame.length;
+    reply = sendFrame(connection_id, message.frame.data, message.frame.length, max_attempts);
+  } else {
+    String line = "DS_V={" + message.text + "}";
+    telemetry_bytes = line.length() + 2;
+    reply = sendMessage(connection_id, line, max_attempts);
   }
+  telemetry_send_millis = millis() - send_start;
+  if (!boot_telemetry_millis && StringHelper::replyIsOK(reply)) {
+    boot_telemetry_millis = millis();
+    LOG_INFO(LOG_BOOT_TELEMETRY, boot_telemetry_millis);
+  }
+  return reply;
+}
 
-  reply = sendMessage(connection_id, "DS_V={'A':'on'}", MAX_ATTEMPTS);
+// Size of the last telemetry message on the link, bytes
+unsigned getTelemetryBytes()
+{
+  return telemetry_bytes;
+}
+
+unsigned long getTelemetrySendMillis()
+{
+  return telemetry_send_millis;
+}
+
+unsigned long getBootTelemetryMillis()
+{
+  return boot_telemetry_millis;
+}
+
+bool sendSensorsInfo(unsigned connection_id) 
+{
+  char* reply;
+  bool rok = sendMessageList(connection_id, Descriptors::composeSensorInfo, SENSORS_COUNT);
+  if (!rok) return rok;
+
+  reply = sendMessage(connection_id, "DS_V={" + Descriptors::sensorKey(SENSOR_ACTIVITY) + "'on'}", MAX_ATTEMPTS);
   rok = StringHelper::replyIsOK(reply);
 
-  last_sending_millis = 0;
+  sensor_registry.reportAll();
 
   return rok;
 }
 
 bool sensorsSending() 
 {
-  if ((hc_state && !hc_info_sended) || (ns_state && !ns_info_sended) || !sensor_outer_signal_sended || (signal_btn_pressed && !signal_btn_sended)) {
-    ind_controller->SensorsSendingSignalState(1);
-    if (signal_btn_pressed && !signal_btn_sended) {
-      tone_controller->FastToneSignal(400, 1000);
-    }
-  }
-  
+  PROFILE_FUNCTION(PROF_SENSORS_SENDING);
+
+  flushEvents();
+
   bool result = false;
   unsigned long int curr_millis = millis();
-  unsigned long int millis_sum_delay = 0;
   unsigned long int millis_sum_reset_delay = 0;
   
   if (curr_millis > last_reset_millis) {
@@ -159,146 +597,62 @@ bool sensorsSending()
   {
     if (errors_count>MAX_ERRORS) 
     {
-      DEBUG_WRITELN("Too much errors. Restarting...");
-      StartConnection(true);
+      LOG_ERROR(LOG_ERRORS_RECONNECT);
+      requestReconnect();
       errors_count = 0;
-      last_reset_millis = last_sending_millis = millis();
+      last_reset_millis = millis();
       return false;
     }
     errors_count = 0;
     last_reset_millis = curr_millis;
   }
 
-  if (curr_millis > last_sending_millis) 
-  {
-    millis_sum_delay = curr_millis - last_sending_millis;
-  }
-
-  if (!last_sending_millis || millis_sum_delay > SENDING_INTERVAL) 
+  if (sensors_ready && sensor_registry.isDue()) 
   {
     ind_controller->SensorsSendingState(1);
-    
-    char status;
-    double T,P;
-
-    String send_str = "'A':'on'";
-    String lcd1 = "";
-    String lcd2 = "";
-    
-    if (send_str.length()>0) send_str = send_str + ",";
-    send_str = send_str + "'E':" + String(errors_count);
-
-    status = pressure.startTemperature();
-    if (status != 0)
-    {
-      delay(status);
-      status = pressure.getTemperature(T);
-      if (status != 0)
-      {
-        if (send_str.length()>0) send_str = send_str + ",";
-        send_str = send_str + "'T':" + String(T, 2);
-        lcd1 = "T="+String(T, 1)+"\337C ";
-        
-        status = pressure.startPressure(3);
-        if (status != 0)
-        {
-          delay(status);
-          status = pressure.getPressure(P, T);
-          if (status != 0)
-          {
-            P = P*0.750063755;
-            if (send_str.length()>0) send_str = send_str + ",";
-            send_str = send_str + "'P':" + String(P, 3);
-            lcd2 = "P="+String(P, 2)+"mm";
-          }
-        }
-      }
-    }
-    
-    if (H_init) {
-      float H = dht.readHumidity();
-      if (!isnan(H)) {
-        setH = true;
-        oldH = H;
-        if (send_str.length()>0) send_str = send_str + ",";
-        send_str = send_str + "'H':" + String(H, 1);
-        lcd1 = lcd1 + "H="+String(H, H>99.9 ? 0 : 1)+"%";
-      } else if (setH) {
-        lcd1 = lcd1 + "H="+String(oldH, oldH>99.9 ? 0 : 1)+"%";
-      }
-    }
 
-    uint16_t lux = lightMeter.readLightLevel();
-    if (send_str.length()>0) send_str = send_str + ",";
-    send_str = send_str + "'L':" + String(lux);
-    ind_controller->updateLightLevel(lux);
-
-    if (send_str.length()>0) send_str = send_str + ",";
-    send_str = send_str + "'R':'" + (digitalRead(HC_PIN) == HIGH ? "yes" : "no") + "'";
-
-    if (ns_state && !ns_info_sended) {
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'N':'yes'";
-    }
-
-    if (MXYZ_init) {
-      Vector norm = magnetic_meter.readNormalize();
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'Mx':" + String(norm.XAxis, 0) + ",'My':" + String(norm.YAxis, 0) + ",'Mz':" + String(norm.ZAxis, 0);
-    }
-
-    lcd_controller->setLCDLines(lcd1.c_str(), lcd2.c_str(), LCD_PAGE_SENSORS);
-    
-    if (send_str.length()>0) {
-      send_str = "DS_V={" + send_str + "}";
-      sendMessage(connection_id, send_str, 0);
-      result = true;
-    }
-    
     if (!hc_info_sended || !ns_info_sended) {
       ind_controller->SensorsSendingSignalState(0);
     }
-    
-    hc_info_sended = true;
-    ns_info_sended = true;
-
-    last_sending_millis = millis();
-
-    ind_controller->SensorsSendingState(0);
 
-  } else if ((hc_state && !hc_info_sended) || (ns_state && !ns_info_sended) || !sensor_outer_signal_sended || (signal_btn_pressed && !signal_btn_sended)) {
-    
-    delay(50);
-    
-    String send_str = "'A':'on'";
-    
-    if (hc_state && !hc_info_sended) {
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'R':'yes'";
-    }
-    if (ns_state && !ns_info_sended) {
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'N':'yes'";
-    }
-    if (signal_btn_pressed && !signal_btn_sended) {
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'B':'yes'";
-    }
-    if (!sensor_outer_signal_sended) {
-      if (send_str.length()>0) send_str = send_str + ",";
-      send_str = send_str + "'O':'"+(sensor_outer_signal ? "yes" : "no")+"'";
+    if (isReconnecting()) {
+      // Local rules still see the new readings
+      sensor_registry.postpone();
+      rule_engine->trigger(RULE_TRIGGER_SENSORS);
+    } else {
+      // Drivers that are due, from the conversions sample() started ahead of time
+      TelemetryMessage message;
+      telemetry_events = 0;
+      if (sensor_registry.compose(message)) {
+        if (StringHelper::replyIsOK(sendTelemetry(message, 0))) telemetryDelivered();
+        rule_engine->trigger(RULE_TRIGGER_SENSORS);
+        result = true;
+      }
     }
-    
-    char* reply = sendMessage(connection_id, "DS_V={"+send_str+"}", 1);
-    bool info_sended = StringHelper::replyIsOK(reply);
 
-    if (hc_state && !hc_info_sended) hc_info_sended = info_sended;
-    if (ns_state && !ns_info_sended) ns_info_sended = info_sended;
-    if (signal_btn_pressed && !signal_btn_sended) signal_btn_sended = info_sended;
-    if (!sensor_outer_signal_sended) sensor_outer_signal_sended = info_sended;
+    updateSensorsLCD();
 
-    ind_controller->SensorsSendingSignalState(0);
+    ind_controller->SensorsSendingState(0);
   }
 
   return result;
 }
+
+void updateSensorsLCD()
+{
+#if CSTATION_FEATURE_LCD
+  String lcd1 = "";
+  String lcd2 = "";
+  if (pressure.hasValue()) {
+    FixedPoint temperature(pressure.getTemperature(), 2);
+    FixedPoint mmhg(BMP180Sensor::toMillimetersHg(pressure.getPressure()), 3);
+    lcd1 = "T="+temperature.toString(1)+"\337C ";
+    lcd2 = "P="+mmhg.toString(2)+"mm";
+  }
+  if (dht.hasValue()) {
+    FixedPoint H(dht.getHumidity(), 1);
+    lcd1 = lcd1 + "H="+H.toString(H.raw>999 ? 0 : 1)+"%";
+  }
+  lcd_controller->setLCDLines(lcd1.c_str(), lcd2.c_str(), LCD_PAGE_SENSORS);
+#endif
+}
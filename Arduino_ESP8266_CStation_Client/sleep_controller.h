@@ -0,0 +1,136 @@
+#ifndef SLEEP_CONTROLLER_H
+#define SLEEP_CONTROLLER_H
+
+#include <avr/sleep.h>
+
+// Idle sleep between loop() passes. Each controller tells how long it can
+// wait (idleTime(), 0 when it has work now) and loop() sleeps for the
+// shortest of them in SLEEP_MODE_IDLE: only the CPU clock stops, the timers,
+// USARTs, TWI and the pin interrupts keep running and any of their interrupts
+// wakes the CPU. The Timer0 (millis) tick wakes it every ms anyway; after
+// each wake the sleep goes on unless the deadline passed, an ISR called
+// wake() or the caller's pending check sees new work (buttons, ESP data).
+
+// Upper bound of one sleep, deadlines are recomputed at least this often
+#define SLEEP_IDLE_MAX 1000
+// Idle share is measured over windows of this length
+#define SLEEP_STATS_WINDOW 10000
+
+typedef bool (*SleepPendingCallback)();
+
+class SleepController
+{
+  private:
+    volatile bool wake_requested;
+
+    unsigned long wakes_count;
+    unsigned long early_wakes_count;
+    unsigned long window_start_micros;
+    unsigned long window_sleep_micros;
+    byte idle_percent;
+
+    SleepController()
+    {
+      wake_requested = false;
+      wakes_count = 0;
+      early_wakes_count = 0;
+      window_start_micros = micros();
+      window_sleep_micros = 0;
+      idle_percent = 0;
+    }
+
+    void updateStats()
+    {
+      unsigned long elapsed = micros() - window_start_micros;
+      if (elapsed < SLEEP_STATS_WINDOW * 1000UL) return;
+      idle_percent = window_sleep_micros / (elapsed / 100);
+      window_start_micros += elapsed;
+      window_sleep_micros = 0;
+    }
+
+  public:
+    static SleepController *_self_controller;
+
+    static SleepController* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new SleepController();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // ms left until interval has passed since the since timestamp, 0 when it has
+    static unsigned long remaining(unsigned long since, unsigned long interval)
+    {
+      unsigned long elapsed = millis() - since;
+      return elapsed < interval ? interval - elapsed : 0;
+    }
+
+    static unsigned long shorter(unsigned long a, unsigned long b)
+    {
+      return a < b ? a : b;
+    }
+
+    // ISR: something for loop() came up, end the current sleep
+    void wake()
+    {
+      wake_requested = true;
+    }
+
+    // Sleeps up to idle_ms, called at the end of every loop() pass
+    void sleep(unsigned long idle_ms, SleepPendingCallback pending)
+    {
+      updateStats();
+      if (idle_ms > SLEEP_IDLE_MAX) idle_ms = SLEEP_IDLE_MAX;
+      unsigned long start_millis = millis();
+      while (idle_ms && millis() - start_millis < idle_ms) {
+        cli();
+        if (wake_requested || pending()) {
+          sei();
+          early_wakes_count++;
+          break;
+        }
+        unsigned long sleep_start = micros();
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        // The instruction after sei() runs before any interrupt, so none can slip in between
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        window_sleep_micros += micros() - sleep_start;
+        wakes_count++;
+      }
+      wake_requested = false;
+    }
+
+    // Share of the last SLEEP_STATS_WINDOW the CPU was asleep, %
+    byte getIdlePercent()
+    {
+      return idle_percent;
+    }
+
+    // CPU wake-ups from idle sleep, by any interrupt
+    unsigned long getWakesCount()
+    {
+      return wakes_count;
+    }
+
+    // Sleeps cut short by wake() or pending work
+    unsigned long getEarlyWakesCount()
+    {
+      return early_wakes_count;
+    }
+};
+
+SleepController *SleepController::_self_controller = NULL;
+
+#endif
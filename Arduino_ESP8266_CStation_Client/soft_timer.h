@@ -0,0 +1,212 @@
+#ifndef SOFT_TIMER_H
+#define SOFT_TIMER_H
+
+// Software timers on one 1 ms hardware tick (Timer5). Timers sit in a two
+// level timing wheel: the near wheel has one slot per tick, the far wheel one
+// slot per SOFT_TIMER_WHEEL_SIZE ticks and is cascaded into the near wheel
+// once per near wheel turn. Starting, stopping and firing a timer are O(1)
+// whatever the period; periods longer than both wheels just pass through the
+// far wheel again. The hardware tick only runs while some timer is active.
+// Callbacks run in the tick ISR, keep them short.
+
+#define SOFT_TIMER_TICK_US 1000
+#define SOFT_TIMER_WHEEL_BITS 6
+#define SOFT_TIMER_WHEEL_SIZE (1 << SOFT_TIMER_WHEEL_BITS)
+#define SOFT_TIMER_WHEEL_MASK (SOFT_TIMER_WHEEL_SIZE - 1)
+
+typedef void (*SoftTimerCallback)(void* context);
+
+struct SoftTimer
+{
+  SoftTimerCallback callback;
+  void* context;
+  unsigned long period;
+  unsigned long expires;
+  SoftTimer* next;
+  SoftTimer* prev;
+  SoftTimer** slot;
+};
+
+class SoftTimers
+{
+  private:
+    SoftTimer* near_wheel[SOFT_TIMER_WHEEL_SIZE];
+    SoftTimer* far_wheel[SOFT_TIMER_WHEEL_SIZE];
+    volatile unsigned long ticks;
+    byte active_count;
+
+    /* tick ISR cost */
+    volatile unsigned int tick_max_us;
+    volatile unsigned long callbacks_count;
+
+    SoftTimers()
+    {
+      for(byte i=0; i<SOFT_TIMER_WHEEL_SIZE; i++) {
+        near_wheel[i] = NULL;
+        far_wheel[i] = NULL;
+      }
+      ticks = 0;
+      active_count = 0;
+      tick_max_us = 0;
+      callbacks_count = 0;
+    }
+
+    // Interrupts disabled
+    void insert(SoftTimer* timer)
+    {
+      unsigned long delta = timer->expires - ticks;
+      SoftTimer** slot;
+      if (delta < SOFT_TIMER_WHEEL_SIZE) {
+        slot = &near_wheel[timer->expires & SOFT_TIMER_WHEEL_MASK];
+      } else {
+        slot = &far_wheel[(timer->expires >> SOFT_TIMER_WHEEL_BITS) & SOFT_TIMER_WHEEL_MASK];
+      }
+      if (!timer->slot) active_count++;
+      timer->slot = slot;
+      timer->prev = NULL;
+      timer->next = *slot;
+      if (*slot) (*slot)->prev = timer;
+      *slot = timer;
+    }
+
+    // Interrupts disabled
+    void remove(SoftTimer* timer)
+    {
+      if (!timer->slot) return;
+      if (timer->prev) timer->prev->next = timer->next; else *timer->slot = timer->next;
+      if (timer->next) timer->next->prev = timer->prev;
+      active_count--;
+      timer->slot = NULL;
+      timer->next = timer->prev = NULL;
+    }
+
+  public:
+    static SoftTimers *_self_controller;
+
+    static SoftTimers* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new SoftTimers();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    static void init(SoftTimer* timer, SoftTimerCallback callback, void* context)
+    {
+      timer->callback = callback;
+      timer->context = context;
+      timer->period = 0;
+      timer->expires = 0;
+      timer->next = timer->prev = NULL;
+      timer->slot = NULL;
+    }
+
+    void begin()
+    {
+      startTimer5(SOFT_TIMER_TICK_US);
+      pauseTimer5();
+    }
+
+    // (Re)starts a periodic timer, period in ms. Safe from timer callbacks.
+    void start(SoftTimer* timer, unsigned long period)
+    {
+      uint8_t sreg = SREG;
+      cli();
+      remove(timer);
+      if (!active_count) {
+        startTimer5(SOFT_TIMER_TICK_US);
+        resetTimer5();
+      }
+      timer->period = period ? period : 1;
+      timer->expires = ticks + timer->period;
+      insert(timer);
+      SREG = sreg;
+    }
+
+    void stop(SoftTimer* timer)
+    {
+      uint8_t sreg = SREG;
+      cli();
+      remove(timer);
+      if (!active_count) pauseTimer5();
+      SREG = sreg;
+    }
+
+    bool isActive(SoftTimer* timer)
+    {
+      return timer->slot != NULL;
+    }
+
+    // Tick ISR
+    void tick()
+    {
+      unsigned int start_us = micros();
+      unsigned long now = ++ticks;
+      byte near_slot = now & SOFT_TIMER_WHEEL_MASK;
+
+      if (!near_slot) {
+        // Detach first: timers that are still far away go back to the same slot
+        SoftTimer* timer = far_wheel[(now >> SOFT_TIMER_WHEEL_BITS) & SOFT_TIMER_WHEEL_MASK];
+        far_wheel[(now >> SOFT_TIMER_WHEEL_BITS) & SOFT_TIMER_WHEEL_MASK] = NULL;
+        while (timer) {
+          SoftTimer* next = timer->next;
+          insert(timer);
+          timer = next;
+        }
+      }
+
+      // Everything in the current near slot expires now. A fired timer goes to
+      // another slot, and callbacks may start or stop any timer.
+      SoftTimer* timer;
+      while ((timer = near_wheel[near_slot]) != NULL) {
+        remove(timer);
+        timer->expires += timer->period;
+        insert(timer);
+        callbacks_count++;
+        timer->callback(timer->context);
+      }
+
+      unsigned int tick_us = (unsigned int)micros() - start_us;
+      if (tick_us > tick_max_us) tick_max_us = tick_us;
+    }
+
+    unsigned long getTicks()
+    {
+      uint8_t sreg = SREG;
+      cli();
+      unsigned long result = ticks;
+      SREG = sreg;
+      return result;
+    }
+
+    // Longest tick ISR so far, us
+    unsigned int getTickMaxMicros()
+    {
+      return tick_max_us;
+    }
+
+    unsigned long getCallbacksCount()
+    {
+      return callbacks_count;
+    }
+};
+
+ISR(timer5Event)
+{
+  PROFILE_FUNCTION(PROF_TIMER5_ISR);
+  resetTimer5();
+  SoftTimers::Instance()->tick();
+}
+
+SoftTimers *SoftTimers::_self_controller = NULL;
+
+#endif
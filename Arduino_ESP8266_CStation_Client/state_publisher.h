@@ -0,0 +1,179 @@
+#ifndef STATE_PUBLISHER_H
+#define STATE_PUBLISHER_H
+
+// State push for servers that sent STATES_SUBSCRIBE=1. Every loop() pass the
+// tracked fields are compared with the values seen last time and the changed
+// ones are marked in a dirty mask, so changes made from timers (fan steps,
+// auto light) are caught the same way as the ones made by commands. The mask
+// goes out as DS_STATE={...} with only those fields, at most once per
+// STATE_PUSH_INTERVAL; changes in between are merged into the next push.
+// Subscription ends with the link, the server subscribes again after DS_READY.
+
+// Shortest gap between two pushes, ms
+#define STATE_PUSH_INTERVAL 1000
+
+#define STATE_FIELD_BIT(state_code) (1U << (state_code))
+#define STATE_FIELDS_ALL ((STATE_FIELD_BIT(STATE_CODES_COUNT) - 1) & ~STATE_FIELD_BIT(STATE_NONE))
+// Changes every second, only pushed when marked (SET_TIME) or with the first push
+#define STATE_FIELDS_TRACKED (STATE_FIELDS_ALL & ~STATE_FIELD_BIT(STATE_TIME))
+
+class StatePublisher
+{
+  private:
+    bool subscribed;
+    unsigned dirty;
+    unsigned long values[STATE_CODES_COUNT];
+    unsigned long last_push_millis;
+    unsigned long pushes_count;
+    unsigned long pushed_fields_count;
+
+    StatePublisher()
+    {
+      subscribed = false;
+      dirty = 0;
+      last_push_millis = 0;
+      pushes_count = 0;
+      pushed_fields_count = 0;
+    }
+
+    static const char* fieldName(byte state_code)
+    {
+      switch(state_code) {
+        case STATE_LED:          return "LED";
+        case STATE_TONE:         return "TONE";
+        case STATE_FAN:          return "FAN";
+        case STATE_LIGHTG4:      return "G4_LIGHT";
+        case STATE_ALARM_HOUR:   return "ALARM_HOUR";
+        case STATE_BEEP_HOURLY:  return "BEEP_HOURLY";
+        case STATE_TIME:         return "TIME";
+        case STATE_TIME_STATUS:  return "TIME_STATUS";
+      }
+      return "";
+    }
+
+    static bool isSwitchField(byte state_code)
+    {
+      return state_code <= STATE_LIGHTG4 || state_code == STATE_BEEP_HOURLY;
+    }
+
+  public:
+    static StatePublisher *_self_controller;
+
+    static StatePublisher* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new StatePublisher();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // "KEY":"value" pairs of the fields in the mask, as in the STATES_REQUEST reply
+    static String composeFields(unsigned fields)
+    {
+      String result = "";
+      for(byte i=STATE_NONE+1; i<STATE_CODES_COUNT; i++) {
+        if (!(fields & STATE_FIELD_BIT(i))) continue;
+        unsigned long value = getState((StateQueryCode) i);
+        if (result.length()) result += ", ";
+        result += "\"";
+        result += fieldName(i);
+        result += "\":\"";
+        if (isSwitchField(i)) {
+          result += value ? "on" : "off";
+        } else {
+          result += String(value);
+        }
+        result += "\"";
+      }
+      return result;
+    }
+
+    // Subscribing starts with a push of every field
+    void subscribe(bool on)
+    {
+      subscribed = on;
+      dirty = 0;
+      if (!subscribed) return;
+      for(byte i=STATE_NONE+1; i<STATE_CODES_COUNT; i++) values[i] = getState((StateQueryCode) i);
+      dirty = STATE_FIELDS_ALL;
+      last_push_millis = millis() - STATE_PUSH_INTERVAL;
+    }
+
+    bool isSubscribed()
+    {
+      return subscribed;
+    }
+
+    void markDirty(StateQueryCode state_code)
+    {
+      if (subscribed) dirty |= STATE_FIELD_BIT(state_code);
+    }
+
+    // Marks the tracked fields that changed since the last call
+    void update()
+    {
+      if (!subscribed) return;
+      for(byte i=STATE_NONE+1; i<STATE_CODES_COUNT; i++) {
+        if (!(STATE_FIELDS_TRACKED & STATE_FIELD_BIT(i))) continue;
+        unsigned long value = getState((StateQueryCode) i);
+        if (value != values[i]) {
+          values[i] = value;
+          dirty |= STATE_FIELD_BIT(i);
+        }
+      }
+    }
+
+    bool isDue()
+    {
+      return subscribed && dirty && !SleepController::remaining(last_push_millis, STATE_PUSH_INTERVAL);
+    }
+
+    unsigned long idleTime()
+    {
+      if (!subscribed || !dirty) return SLEEP_IDLE_MAX;
+      return SleepController::remaining(last_push_millis, STATE_PUSH_INTERVAL);
+    }
+
+    // Dirty mask for the push, cleared until the next change
+    unsigned take()
+    {
+      unsigned fields = dirty;
+      dirty = 0;
+      last_push_millis = millis();
+      return fields;
+    }
+
+    // Push result: sent fields are counted, failed ones go out with the next push
+    void pushed(unsigned fields, bool sended)
+    {
+      if (!sended) {
+        if (subscribed) dirty |= fields;
+        return;
+      }
+      pushes_count++;
+      for(; fields; fields &= fields - 1) pushed_fields_count++;
+    }
+
+    unsigned long getPushesCount()
+    {
+      return pushes_count;
+    }
+
+    unsigned long getPushedFieldsCount()
+    {
+      return pushed_fields_count;
+    }
+};
+
+StatePublisher *StatePublisher::_self_controller = NULL;
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef STRING_HELPER_H
 #define STRING_HELPER_H
 
+#include <util/crc16.h>
+
 class StringHelper 
 {
   public:
@@ -77,6 +79,25 @@ class StringHelper
       }
       return foundOK;
     }
+
+    static bool isCleanReply(const char* reply)
+    {
+      if (reply) {
+        for (; *reply; reply++) {
+          byte c = *reply;
+          if ((c<' ' && c!='\r' && c!='\n') || c>'~') return false;
+        }
+      }
+      return true;
+    }
+	
+    // CRC-16/CCITT-FALSE of the string, the same on the server side
+    static uint16_t crc16(const char* str)
+    {
+      uint16_t crc = 0xFFFF;
+      for (; *str; str++) crc = _crc_xmodem_update(crc, *str);
+      return crc;
+    }
 	
   	static void degStrConvert(char *str)
   	{
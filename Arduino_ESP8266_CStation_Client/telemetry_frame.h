@@ -0,0 +1,126 @@
+#ifndef TELEMETRY_FRAME_H
+#define TELEMETRY_FRAME_H
+
+#include <util/crc16.h>
+
+// Binary alternative to the DS_V={...} text telemetry, used once the server
+// asked for it with SET_FORMAT=1. Layout, multi-byte fields little endian:
+//   magic    0xC5, never the first byte of a text line
+//   version  TELEMETRY_FRAME_VERSION
+//   length   whole frame including the CRC
+//   station  station id
+//   sequence increments with every frame
+//   presence varint, bit i set when sensors_list entry i is present
+//   values   one zigzag varint per present sensor, in sensor index order;
+//            integers scaled by 10^DEC of the sensor (DS_INFO 'DEC', 0 if
+//            missing), ENUM sensors as the index of the value
+//   crc      CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) of all bytes before it
+
+#define TELEMETRY_FRAME_MAGIC 0xC5
+#define TELEMETRY_FRAME_VERSION 1
+// Header, presence, every sensor at the longest varint and the CRC
+#define TELEMETRY_FRAME_MAX (5 + 5 + SENSORS_COUNT * 5 + 2)
+
+class TelemetryFrame
+{
+  private:
+    long values[SENSORS_COUNT];
+    unsigned long presence;
+
+    byte putVarint(byte pos, unsigned long value)
+    {
+      while (value >= 0x80) {
+        data[pos++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+      }
+      data[pos++] = value;
+      return pos;
+    }
+
+  public:
+    byte data[TELEMETRY_FRAME_MAX];
+    byte length;
+
+    TelemetryFrame()
+    {
+      presence = 0;
+      length = 0;
+    }
+
+    void add(SensorId sensor, long value)
+    {
+      values[sensor] = value;
+      presence |= 1UL << sensor;
+    }
+
+    // Rescaled to the decimals the sensor is declared with
+    void add(SensorId sensor, const FixedPoint& value)
+    {
+      add(sensor, value.scaled(Descriptors::sensorDecimals(sensor)));
+    }
+
+    bool isEmpty()
+    {
+      return !presence;
+    }
+
+    // Encodes the values added so far into data/length
+    void finish(byte station, byte sequence)
+    {
+      byte pos = 0;
+      data[pos++] = TELEMETRY_FRAME_MAGIC;
+      data[pos++] = TELEMETRY_FRAME_VERSION;
+      pos++;
+      data[pos++] = station;
+      data[pos++] = sequence;
+      pos = putVarint(pos, presence);
+      for(byte i=0; i<SENSORS_COUNT; i++) {
+        if (presence & (1UL << i)) {
+          pos = putVarint(pos, ((unsigned long)values[i] << 1) ^ (unsigned long)(values[i] >> 31));
+        }
+      }
+      data[2] = pos + 2;
+      uint16_t crc = 0xFFFF;
+      for(byte i=0; i<pos; i++) crc = _crc_xmodem_update(crc, data[i]);
+      data[pos++] = crc & 0xFF;
+      data[pos++] = crc >> 8;
+      length = pos;
+    }
+};
+
+// One telemetry message in both formats, sendTelemetry() sends the one the
+// server asked for. Every message starts with the activity flag.
+class TelemetryMessage
+{
+  public:
+    String text;
+    TelemetryFrame frame;
+
+    TelemetryMessage()
+    {
+      text = Descriptors::sensorKey(SENSOR_ACTIVITY) + "'on'";
+      frame.add(SENSOR_ACTIVITY, 1);
+    }
+
+    void add(SensorId sensor, long value)
+    {
+      text = text + "," + Descriptors::sensorKey(sensor) + String(value);
+      frame.add(sensor, value);
+    }
+
+    // With the decimals the sensor is declared with
+    void add(SensorId sensor, const FixedPoint& value)
+    {
+      text = text + "," + Descriptors::sensorKey(sensor) + value.toString(Descriptors::sensorDecimals(sensor));
+      frame.add(sensor, value);
+    }
+
+    // ENUM sensors with 'no','yes' values
+    void addFlag(SensorId sensor, bool value)
+    {
+      text = text + "," + Descriptors::sensorKey(sensor) + (value ? "'yes'" : "'no'");
+      frame.add(sensor, value ? 1 : 0);
+    }
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef TIME_SYNC_CONTROLLER_H
+#define TIME_SYNC_CONTROLLER_H
+
+// Time from the server, NTP style over the DS_GETTIME/SET_TIME exchange.
+// The request and the reply are timestamped with millis() and the server time
+// (SET_TIME=<unix>[.<ms>]) is taken as read half way through the round trip.
+// Between syncs the time runs from millis() corrected by the oscillator drift
+// measured over successive syncs, TimeLib is set from it at a second boundary
+// every TIME_APPLY_INTERVAL. The sync interval doubles while the clock stays
+// within TIME_SYNC_MAX_ERROR of the server and halves when it does not.
+// Whole second replies still work, but are too coarse for the drift estimate.
+// The drift is kept in ppb and applied with 32-bit integer math only.
+
+// Sync interval bounds, s; TIME_SYNC_INTERVAL is the initial one
+#define TIME_SYNC_INTERVAL_MAX 21600
+// Error allowed to build up between two syncs, ms
+#define TIME_SYNC_MAX_ERROR 250
+// A request without reply is repeated after this, ms
+#define TIME_SYNC_RETRY 30000
+// Round trips longer than this are not used for the drift, ms
+#define TIME_SYNC_RTT_MAX 2000
+// Drift samples noisier than this are skipped, ppm
+#define TIME_DRIFT_NOISE_MAX 20
+// ppb
+#define TIME_DRIFT_LIMIT 500000L
+// Longer spans between syncs do not fit partsPerBillion(), ms
+#define TIME_DRIFT_SPAN_MAX 400000000UL
+// TimeLib follows the corrected clock this often, ms
+#define TIME_APPLY_INTERVAL 60000
+// setTime() only this early into a second, ms
+#define TIME_APPLY_WINDOW 20
+// SET_TIME without a ms part
+#define TIME_MS_UNKNOWN 0xFFFF
+
+class TimeSyncController
+{
+  private:
+    bool synced;
+    bool drift_known;
+    bool apply_pending;
+    time_t ref_time;
+    unsigned ref_ms;
+    unsigned long ref_millis;
+    unsigned ref_resolution;
+    unsigned long ref_round_trip;
+    // Correction applied to millis(), negative when the oscillator runs fast
+    long drift_ppb;
+    unsigned long interval;
+    long last_error;
+    unsigned long request_millis;
+    unsigned long last_request_millis;
+    unsigned long round_trip;
+    unsigned long last_apply_millis;
+
+    TimeSyncController()
+    {
+      synced = false;
+      drift_known = false;
+      apply_pending = false;
+      ref_time = 0;
+      ref_ms = 0;
+      ref_millis = 0;
+      ref_resolution = 0;
+      ref_round_trip = 0;
+      drift_ppb = 0;
+      interval = TIME_SYNC_INTERVAL;
+      last_error = 0;
+      request_millis = 0;
+      last_request_millis = millis() - TIME_SYNC_RETRY;
+      round_trip = 0;
+      last_apply_millis = 0;
+    }
+
+    // elapsed * drift_ppb / 10^9, the whole ppm and the rest apart so both products fit 32 bits
+    long driftCorrection(unsigned long elapsed)
+    {
+      unsigned long ppb = labs(drift_ppb);
+      unsigned long correction = FixedPoint::mulDivRound(elapsed, ppb / 1000, 1000000UL) +
+                                 FixedPoint::mulDivRound(elapsed / 1000, ppb % 1000, 1000000UL);
+      return drift_ppb < 0 ? -(long)correction : (long)correction;
+    }
+
+    // part * 10^9 / whole for part < whole <= TIME_DRIFT_SPAN_MAX, one decimal digit at a time
+    static unsigned long partsPerBillion(unsigned long part, unsigned long whole)
+    {
+      unsigned long result = 0;
+      for(byte i=0; i<9; i++) {
+        part *= 10;
+        result = result*10 + part / whole;
+        part %= whole;
+      }
+      return result;
+    }
+
+    // Server time at the given millis() by the corrected clock
+    void predict(unsigned long at, time_t* time, unsigned* ms)
+    {
+      unsigned long elapsed = at - ref_millis;
+      unsigned long total = ref_ms + elapsed + driftCorrection(elapsed);
+      *time = ref_time + total / 1000;
+      *ms = total % 1000;
+    }
+
+    void adaptInterval(unsigned long noise)
+    {
+      // Beyond what the measurement itself can be off by
+      unsigned long error = labs(last_error);
+      error = error > noise ? error - noise : 0;
+      if (error < TIME_SYNC_MAX_ERROR / 4 && interval < TIME_SYNC_INTERVAL_MAX) {
+        interval *= 2;
+        if (interval > TIME_SYNC_INTERVAL_MAX) interval = TIME_SYNC_INTERVAL_MAX;
+      } else if (error > TIME_SYNC_MAX_ERROR / 2 && interval > TIME_SYNC_INTERVAL) {
+        interval /= 2;
+        if (interval < TIME_SYNC_INTERVAL) interval = TIME_SYNC_INTERVAL;
+      }
+    }
+
+  public:
+    static TimeSyncController *_self_controller;
+
+    static TimeSyncController* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new TimeSyncController();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    // ".250" part of a SET_TIME parameter as ms, TIME_MS_UNKNOWN when there is none
+    static unsigned readMillisFraction(const char* param)
+    {
+      const char* fraction = strchr(param, '.');
+      if (!fraction || !isdigit(fraction[1])) return TIME_MS_UNKNOWN;
+      unsigned ms = 0;
+      unsigned scale = 100;
+      for(byte i=1; i<=3 && isdigit(fraction[i]); i++, scale/=10) ms += (fraction[i]-'0') * scale;
+      return ms;
+    }
+
+    bool isSyncDue()
+    {
+      if (millis() - last_request_millis < TIME_SYNC_RETRY) return false;
+      return !synced || millis() - ref_millis >= interval * 1000UL;
+    }
+
+    void requestSent(bool sended)
+    {
+      last_request_millis = millis();
+      request_millis = sended ? last_request_millis : 0;
+    }
+
+    // SET_TIME received. server_ms is TIME_MS_UNKNOWN for whole seconds, a reply
+    // without a pending request is applied with no round trip correction.
+    void setServerTime(time_t server_time, unsigned server_ms)
+    {
+      unsigned long received = millis();
+      bool measured = request_millis != 0;
+      if (measured) {
+        round_trip = received - request_millis;
+        request_millis = 0;
+      }
+      // Truncated to the second by the server: the middle of that second
+      unsigned resolution = server_ms == TIME_MS_UNKNOWN ? 500 : 1;
+      unsigned long total = (server_ms == TIME_MS_UNKNOWN ? 500 : server_ms) + (measured ? round_trip / 2 : 0);
+      server_time += total / 1000;
+      server_ms = total % 1000;
+      bool usable = measured && round_trip <= TIME_SYNC_RTT_MAX;
+
+      if (synced) {
+        time_t predicted_time;
+        unsigned predicted_ms;
+        predict(received, &predicted_time, &predicted_ms);
+        last_error = (long)(predicted_time - server_time) * 1000 + (long)predicted_ms - (long)server_ms;
+        unsigned long span = received - ref_millis;
+        // A steady path asymmetry shifts both syncs alike, only the change of the round trip counts
+        unsigned long rtt_change = round_trip > ref_round_trip ? round_trip - ref_round_trip : ref_round_trip - round_trip;
+        unsigned long noise = resolution + ref_resolution + rtt_change / 2;
+        if (usable && ref_resolution && span <= TIME_DRIFT_SPAN_MAX && noise * (1000000UL / TIME_DRIFT_NOISE_MAX) <= span) {
+          // Elapsed by the corrected clock minus elapsed by the server, spread over the span
+          unsigned long error = labs(last_error);
+          // Past 1000 ppm the sample is clamped below anyway
+          long error_ppb = error < span / 1000 ? (long)partsPerBillion(error, span) : 2 * TIME_DRIFT_LIMIT;
+          long measured_ppb = drift_ppb - (last_error < 0 ? -error_ppb : error_ppb);
+          drift_ppb = drift_known ? (drift_ppb + measured_ppb) / 2 : measured_ppb;
+          if (drift_ppb > TIME_DRIFT_LIMIT) drift_ppb = TIME_DRIFT_LIMIT;
+          if (drift_ppb < -TIME_DRIFT_LIMIT) drift_ppb = -TIME_DRIFT_LIMIT;
+          drift_known = true;
+        }
+        if (measured) adaptInterval(resolution + round_trip / 2);
+      }
+
+      ref_time = server_time;
+      ref_ms = server_ms;
+      ref_millis = received;
+      ref_resolution = usable ? resolution : 0;
+      ref_round_trip = round_trip;
+      synced = true;
+      // Whole seconds now, the second boundary is put in place by timerProcess()
+      setTime(server_time);
+      apply_pending = true;
+    }
+
+    void timerProcess()
+    {
+      if (!synced) return;
+      if (!apply_pending && millis() - last_apply_millis >= TIME_APPLY_INTERVAL) apply_pending = true;
+      if (!apply_pending) return;
+      time_t time;
+      unsigned ms;
+      predict(millis(), &time, &ms);
+      if (ms >= TIME_APPLY_WINDOW) return;
+      setTime(time);
+      apply_pending = false;
+      last_apply_millis = millis();
+    }
+
+    // ms until timerProcess() has to set the clock
+    unsigned long idleTime()
+    {
+      if (!synced) return SLEEP_IDLE_MAX;
+      if (!apply_pending) return SleepController::remaining(last_apply_millis, TIME_APPLY_INTERVAL);
+      time_t time;
+      unsigned ms;
+      predict(millis(), &time, &ms);
+      return ms < TIME_APPLY_WINDOW ? 0 : 1000 - ms;
+    }
+
+    // ms until the next DS_GETTIME is due
+    unsigned long syncIdleTime()
+    {
+      unsigned long retry = SleepController::remaining(last_request_millis, TIME_SYNC_RETRY);
+      if (!synced) return retry;
+      unsigned long due = SleepController::remaining(ref_millis, interval * 1000UL);
+      return due > retry ? due : retry;
+    }
+
+    // timeSet while the last sync is within twice the interval
+    timeStatus_t getStatus()
+    {
+      if (!synced) return timeNotSet;
+      return millis() - ref_millis > interval * 2000UL ? timeNeedsSync : timeSet;
+    }
+
+    // Current sync interval, s
+    unsigned long getInterval()
+    {
+      return interval;
+    }
+
+    unsigned long getRoundTrip()
+    {
+      return round_trip;
+    }
+
+    // Correction applied to millis(), ppb
+    long getDriftPPB()
+    {
+      return drift_ppb;
+    }
+
+    // Corrected clock minus server time at the last sync, ms
+    long getLastError()
+    {
+      return last_error;
+    }
+};
+
+TimeSyncController *TimeSyncController::_self_controller = NULL;
+
+#endif
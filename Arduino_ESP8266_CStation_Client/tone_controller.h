@@ -2,12 +2,13 @@
 #define TONE_CONTROLLER_H
 
 #define TONE_PIN 7
-#define MAX_TIMER_PERIOD 1000
 
 #define MELODY_MAX_SIZE 512
 
 #define CUSTOM_MELODY_ADDR 1024
 
+#if CSTATION_FEATURE_BUZZER
+
 const unsigned oct_freq[9][7] = {
   {16,  18,  21,  22,  25,  28,  31  },
   {33,  37,  41,  44,  49,  55,  62  },
@@ -20,8 +21,11 @@ const unsigned oct_freq[9][7] = {
   {4186,4699,5274,5588,6272,7040,7902}
 };
 
-const float diez_k = 1.059463;
-const float bemol_k = 0.9438743;
+// Sharp/flat factors 1.059463 and 0.9438743 in Q16, exact for every oct_freq entry
+#define DIEZ_K_Q16 69431UL
+#define BEMOL_K_Q16 61857UL
+
+#if CSTATION_FEATURE_MELODIES
 
 byte melody_count = 17;
 
@@ -45,6 +49,13 @@ const char melody_17[] PROGMEM = "180-1:G6=4,C7=5,B6=2,C7=6,B6=2,A6=8,p4,G6=4,A6
 
 const char* const melody_list[] PROGMEM = {melody_1, melody_2, melody_3, melody_4, melody_5, melody_6, melody_7, melody_8, melody_9, melody_10, melody_11, melody_12, melody_13, melody_14, melody_15, melody_16, melody_17};
 
+#else
+
+// Only the custom melody in EEPROM, index 0
+byte melody_count = 0;
+
+#endif
+
 char melody_buffer[MELODY_MAX_SIZE+1];
 
 class ToneController 
@@ -62,39 +73,49 @@ class ToneController
     volatile bool fast_signal_active; // Fast signal flag
     volatile bool tone_muted;
     volatile bool tone_is_melody;
+    volatile bool tone_audible; // Buzzer is sounding right now
+    volatile unsigned long audible_millis; // Start of the current audible span
+    volatile unsigned long audible_total; // Audible time of the finished spans, ms
+    volatile unsigned long audible_spans;
     char *melody;
     int sub_level;
     unsigned int melody_tempo;
     volatile unsigned int melody_pos;
-    volatile byte melody_timer_counter;
-    volatile byte melody_timer_counter_max;
+    volatile byte melody_step_length; // Current melody step in tempo units
 
-    volatile unsigned long timer_counter;
-    volatile unsigned long timer_counter_max;
+    SoftTimer tone_timer;
 
-    void StartTonePeriodTimer(unsigned long period_ms) 
+    static void toneTimerSignal(void* context)
     {
-      if (!tone_periodic) {
+      ((ToneController*)context)->TonePeriodTimerSignal();
+    }
 
-        if (period_ms>MAX_TIMER_PERIOD) {
-          unsigned long correct_period;
-          if (period_ms>=2*MAX_TIMER_PERIOD) {
-            correct_period = MAX_TIMER_PERIOD;
-          } else {
-            correct_period = period_ms / 2;
-          }
-          for(;period_ms % correct_period != 0; correct_period--);
-          timer_counter_max = period_ms/correct_period;
-          period_ms = correct_period;
-        } else {
-          timer_counter_max = 1;
-        }
-        timer_counter = timer_counter_max;
+    void ToneOn(unsigned frequency)
+    {
+      tone(TONE_PIN, frequency);
+      if (!tone_audible) {
+        tone_audible = true;
+        audible_millis = millis();
+        audible_spans++;
+      }
+    }
 
-        DEBUG_WRITE("Timer5 period = "); DEBUG_WRITELN(period_ms*1000);
-        DEBUG_WRITE("Timer5 max counter = "); DEBUG_WRITELN(timer_counter_max);
-        startTimer5(period_ms*1000);
-        resetTimer5();
+    void ToneOff()
+    {
+      noTone(TONE_PIN);
+      digitalWrite(TONE_PIN, HIGH);
+      if (tone_audible) {
+        tone_audible = false;
+        audible_total += millis() - audible_millis;
+        audible_millis = millis();
+      }
+    }
+
+    void StartTonePeriodTimer(unsigned long period_ms) 
+    {
+      if (!tone_periodic) {
+        LOG_DEBUG(LOG_TONE_PERIOD, period_ms);
+        soft_timers->start(&tone_timer, period_ms);
         tone_periodic = true;
         tone_period = period_ms;
       }
@@ -103,24 +124,22 @@ class ToneController
     void StopTonePeriodTimer() 
     {
       if (tone_periodic) {
-        pauseTimer5();
-        DEBUG_WRITELN("Timer5 paused");
+        soft_timers->stop(&tone_timer);
+        LOG_DEBUG(LOG_TONE_TIMER_STOP);
         tone_periodic = false;
         tone_period = 0;
-        timer_counter = 0;
-        timer_counter_max = 0;
       }
     }
 
     void StartSimpleTone(unsigned frequency)
     {
-      DEBUG_WRITE("Starting tone. F="); DEBUG_WRITELN(tone_frequency);
+      LOG_DEBUG(LOG_TONE_START, frequency);
       StopTonePeriodTimer();
       tone_frequency = frequency;
       tone_period = 0;
       tone_periodic_repeats = 0;
       tone_is_active = true;
-      tone(TONE_PIN, tone_frequency);
+      ToneOn(tone_frequency);
       if (prog_led_tone_control) {
         ind_controller->ToneState(1);
         prog_led_state = true;
@@ -130,7 +149,7 @@ class ToneController
 
     void StartPeriodicTone(unsigned frequency, unsigned long period, unsigned long repeats_count, bool start_state)
     {
-      DEBUG_WRITE("Starting tone. F="); DEBUG_WRITE(frequency); DEBUG_WRITE(" P="); DEBUG_WRITE(period); DEBUG_WRITE(" R="); DEBUG_WRITELN(repeats_count);
+      LOG_DEBUG(LOG_TONE_START_REPEAT, frequency, period, repeats_count);
       tone_frequency = frequency;
       tone_periodic_repeats = repeats_count;
       tone_state = !start_state;
@@ -145,21 +164,15 @@ class ToneController
 
     void ToneMelodyAction()
     {
-	  if (melody_timer_counter<melody_timer_counter_max) {
-		  melody_timer_counter++;
-		  return;
-	  }
-	  melody_timer_counter = 0;
+      PROFILE_FUNCTION(PROF_MELODY_ACTION);
       if (melody[melody_pos]==0) {
-        noTone(TONE_PIN);
-        digitalWrite(TONE_PIN, HIGH);
+        ToneOff();
         tone_muted = true;
         return;
       }
       if (melody[melody_pos]==',') melody_pos++;
       if (melody[melody_pos]==',' || melody[melody_pos]==0) {
-        noTone(TONE_PIN);
-        digitalWrite(TONE_PIN, HIGH);
+        ToneOff();
         if (melody[melody_pos]==0) {
           tone_muted = true;
           return;
@@ -167,7 +180,7 @@ class ToneController
       } else {
         char bukv = melody[melody_pos];
 		if (bukv!='p') {
-			melody_timer_counter_max = 8;
+			melody_step_length = 8;
 			byte b_pos = 0;
 			switch(bukv) {
 			  case 'C': b_pos = 0; break;
@@ -185,11 +198,11 @@ class ToneController
 			unsigned int cfreq = oct_freq[c_pos][b_pos];
 			if (melody[melody_pos+1]=='#') {
 				melody_pos++;
-				cfreq = cfreq * diez_k;
+				cfreq = (cfreq * DIEZ_K_Q16) >> 16;
 			}
 			if (melody[melody_pos+1]=='b') {
 				melody_pos++;
-				cfreq = cfreq * bemol_k;
+				cfreq = (cfreq * BEMOL_K_Q16) >> 16;
 			}
 			if (melody[melody_pos+1]=='=') {
 				melody_pos+=2;
@@ -198,34 +211,34 @@ class ToneController
 				  return;
 				}
 				char pcifr = melody[melody_pos];
-				melody_timer_counter_max = pcifr - '0';
-				if (melody_timer_counter_max>9) melody_timer_counter_max = 9;
+				melody_step_length = pcifr - '0';
+				if (melody_step_length>9) melody_step_length = 9;
 			}
-			tone(TONE_PIN, cfreq);
+			ToneOn(cfreq);
 		} else {
-			noTone(TONE_PIN);
-			digitalWrite(TONE_PIN, HIGH);
+			ToneOff();
 			melody_pos++;
 			if (melody[melody_pos]==0) {
 			  tone_muted = true;
 			  return;
 			}
 			char pcifr = melody[melody_pos];
-			melody_timer_counter_max = pcifr - '0';
-			if (melody_timer_counter_max>9) melody_timer_counter_max = 9;
+			melody_step_length = pcifr - '0';
+			if (melody_step_length>9) melody_step_length = 9;
 		}
       }
       melody_pos++;
+      // Next step exactly when this one ends, no idle ticks in between
+      soft_timers->start(&tone_timer, (unsigned long)melody_tempo * (melody_step_length + 1));
     }
 
     void TonePeriodAction()
     {
       tone_state = !tone_state;
       if (tone_state) {
-        tone(TONE_PIN, tone_frequency);
+        ToneOn(tone_frequency);
       } else {
-        noTone(TONE_PIN);
-        digitalWrite(TONE_PIN, HIGH);
+        ToneOff();
       }
       if (prog_led_tone_control) {
         prog_led_state = !prog_led_state;
@@ -275,7 +288,13 @@ class ToneController
       fast_signal_active = false;
       tone_muted = false;
       tone_is_melody = false;
+      tone_audible = false;
+      audible_millis = 0;
+      audible_total = 0;
+      audible_spans = 0;
       melody_tempo = 600;
+      melody_step_length = 1;
+      SoftTimers::init(&tone_timer, toneTimerSignal, this);
     }
 
     void timerProcess()
@@ -285,11 +304,41 @@ class ToneController
       }
     }
 
+    // ms until timerProcess() has something to do
+    unsigned long idleTime()
+    {
+      return tone_muted ? 0 : SLEEP_IDLE_MAX;
+    }
+
     bool isToneRunning()
     {
       return tone_is_active && !tone_muted;
     }
 
+    // True while the buzzer sounds and for tail_ms after it went quiet
+    bool isToneAudible(unsigned long tail_ms)
+    {
+      return tone_audible || millis() - audible_millis < tail_ms;
+    }
+
+    // Total time the buzzer was sounding, ms
+    unsigned long getAudibleMillis()
+    {
+      noInterrupts();
+      unsigned long total = audible_total + (tone_audible ? millis() - audible_millis : 0);
+      interrupts();
+      return total;
+    }
+
+    // Number of times the buzzer started sounding
+    unsigned long getAudibleSpans()
+    {
+      noInterrupts();
+      unsigned long spans = audible_spans;
+      interrupts();
+      return spans;
+    }
+
     void setLedControl(bool state)
     {
       prog_led_tone_control = state;
@@ -301,8 +350,7 @@ class ToneController
 	    sub_level = 0;
       unsigned int pos;
       unsigned int melody_ctemp = StringHelper::readIntFromString(melody, 0, &pos);
-  	  melody_timer_counter = 1;
-  	  melody_timer_counter_max = 1;
+  	  melody_step_length = 1;
       if (melody_ctemp) {
         melody_tempo = 7500 / melody_ctemp;
       } else {
@@ -316,24 +364,26 @@ class ToneController
         pos++;
       }
       melody += pos;
-      DEBUG_WRITELN("Starting melody");
+      LOG_DEBUG(LOG_MELODY_START);
       tone_frequency = 1;
       melody_pos = 0;
       tone_periodic_repeats = 1;
       tone_state = true;
       tone_is_active = true;
       tone_is_melody = true;
+      tone_periodic = true;
       ToneMelodyAction();
-      StartTonePeriodTimer(melody_tempo);
     }
 
     void StartMelodyToneByIndex(byte index) {
       if (index == 0) {
         EEPROM_Helper::readStringFromEEPROM(CUSTOM_MELODY_ADDR, melody_buffer, MELODY_MAX_SIZE);
         StartMelodyTone(melody_buffer);
+#if CSTATION_FEATURE_MELODIES
       } else if (index <= melody_count) {
         strlcpy_P(melody_buffer, (char*)pgm_read_word(&(melody_list[index-1])), MELODY_MAX_SIZE);
         StartMelodyTone(melody_buffer);
+#endif
       }
     }
 
@@ -352,10 +402,9 @@ class ToneController
 
     void StopTone() 
     {
-      DEBUG_WRITELN("Stopping tone");
+      LOG_DEBUG(LOG_TONE_STOP);
       StopTonePeriodTimer();
-      noTone(TONE_PIN);
-      digitalWrite(TONE_PIN, HIGH);
+      ToneOff();
       tone_is_melody = false;
       tone_is_active = false;
       fast_signal_active = false;
@@ -370,16 +419,14 @@ class ToneController
 
     void TonePeriodTimerSignal()
     {
-      if (timer_counter && tone_periodic && !tone_muted && tone_is_active) {
+      if (tone_periodic && !tone_muted && tone_is_active) {
         if (tone_is_melody) {
           ToneMelodyAction();
         } else {
-          timer_counter--;
-          if (!timer_counter) {
-            timer_counter = timer_counter_max;
-            TonePeriodAction();
-          }
+          TonePeriodAction();
         }
+        // The end of the tone is handled by timerProcess()
+        if (tone_muted) sleep_controller->wake();
       }
     }
 
@@ -449,11 +496,38 @@ class ToneController
     }
 };
 
-ISR(timer5Event)
+#else
+
+byte melody_count = 0;
+
+// Stand-in for builds without the buzzer, the calls compile to nothing
+class ToneController
 {
-  resetTimer5();
-  ToneController::Instance()->TonePeriodTimerSignal();
-}
+  public:
+    static ToneController *_self_controller;
+
+    static ToneController* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new ToneController();
+      }
+      return _self_controller;
+    }
+
+    void timerProcess() {}
+    unsigned long idleTime() { return SLEEP_IDLE_MAX; }
+    bool isToneRunning() { return false; }
+    bool isToneAudible(unsigned long tail_ms) { return false; }
+    unsigned long getAudibleMillis() { return 0; }
+    unsigned long getAudibleSpans() { return 0; }
+    void setLedControl(bool state) {}
+    void StartMelodyToneByIndex(byte index) {}
+    void StartTone(unsigned frequency, unsigned long period) {}
+    void StopTone() {}
+    void FastToneSignal(unsigned frequency, unsigned long tone_length) {}
+};
+
+#endif
 
 ToneController *ToneController::_self_controller = NULL;
 
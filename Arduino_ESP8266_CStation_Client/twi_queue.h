@@ -0,0 +1,250 @@
+#ifndef TWI_QUEUE_H
+#define TWI_QUEUE_H
+
+#include <util/twi.h>
+
+// Interrupt driven I2C master shared by all bus devices. Drivers submit
+// jobs (write, read or write then read with a repeated start) and carry
+// on; the TWI ISR runs them one after another, high priority jobs first.
+// Job buffers belong to the submitter and must stay valid until the job
+// is no longer TWI_JOB_PENDING/TWI_JOB_RUNNING.
+
+#define TWI_FREQUENCY 100000L
+#define TWI_QUEUE_SIZE 8
+#define TWI_JOB_TIMEOUT 50
+
+#define TWI_PRIORITY_HIGH 0
+#define TWI_PRIORITY_LOW 1
+#define TWI_PRIORITIES 2
+
+#define TWI_JOB_IDLE 0
+#define TWI_JOB_PENDING 1
+#define TWI_JOB_RUNNING 2
+#define TWI_JOB_DONE 3
+#define TWI_JOB_ERROR 4
+
+struct TWIJob;
+// Called from the TWI ISR when the job is finished, keep it short
+typedef void (*TWICallback)(TWIJob* job);
+
+struct TWIJob
+{
+  byte address;
+  const byte* write_data;
+  byte write_length;
+  byte* read_data;
+  byte read_length;
+  TWICallback callback;
+  void* context;
+  volatile byte status;
+};
+
+class TWIQueue
+{
+  private:
+    TWIJob* volatile queue[TWI_PRIORITIES][TWI_QUEUE_SIZE];
+    volatile byte queue_head[TWI_PRIORITIES];
+    volatile byte queue_count[TWI_PRIORITIES];
+
+    TWIJob* volatile current;
+    volatile byte position;
+    unsigned long int current_millis;
+
+    unsigned long int jobs_count;
+    volatile unsigned long int errors_count;
+
+    TWIQueue()
+    {
+      for(byte i=0; i<TWI_PRIORITIES; i++) {
+        queue_head[i] = 0;
+        queue_count[i] = 0;
+      }
+      current = NULL;
+      position = 0;
+      current_millis = 0;
+      jobs_count = 0;
+      errors_count = 0;
+    }
+
+    // ISR context or interrupts disabled
+    void startNext(byte control)
+    {
+      current = NULL;
+      for(byte i=0; i<TWI_PRIORITIES && !current; i++) {
+        if (queue_count[i]) {
+          current = queue[i][queue_head[i]];
+          queue_head[i] = (queue_head[i] + 1) % TWI_QUEUE_SIZE;
+          queue_count[i]--;
+        }
+      }
+      if (current) {
+        // A STOP still on the wire must finish before the next START
+        if (!control) while (TWCR & _BV(TWSTO));
+        current->status = TWI_JOB_RUNNING;
+        position = 0;
+        current_millis = millis();
+        TWCR = control | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+      } else if (control) {
+        TWCR = control | _BV(TWEN) | _BV(TWINT);
+      }
+    }
+
+    // ISR context: stops the bus and goes on with the next job
+    void finish(byte status)
+    {
+      TWIJob* job = current;
+      job->status = status;
+      if (status == TWI_JOB_ERROR) errors_count++;
+      startNext(_BV(TWSTO));
+      if (job->callback) job->callback(job);
+      // Drivers pick the result up in loop()
+      sleep_controller->wake();
+    }
+
+    void ack(bool ack_next)
+    {
+      TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | (ack_next ? _BV(TWEA) : 0);
+    }
+
+  public:
+    static TWIQueue *_self_controller;
+
+    static TWIQueue* Instance() {
+      if(!_self_controller)
+      {
+          _self_controller = new TWIQueue();
+      }
+      return _self_controller;
+    }
+    static bool DeleteInstance() {
+      if(_self_controller)
+      {
+          delete _self_controller;
+          _self_controller = NULL;
+          return true;
+      }
+      return false;
+    }
+
+    void begin()
+    {
+      // Internal pull-ups on SDA/SCL like Wire
+      digitalWrite(SDA, HIGH);
+      digitalWrite(SCL, HIGH);
+      TWSR = 0;
+      TWBR = ((F_CPU / TWI_FREQUENCY) - 16) / 2;
+      TWCR = _BV(TWEN);
+    }
+
+    bool submit(TWIJob* job, byte priority)
+    {
+      bool result = false;
+      noInterrupts();
+      if (job->status != TWI_JOB_PENDING && job->status != TWI_JOB_RUNNING && queue_count[priority] < TWI_QUEUE_SIZE) {
+        job->status = TWI_JOB_PENDING;
+        queue[priority][(queue_head[priority] + queue_count[priority]) % TWI_QUEUE_SIZE] = job;
+        queue_count[priority]++;
+        jobs_count++;
+        if (!current) startNext(0);
+        result = true;
+      }
+      interrupts();
+      return result;
+    }
+
+    // Waits for the job, for initialization code only
+    bool execute(TWIJob* job, byte priority)
+    {
+      if (!submit(job, priority)) return false;
+      while (isBusy(job)) process();
+      return job->status == TWI_JOB_DONE;
+    }
+
+    bool isBusy(TWIJob* job)
+    {
+      return job->status == TWI_JOB_PENDING || job->status == TWI_JOB_RUNNING;
+    }
+
+    // Called from loop(): recovers the bus when a device holds it
+    void process()
+    {
+      noInterrupts();
+      if (current && millis() - current_millis > TWI_JOB_TIMEOUT) {
+        TWCR = 0;
+        TWCR = _BV(TWEN);
+        finish(TWI_JOB_ERROR);
+      }
+      interrupts();
+    }
+
+    // ms until process() has to check the running job for a timeout
+    unsigned long idleTime()
+    {
+      noInterrupts();
+      unsigned long idle = current ? SleepController::remaining(current_millis, TWI_JOB_TIMEOUT + 1) : SLEEP_IDLE_MAX;
+      interrupts();
+      return idle;
+    }
+
+    unsigned long getJobsCount()
+    {
+      return jobs_count;
+    }
+
+    unsigned long getErrorsCount()
+    {
+      return errors_count;
+    }
+
+    // TWI ISR
+    void interruptHandler()
+    {
+      TWIJob* job = current;
+      if (!job) {
+        TWCR = _BV(TWEN) | _BV(TWINT);
+        return;
+      }
+      switch(TW_STATUS) {
+        case TW_START:
+        case TW_REP_START:
+          if (position < job->write_length || !job->read_length) {
+            TWDR = TW_WRITE | (job->address << 1);
+          } else {
+            position = 0;
+            TWDR = TW_READ | (job->address << 1);
+          }
+          TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+          break;
+        case TW_MT_SLA_ACK:
+        case TW_MT_DATA_ACK:
+          if (position < job->write_length) {
+            TWDR = job->write_data[position++];
+            TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+          } else if (job->read_length) {
+            TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
+          } else {
+            finish(TWI_JOB_DONE);
+          }
+          break;
+        case TW_MR_SLA_ACK:
+          ack(job->read_length > 1);
+          break;
+        case TW_MR_DATA_ACK:
+          job->read_data[position++] = TWDR;
+          ack(position < job->read_length - 1);
+          break;
+        case TW_MR_DATA_NACK:
+          job->read_data[position++] = TWDR;
+          finish(TWI_JOB_DONE);
+          break;
+        default:
+          // NACK, arbitration lost or bus error
+          finish(TWI_JOB_ERROR);
+          break;
+      }
+    }
+};
+
+TWIQueue *TWIQueue::_self_controller = NULL;
+
+#endif
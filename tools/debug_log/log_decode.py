@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""
+Decoder for the CStation tokenized log (debug_log.h), the binary records the
+station writes on its Serial port when built with CSTATION_DEBUG or
+CSTATION_LOG_LEVEL. Message formats and ids come from LOG_MESSAGES in
+debug_log.h, in the order they are listed there.
+
+  log_decode.py --port /dev/ttyACM0 [--baud 115200]   (needs pyserial)
+  log_decode.py capture.bin
+  log_decode.py < capture.bin
+  log_decode.py --self-test
+"""
+
+import argparse
+import os
+import re
+import sys
+
+RECORD_SYNC = 0xA5
+LEVELS = {1: 'ERROR', 2: 'WARN', 3: 'INFO', 4: 'DEBUG'}
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEBUG_LOG_H = os.path.join(HERE, '..', '..', 'Arduino_ESP8266_CStation_Client', 'debug_log.h')
+
+CONVERSION = re.compile(r'%[-+ 0#]*\d*l?[dux]')
+
+
+class RecordError(Exception):
+    pass
+
+
+def messages_from_header(path=DEBUG_LOG_H):
+    """[(id name, format)] from LOG_MESSAGES in debug_log.h, index = message id."""
+    with open(path, encoding='utf-8') as f:
+        return re.findall(r'X\((LOG_\w+),\s*"((?:[^"\\]|\\.)*)"\)', f.read())
+
+
+def put_varint(out, value):
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def get_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise RecordError('truncated varint')
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def encode(message_id, level, millis, args=()):
+    """One record as DebugLog::pack() writes it."""
+    out = bytearray([RECORD_SYNC, message_id, 0])
+    out += (millis & 0xFFFFFFFF).to_bytes(4, 'little')
+    for arg in args:
+        put_varint(out, ((arg << 1) ^ (arg >> 31)) & 0xFFFFFFFF)
+    out[2] = (level << 5) | (len(out) - 3)
+    return bytes(out)
+
+
+def format_message(messages, message_id, payload):
+    """(millis, text) of one record from the bytes after its length byte."""
+    if message_id >= len(messages):
+        raise RecordError('unknown message id %d' % message_id)
+    name, fmt = messages[message_id]
+    if len(payload) < 4:
+        raise RecordError('short record')
+    millis = int.from_bytes(payload[:4], 'little')
+    pos = 4
+    args = []
+    for conversion in CONVERSION.findall(fmt):
+        raw, pos = get_varint(payload, pos)
+        value = (raw >> 1) ^ -(raw & 1)
+        if conversion[-1] in 'ux':
+            value &= 0xFFFFFFFF
+        args.append(value)
+    if pos != len(payload):
+        raise RecordError('%s: %d bytes left over' % (name, len(payload) - pos))
+    return millis, CONVERSION.sub(lambda m: m.group(0).replace('l', ''), fmt) % tuple(args)
+
+
+class Decoder:
+    """Splits a byte stream into records, skipping garbage up to the next sync byte."""
+
+    def __init__(self, messages):
+        self.messages = messages
+        self.data = bytearray()
+        self.skipped = 0
+
+    def feed(self, chunk):
+        self.data += chunk
+        while True:
+            start = self.data.find(RECORD_SYNC)
+            if start < 0:
+                self.skipped += len(self.data)
+                self.data.clear()
+                return
+            if start:
+                self.skipped += start
+                del self.data[:start]
+            if len(self.data) < 3:
+                return
+            length = self.data[2] & 0x1F
+            if len(self.data) < 3 + length:
+                return
+            try:
+                millis, text = format_message(self.messages, self.data[1], bytes(self.data[3:3 + length]))
+            except RecordError as e:
+                # Not a record after all, look for the next sync byte
+                self.skipped += 1
+                del self.data[:1]
+                yield None, 'ERROR', 'undecodable record: %s' % e
+                continue
+            level = LEVELS.get(self.data[2] >> 5, '?')
+            del self.data[:3 + length]
+            yield millis, level, text
+
+
+def print_records(decoder, chunks):
+    for chunk in chunks:
+        for millis, level, text in decoder.feed(chunk):
+            stamp = '%10.3f' % (millis / 1000.0) if millis is not None else ' ' * 10
+            print('%s %-5s %s' % (stamp, level, text))
+            sys.stdout.flush()
+
+
+def read_chunks(stream):
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        yield chunk
+
+
+def serial_chunks(port, baud):
+    import serial
+    with serial.Serial(port, baud, timeout=0.2) as link:
+        while True:
+            chunk = link.read(256)
+            if chunk:
+                yield chunk
+
+
+def self_test(messages):
+    ids = {name: i for i, (name, _) in enumerate(messages)}
+    stream = b'noise' + encode(ids['LOG_STARTING'], 3, 12) \
+        + encode(ids['LOG_SEND_MESSAGE'], 4, 70000, (0, 123)) \
+        + encode(ids['LOG_FAN_NEXT'], 4, 0xFFFFFFFF, (-5,)) \
+        + encode(ids['LOG_TONE_START_REPEAT'], 4, 1, (500, 100000, 3))
+    decoder = Decoder(messages)
+    # Byte by byte, as a serial port may hand it over
+    records = [r for i in range(len(stream)) for r in decoder.feed(stream[i:i + 1])]
+    expected = [
+        (12, 'INFO', 'Starting...'),
+        (70000, 'DEBUG', 'Sending to 0 message of 123 bytes'),
+        (0xFFFFFFFF, 'DEBUG', 'nextFanState: -5'),
+        (1, 'DEBUG', 'Starting tone. F=500 P=100000 R=3'),
+    ]
+    if records != expected or decoder.skipped != 5:
+        raise RecordError('self-test mismatch: %r' % records)
+    for millis, level, text in records:
+        print('%10.3f %-5s %s' % (millis / 1000.0, level, text))
+    print('self-test passed')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('capture', nargs='?', help='binary capture, stdin when missing')
+    parser.add_argument('--port', help='serial port to read from')
+    parser.add_argument('--baud', type=int, default=115200, help='LOG_BAUD_RATE of the firmware')
+    parser.add_argument('--header', default=DEBUG_LOG_H, help='debug_log.h to take the messages from')
+    parser.add_argument('--self-test', action='store_true', help='decode sample records')
+    args = parser.parse_args()
+
+    messages = messages_from_header(args.header)
+    if args.self_test:
+        self_test(messages)
+        return 0
+    decoder = Decoder(messages)
+    if args.port:
+        print_records(decoder, serial_chunks(args.port, args.baud))
+    elif args.capture:
+        with open(args.capture, 'rb') as f:
+            print_records(decoder, read_chunks(f))
+    else:
+        print_records(decoder, read_chunks(sys.stdin.buffer))
+    if decoder.skipped:
+        print('%d bytes skipped' % decoder.skipped, file=sys.stderr)
+    return 0
+
+
+if __name__ == '__main__':
+    try:
+        sys.exit(main())
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Builds the firmware once per feature set (feature_set.h) and reports the
+# flash and static RAM each one takes.
+# Needs arduino-cli (arduino:avr core + sketch libraries) and avr-size.
+#   ./feature_size.sh                     FULL, HEADLESS and MINIMAL
+#   ./feature_size.sh "-DCSTATION_FEATURE_MELODIES=0" ...   any other flags
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SKETCH="$HERE/../../Arduino_ESP8266_CStation_Client"
+OUT="$HERE/build"
+FLASH_SIZE=253952
+RAM_SIZE=8192
+
+if [ $# -eq 0 ]; then
+  set -- "-DCSTATION_FEATURES=CSTATION_FEATURES_FULL" \
+         "-DCSTATION_FEATURES=CSTATION_FEATURES_HEADLESS" \
+         "-DCSTATION_FEATURES=CSTATION_FEATURES_MINIMAL"
+fi
+
+printf '%-60s %8s %6s %8s %6s\n' "flags" "flash" "%" "ram" "%"
+for flags in "$@"; do
+  name=$(echo "$flags" | tr -c 'A-Za-z0-9_\n' '_')
+  mkdir -p "$OUT/$name"
+  arduino-cli compile --fqbn arduino:avr:mega:cpu=atmega2560 \
+    --build-property "compiler.cpp.extra_flags=$flags" \
+    --output-dir "$OUT/$name" "$SKETCH" > "$OUT/$name/compile.log"
+  # Berkeley format: text data bss; flash holds text and the data initializers
+  avr-size "$OUT/$name/Arduino_ESP8266_CStation_Client.ino.elf" | awk \
+    -v flags="$flags" -v flash_size=$FLASH_SIZE -v ram_size=$RAM_SIZE 'NR == 2 {
+      flash = $1 + $2; ram = $2 + $3
+      printf "%-60s %8d %5.1f%% %8d %5.1f%%\n", flags, flash, 100 * flash / flash_size, ram, 100 * ram / ram_size
+    }'
+done
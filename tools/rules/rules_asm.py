@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""
+Assembler for the CStation rule engine (rule_engine.h). Compiles rules, one
+per line, into the bytecode the station keeps in EEPROM and prints the
+SET_RULES commands that upload and enable it.
+
+  on <trigger>[,<trigger>] [if <condition> [and <condition>]] [hold <s>] do <action>[, <action>]
+
+  triggers    presence noise outer button magnetic sensors minute
+  conditions  <operand> ==|!=|<|<=|>|>= <value>, <operand> in <first>..<last>
+  operands    sensor codes (T, H, L, R, NL, ...), state.<name> (state.fan,
+              state.tone, ...), time (minutes since midnight), weekday, watch
+  values      numbers in the sensor units, HH:MM, yes/no, on/off
+  actions     tone <Hz>, melody <n>, stop, led|fan|light on|off,
+              page <n>|auto, lcd "<text>"
+
+  rules_asm.py rules.txt [--chunk 80] [--without MAGNETOMETER]
+  rules_asm.py --self-test
+"""
+
+import argparse
+import os
+import re
+import shlex
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, '..', '..', 'Arduino_ESP8266_CStation_Client')
+DESCRIPTORS_H = os.path.join(SOURCE, 'descriptors.h')
+MAIN_INO = os.path.join(SOURCE, 'Arduino_ESP8266_CStation_Client.ino')
+
+MAX_SIZE = 255
+MAX_RULES = 16
+TEXT_MAX = 32
+# Program bytes per SET_RULES command, the line fits LINK_BUFFER_SIZE
+DEFAULT_CHUNK = 80
+
+TRIGGERS = {'presence': 0x01, 'noise': 0x02, 'outer': 0x04, 'button': 0x08, 'magnetic': 0x10,
+            'sensors': 0x20, 'minute': 0x40}
+OPERAND_STATE = 0x40
+SPECIAL_OPERANDS = {'time': 0x80, 'weekday': 0x81, 'watch': 0x82}
+OPS = {'==': 0, '!=': 1, '<': 2, '<=': 3, '>': 4, '>=': 5, 'in': 6}
+ACTIONS = {'tone': 1, 'melody': 2, 'stop': 3, 'led': 4, 'fan': 5, 'light': 6, 'page': 7, 'lcd': 8}
+LCD_UNFIX = 0xFF
+WORDS = {'yes': 1, 'no': 0, 'on': 1, 'off': 0}
+
+
+class RuleError(Exception):
+    pass
+
+
+def tokens(line):
+    """Words of a rule line, commas as tokens of their own, quotes and # comments as in a shell."""
+    lexer = shlex.shlex(line, posix=True, punctuation_chars=',')
+    lexer.whitespace_split = True
+    lexer.commenters = '#'
+    return list(lexer)
+
+
+def split_list(words):
+    """[[words], ...] separated by commas."""
+    items = [[]]
+    for word in words:
+        if word == ',':
+            items.append([])
+        else:
+            items[-1].append(word)
+    if not all(items):
+        raise RuleError('empty list item')
+    return items
+
+
+def sensors_from_header(path=DESCRIPTORS_H, without=()):
+    """{code: (index, decimals)} from SENSORS_TABLE in descriptors.h, less the rows of the features in without."""
+    with open(path, encoding='utf-8') as f:
+        rows = re.findall(r'(?:FEATURE_ROW\(CSTATION_FEATURE_(\w+),\s*)?X\((SENSOR_\w+),\s*"(\w+)",\s*(\d+),', f.read())
+    rows = [(code, decimals) for feature, _, code, decimals in rows if feature not in without]
+    return {code: (i, int(decimals)) for i, (code, decimals) in enumerate(rows)}
+
+
+def states_from_sketch(path=MAIN_INO):
+    """{name: code} from the StateQueryCode enum, STATE_FAN as 'fan'."""
+    with open(path, encoding='utf-8') as f:
+        body = re.search(r'enum StateQueryCode\s*\{([^}]*)\}', f.read()).group(1)
+    names = re.findall(r'STATE_(\w+)', body)
+    return {name.lower(): i for i, name in enumerate(names) if name not in ('NONE', 'CODES_COUNT')}
+
+
+class Assembler:
+    def __init__(self, sensors, states):
+        self.sensors = sensors
+        self.states = states
+
+    def operand(self, name):
+        """(operand byte, decimals its values are scaled by)"""
+        if name in SPECIAL_OPERANDS:
+            return SPECIAL_OPERANDS[name], 0
+        if name.startswith('state.') and name[6:] in self.states:
+            return OPERAND_STATE + self.states[name[6:]], 0
+        if name in self.sensors:
+            index, decimals = self.sensors[name]
+            return index, decimals
+        raise RuleError('unknown operand %r' % name)
+
+    @staticmethod
+    def value(text, decimals):
+        if text in WORDS:
+            return WORDS[text]
+        match = re.match(r'^(\d{1,2}):(\d{2})$', text)
+        if match:
+            return int(match.group(1)) * 60 + int(match.group(2))
+        try:
+            return int(round(float(text) * 10 ** decimals))
+        except ValueError:
+            raise RuleError('bad value %r' % text)
+
+    def condition(self, words):
+        if len(words) != 3 or words[1] not in OPS:
+            raise RuleError('bad condition %r' % ' '.join(words))
+        operand, decimals = self.operand(words[0])
+        if words[1] == 'in':
+            bounds = words[2].split('..')
+            if len(bounds) != 2:
+                raise RuleError('bad range %r' % words[2])
+            first, last = (self.value(b, decimals) & 0xFFFF for b in bounds)
+            reference = first | (last << 16)
+        else:
+            reference = self.value(words[2], decimals) & 0xFFFFFFFF
+        return bytes([operand, OPS[words[1]]]) + reference.to_bytes(4, 'little')
+
+    @staticmethod
+    def action(words):
+        name = words[0]
+        if name not in ACTIONS:
+            raise RuleError('unknown action %r' % name)
+        code = ACTIONS[name]
+        if name == 'lcd':
+            text = ' '.join(words[1:]).encode('ascii')
+            if not text or len(text) > TEXT_MAX:
+                raise RuleError('lcd text of 1 to %d chars' % TEXT_MAX)
+            return bytes([code, len(text)]) + text
+        if name == 'stop':
+            argument = 0
+        elif len(words) != 2:
+            raise RuleError('%s takes one argument' % name)
+        elif name == 'page' and words[1] == 'auto':
+            argument = LCD_UNFIX
+        elif words[1] in WORDS:
+            argument = WORDS[words[1]]
+        else:
+            argument = int(words[1])
+        return bytes([code]) + argument.to_bytes(2, 'little')
+
+    def rule(self, words):
+        if len(words) < 4 or words[0] != 'on' or 'do' not in words:
+            raise RuleError('expected "on <triggers> ... do <actions>"')
+        do = words.index('do')
+        head, actions = words[1:do], words[do + 1:]
+        triggers = 0
+        count = 1
+        while count < len(head) and head[count] == ',':
+            count += 2
+        for name, in split_list(head[:count]):
+            if name not in TRIGGERS:
+                raise RuleError('unknown trigger %r' % name)
+            triggers |= TRIGGERS[name]
+        rest = head[count:]
+        holdoff = 0
+        if len(rest) >= 2 and rest[-2] == 'hold':
+            holdoff = int(rest[-1])
+            rest = rest[:-2]
+            if not 0 <= holdoff <= 255:
+                raise RuleError('hold of 0 to 255 s')
+        conditions = []
+        if rest:
+            if rest[0] != 'if':
+                raise RuleError('expected "if" after the triggers')
+            words = rest[1:]
+            while words:
+                conditions.append(self.condition(words[:3]))
+                words = words[3:]
+                if words and words.pop(0) != 'and':
+                    raise RuleError('conditions are joined with "and"')
+        body = b''.join(conditions)
+        for action in split_list(actions):
+            body += self.action(action)
+        size = 4 + len(body)
+        if size > MAX_SIZE:
+            raise RuleError('rule too long')
+        return bytes([size, triggers, len(conditions), holdoff]) + body
+
+    def program(self, lines):
+        program = b''
+        count = 0
+        for number, line in enumerate(lines, 1):
+            try:
+                words = tokens(line)
+                if not words:
+                    continue
+                program += self.rule(words)
+            except (RuleError, ValueError) as e:
+                raise RuleError('line %d: %s' % (number, e))
+            count += 1
+        if count > MAX_RULES or len(program) > MAX_SIZE:
+            raise RuleError('%d rules, %d bytes: at most %d rules in %d bytes' % (count, len(program), MAX_RULES, MAX_SIZE))
+        return program
+
+
+def commands(program, chunk):
+    """SET_RULES lines uploading and enabling the program."""
+    lines = ['SET_RULES=+' + program[i:i + chunk].hex().upper() for i in range(0, len(program), chunk)]
+    return lines + ['SET_RULES=1']
+
+
+def self_test(assembler):
+    program = assembler.program([
+        '# watch mode alarm',
+        'on noise, presence if watch == yes and time in 22:00..07:00 hold 60 do melody 3, lcd "Noise in watch mode"  # alarm',
+        'on sensors if T > 26.5 do fan on',
+        'on minute if time == 7:30 do tone 800, page auto',
+    ])
+    expected = (
+        '28 03 02 3C'
+        ' 82 00 01000000'
+        ' 80 06 2805A401'
+        ' 02 0300'
+        ' 08 13' + ''.join('%02X' % b for b in b'Noise in watch mode') +
+        ' 0D 20 01 00 02 04 5A0A0000 05 0100'
+        ' 10 40 01 00 80 00 C2010000 01 2003 07 FF00'
+    ).replace(' ', '')
+    if program.hex().upper() != expected:
+        raise RuleError('self-test mismatch: %s' % program.hex().upper())
+    if Assembler(sensors_from_header(without=('MAGNETOMETER',)), {}).operand('NL') != (10, 0):
+        raise RuleError('self-test: NL without the magnetometer rows')
+    for bad in ('on rain do stop', 'on noise if X > 1 do stop', 'on noise do lcd "%s"' % ('x' * 33)):
+        try:
+            assembler.program([bad])
+        except RuleError:
+            continue
+        raise RuleError('self-test accepted %r' % bad)
+    for line in commands(program, 32):
+        print(line)
+    print('self-test passed')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('rules', nargs='?', help='rules text, stdin when missing')
+    parser.add_argument('--chunk', type=int, default=DEFAULT_CHUNK, help='program bytes per SET_RULES command')
+    parser.add_argument('--without', action='append', default=[], metavar='FEATURE',
+                        help='CSTATION_FEATURE_<FEATURE> is 0 in the station build, its sensors are left out')
+    parser.add_argument('--self-test', action='store_true', help='assemble sample rules')
+    args = parser.parse_args()
+
+    assembler = Assembler(sensors_from_header(without=[f.upper() for f in args.without]), states_from_sketch())
+    if args.self_test:
+        self_test(assembler)
+        return 0
+    if args.rules:
+        with open(args.rules, encoding='utf-8') as f:
+            lines = f.read().splitlines()
+    else:
+        lines = sys.stdin.read().splitlines()
+    try:
+        program = assembler.program(lines)
+    except RuleError as e:
+        print(e, file=sys.stderr)
+        return 1
+    print('%d bytes' % len(program), file=sys.stderr)
+    for line in commands(program, args.chunk):
+        print(line)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
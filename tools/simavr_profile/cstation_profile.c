@@ -0,0 +1,562 @@
+/*
+ * Cycle-accurate profiling harness for the CStation client firmware.
+ *
+ * Runs the ATmega2560 ELF (built with -DCSTATION_PROFILE) under simavr,
+ * emulates the ESP8266 AT firmware on UART2, plays scripted pin stimuli
+ * and reports per-function cycle counts taken from the GPIOR0 markers
+ * written by profiler.h, the worst-case latency of the soft timer tick
+ * ISR, the share of time spent in idle sleep and the size and send time
+ * of text and binary telemetry messages and of DS_STATE messages.
+ *
+ * Build: cc -O2 -o cstation_profile cstation_profile.c -lsimavr -lelf
+ * Usage: cstation_profile [-t seconds] [-s stimuli.txt] [-l esp_latency_us] firmware.elf
+ *
+ * Stimuli file, one event per line, '#' starts a comment:
+ *   <ms> pin <arduino pin> <0|1>      drive an input pin
+ *   <ms> ipd <link id> <text>         deliver "+IPD,<link>,<len>:<text>\r\n" from the ESP
+ *                                     ("\n" in <text> splits it into several commands)
+ *                                     (raw "<text>\r\n" while in passthrough mode)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_ioport.h>
+
+#define PROFILE_HOST
+#include "../../Arduino_ESP8266_CStation_Client/profiler.h"
+
+#define MCU_NAME "atmega2560"
+#define MCU_FREQUENCY 16000000UL
+#define GPIOR0_DATA_ADDR 0x3E
+
+#define TIMER5_COMPA_VECTOR 47
+
+#define MAX_STACK_DEPTH 32
+#define MAX_STIMULI 1024
+#define ESP_LINE_MAX 640
+#define ESP_TX_QUEUE 8192
+
+#define PROFILE_POINT_NAME(id, name) name,
+static const char *point_names[PROF_POINTS_COUNT] = { "none", PROFILE_POINTS(PROFILE_POINT_NAME) };
+#undef PROFILE_POINT_NAME
+
+typedef struct {
+	uint64_t calls;
+	uint64_t total;
+	uint64_t self;
+	uint64_t max;
+	uint64_t min;
+} point_stats_t;
+
+typedef struct {
+	uint8_t point;
+	uint64_t start;
+	uint64_t children;
+	int binary;              /* sendTelemetry() frame that went out through sendFrame() */
+} stack_frame_t;
+
+/* telemetry messages by format: DS_V text lines and binary frames */
+#define TELEMETRY_TEXT 0
+#define TELEMETRY_BINARY 1
+#define TELEMETRY_FRAME_MAGIC 0xC5
+
+typedef struct {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t sends;
+	uint64_t send_cycles;
+	uint64_t send_max;
+} telemetry_stats_t;
+
+typedef struct {
+	uint8_t vector;
+	uint8_t point;
+	const char *name;
+	int pending;
+	uint64_t pending_cycle;
+	uint64_t count;
+	uint64_t worst_entry;    /* pending -> vector running */
+	uint64_t worst_body;     /* pending -> first marker in the handler */
+} isr_watch_t;
+
+typedef struct {
+	uint64_t at_cycle;
+	char kind;
+	int pin;
+	int value;
+	char text[256];
+} stimulus_t;
+
+static avr_t *avr;
+static point_stats_t stats[PROF_POINTS_COUNT];
+static stack_frame_t stack[MAX_STACK_DEPTH];
+static int stack_depth;
+static uint64_t unbalanced_markers;
+static telemetry_stats_t telemetry[2];
+static uint64_t sleep_cycles;
+static uint64_t sleep_wakes;
+static uint64_t state_messages;
+static uint64_t state_bytes;
+static const char *telemetry_names[2] = { "text", "binary" };
+
+static isr_watch_t isr_watch[] = {
+	{ TIMER5_COMPA_VECTOR, PROF_TIMER5_ISR, "timer5Event" },
+};
+#define ISR_WATCH_COUNT (sizeof(isr_watch) / sizeof(isr_watch[0]))
+
+static stimulus_t stimuli[MAX_STIMULI];
+static int stimuli_count;
+static int stimuli_next;
+
+static struct {
+	char line[ESP_LINE_MAX];
+	int line_len;
+	int payload_remaining;
+	int payload_len;
+	int passthrough;
+	int plus_count;
+	int buffered;
+	int link;
+	int segment;
+	char payload_head[9];
+	uint8_t tx[ESP_TX_QUEUE];
+	int tx_head, tx_tail;
+	uint64_t tx_ready_cycle;
+	uint64_t latency_cycles;
+	int xon;
+	avr_irq_t *uart_in;
+	uint64_t sends;
+	uint64_t send_bytes;
+} esp;
+
+static uint64_t ms_to_cycles(uint64_t ms)
+{
+	return ms * (MCU_FREQUENCY / 1000);
+}
+
+/* ---- profiling markers ---- */
+
+static void on_marker(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	uint64_t now = avr->cycle;
+	uint8_t point = v & ~PROFILE_EXIT_FLAG;
+
+	avr->data[addr] = v;
+	if (point == PROF_NONE || point >= PROF_POINTS_COUNT)
+		return;
+
+	if (!(v & PROFILE_EXIT_FLAG)) {
+		for (unsigned i = 0; i < ISR_WATCH_COUNT; i++) {
+			isr_watch_t *w = &isr_watch[i];
+			if (w->point == point && w->pending_cycle) {
+				uint64_t latency = now - w->pending_cycle;
+				if (latency > w->worst_body)
+					w->worst_body = latency;
+				w->pending_cycle = 0;
+				w->count++;
+			}
+		}
+		if (stack_depth < MAX_STACK_DEPTH) {
+			stack[stack_depth].point = point;
+			stack[stack_depth].start = now;
+			stack[stack_depth].children = 0;
+			stack[stack_depth].binary = 0;
+		}
+		stack_depth++;
+		return;
+	}
+
+	if (!stack_depth || stack_depth > MAX_STACK_DEPTH || stack[stack_depth - 1].point != point) {
+		unbalanced_markers++;
+		if (stack_depth)
+			stack_depth--;
+		return;
+	}
+
+	stack_frame_t *frame = &stack[--stack_depth];
+	uint64_t duration = now - frame->start;
+	point_stats_t *s = &stats[point];
+	s->calls++;
+	s->total += duration;
+	s->self += duration - frame->children;
+	if (duration > s->max)
+		s->max = duration;
+	if (!s->min || duration < s->min)
+		s->min = duration;
+	if (stack_depth && stack_depth <= MAX_STACK_DEPTH) {
+		stack[stack_depth - 1].children += duration;
+		if (point == PROF_SEND_FRAME && stack[stack_depth - 1].point == PROF_SEND_TELEMETRY)
+			stack[stack_depth - 1].binary = 1;
+	}
+	if (point == PROF_SEND_TELEMETRY) {
+		telemetry_stats_t *t = &telemetry[frame->binary ? TELEMETRY_BINARY : TELEMETRY_TEXT];
+		t->sends++;
+		t->send_cycles += duration;
+		if (duration > t->send_max)
+			t->send_max = duration;
+	}
+}
+
+/* ---- ISR latency ---- */
+
+static void on_vector_pending(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	isr_watch_t *w = (isr_watch_t *)param;
+	if (value && !w->pending) {
+		w->pending_cycle = avr->cycle;
+	}
+	w->pending = value;
+}
+
+static void on_vector_running(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	isr_watch_t *w = (isr_watch_t *)param;
+	if (value && w->pending_cycle) {
+		uint64_t latency = avr->cycle - w->pending_cycle;
+		if (latency > w->worst_entry)
+			w->worst_entry = latency;
+	}
+}
+
+/* ---- ESP8266 emulation on UART2 ---- */
+
+static void esp_queue(const char *s, int len)
+{
+	if (len < 0)
+		len = strlen(s);
+	if (esp.tx_head == esp.tx_tail)
+		esp.tx_ready_cycle = avr->cycle + esp.latency_cycles;
+	for (int i = 0; i < len; i++) {
+		int next = (esp.tx_head + 1) % ESP_TX_QUEUE;
+		if (next == esp.tx_tail)
+			break;
+		esp.tx[esp.tx_head] = s[i];
+		esp.tx_head = next;
+	}
+}
+
+static void esp_command(char *line)
+{
+	char buf[96];
+	int link, len;
+
+	if (!strcmp(line, "AT+CIPSEND")) {
+		esp.passthrough = 1;
+		esp.plus_count = 0;
+		esp_queue("OK\r\n\r\n>", -1);
+	} else if (sscanf(line, "AT+CIPSENDBUF=%d,%d", &link, &len) == 2) {
+		esp.payload_remaining = esp.payload_len = len;
+		esp.buffered = 1;
+		esp.link = link;
+		esp.segment++;
+		snprintf(buf, sizeof(buf), "%d,%d\r\n\r\nOK\r\n>", esp.segment, esp.segment - 1);
+		esp_queue(buf, -1);
+	} else if (sscanf(line, "AT+CIPSEND=%d,%d", &link, &len) == 2) {
+		esp.payload_remaining = esp.payload_len = len;
+		esp.buffered = 0;
+		esp_queue("OK\r\n> ", -1);
+	} else if (!strncmp(line, "AT+RST", 6)) {
+		esp_queue("OK\r\n\r\nready\r\n", -1);
+	} else if (!strncmp(line, "AT+CIFSR", 8)) {
+		esp_queue("+CIFSR:STAIP,\"192.168.4.2\"\r\n\r\nOK\r\n", -1);
+	} else if (!strncmp(line, "AT+CIPSTATUS", 12)) {
+		esp_queue("STATUS:3\r\n\r\nOK\r\n", -1);
+	} else if (sscanf(line, "AT+CIPSTART=%d", &link) == 1) {
+		snprintf(buf, sizeof(buf), "%d,CONNECT\r\n\r\nOK\r\n", link);
+		esp_queue(buf, -1);
+	} else if (!strncmp(line, "AT", 2)) {
+		esp_queue("OK\r\n", -1);
+	}
+}
+
+static void on_uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	char c = (char)value;
+
+	if (esp.passthrough) {
+		esp.send_bytes++;
+		esp.plus_count = (c == '+') ? esp.plus_count + 1 : 0;
+		if (c == '\n')
+			esp.sends++;
+		if (esp.plus_count == 3) {
+			esp.passthrough = 0;
+			esp.line_len = 0;
+		}
+		return;
+	}
+	if (esp.payload_remaining) {
+		int pos = esp.payload_len - esp.payload_remaining;
+		if (pos < (int)sizeof(esp.payload_head))
+			esp.payload_head[pos] = c;
+		if (!--esp.payload_remaining) {
+			char buf[64];
+			esp.sends++;
+			esp.send_bytes += esp.payload_len;
+			if ((uint8_t)esp.payload_head[0] == TELEMETRY_FRAME_MAGIC) {
+				telemetry[TELEMETRY_BINARY].messages++;
+				telemetry[TELEMETRY_BINARY].bytes += esp.payload_len;
+			} else if (esp.payload_len >= 5 && !memcmp(esp.payload_head, "DS_V=", 5)) {
+				telemetry[TELEMETRY_TEXT].messages++;
+				telemetry[TELEMETRY_TEXT].bytes += esp.payload_len;
+			} else if (esp.payload_len >= 9 && !memcmp(esp.payload_head, "DS_STATE=", 9)) {
+				state_messages++;
+				state_bytes += esp.payload_len;
+			}
+			if (esp.buffered)
+				snprintf(buf, sizeof(buf), "\r\nRecv %d bytes\r\n%d,%d,SEND OK\r\n", esp.payload_len, esp.link, esp.segment);
+			else
+				snprintf(buf, sizeof(buf), "\r\nRecv %d bytes\r\n\r\nSEND OK\r\n", esp.payload_len);
+			esp_queue(buf, -1);
+		}
+		return;
+	}
+	if (c == '\n') {
+		esp.line[esp.line_len] = 0;
+		if (esp.line_len && esp.line[esp.line_len - 1] == '\r')
+			esp.line[esp.line_len - 1] = 0;
+		esp_command(esp.line);
+		esp.line_len = 0;
+	} else if (esp.line_len < ESP_LINE_MAX - 1) {
+		esp.line[esp.line_len++] = c;
+	}
+}
+
+static void on_uart_xon(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	esp.xon = 1;
+}
+
+static void on_uart_xoff(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	esp.xon = 0;
+}
+
+static void esp_pump(void)
+{
+	while (esp.xon && esp.tx_head != esp.tx_tail && avr->cycle >= esp.tx_ready_cycle) {
+		avr_raise_irq(esp.uart_in, esp.tx[esp.tx_tail]);
+		esp.tx_tail = (esp.tx_tail + 1) % ESP_TX_QUEUE;
+	}
+}
+
+static void esp_attach(void)
+{
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('2'), &flags);
+	flags &= ~(AVR_UART_FLAG_STDIO | AVR_UART_FLAG_POLL_SLEEP);
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('2'), &flags);
+
+	esp.uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('2'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('2'), UART_IRQ_OUTPUT), on_uart_output, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('2'), UART_IRQ_OUT_XON), on_uart_xon, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('2'), UART_IRQ_OUT_XOFF), on_uart_xoff, NULL);
+	esp.xon = 1;
+}
+
+/* ---- pin stimuli ---- */
+
+static int arduino_pin_to_port(int pin, char *port, int *bit)
+{
+	static const struct { int pin; char port; int bit; } map[] = {
+		{ 2, 'E', 4 },   /* CONTROL_BTN_PIN */
+		{ 3, 'E', 5 },   /* SENSOR_OUT_PIN */
+		{ 5, 'E', 3 },
+		{ 18, 'D', 3 },  /* HC_PIN */
+		{ 19, 'D', 2 },  /* NS_PIN */
+		{ 48, 'L', 1 },  /* RESET_BTN_PIN */
+		{ 49, 'L', 0 },
+		{ 50, 'B', 3 },  /* CONFIG_BTN_PIN */
+		{ 52, 'B', 1 },  /* SIGNAL_BTN_PIN */
+		{ 62, 'K', 0 },  /* DHTPIN (A8) */
+	};
+	for (unsigned i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		if (map[i].pin == pin) {
+			*port = map[i].port;
+			*bit = map[i].bit;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int load_stimuli(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[320];
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) && stimuli_count < MAX_STIMULI) {
+		stimulus_t *s = &stimuli[stimuli_count];
+		unsigned long ms;
+		char kind[8];
+		int consumed = 0;
+
+		if (line[0] == '#' || sscanf(line, "%lu %7s %n", &ms, kind, &consumed) < 2)
+			continue;
+		s->at_cycle = ms_to_cycles(ms);
+		if (!strcmp(kind, "pin") && sscanf(line + consumed, "%d %d", &s->pin, &s->value) == 2) {
+			s->kind = 'p';
+		} else if (!strcmp(kind, "ipd") && sscanf(line + consumed, "%d %255[^\r\n]", &s->pin, s->text) == 2) {
+			/* "\n" separates the commands of one burst */
+			char *r = s->text, *w = s->text;
+			for (; *r; r++, w++) {
+				if (r[0] == '\\' && r[1] == 'n') {
+					*w = '\n';
+					r++;
+				} else {
+					*w = *r;
+				}
+			}
+			*w = 0;
+			s->kind = 'i';
+		} else {
+			fprintf(stderr, "%s: bad stimulus: %s", path, line);
+			continue;
+		}
+		stimuli_count++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void apply_stimuli(void)
+{
+	while (stimuli_next < stimuli_count && avr->cycle >= stimuli[stimuli_next].at_cycle) {
+		stimulus_t *s = &stimuli[stimuli_next++];
+		if (s->kind == 'p') {
+			char port;
+			int bit;
+			if (arduino_pin_to_port(s->pin, &port, &bit))
+				avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), bit), s->value);
+			else
+				fprintf(stderr, "pin %d is not mapped\n", s->pin);
+		} else {
+			char header[32];
+			int len = strlen(s->text) + 2;
+			snprintf(header, sizeof(header), "+IPD,%d,%d:", s->pin, len);
+			if (!esp.passthrough)
+				esp_queue(header, -1);
+			esp_queue(s->text, -1);
+			esp_queue("\r\n", 2);
+		}
+	}
+}
+
+/* ---- report ---- */
+
+static void report(void)
+{
+	double cycles_per_us = MCU_FREQUENCY / 1000000.0;
+
+	printf("simulated %.3f s (%llu cycles)\n", avr->cycle / (double)MCU_FREQUENCY, (unsigned long long)avr->cycle);
+	printf("\n%-40s %10s %14s %14s %10s %10s %10s\n", "function", "calls", "total", "self", "avg", "min", "max");
+	for (int i = 1; i < PROF_POINTS_COUNT; i++) {
+		point_stats_t *s = &stats[i];
+		if (!s->calls)
+			continue;
+		printf("%-40s %10llu %14llu %14llu %10llu %10llu %10llu\n", point_names[i],
+			(unsigned long long)s->calls, (unsigned long long)s->total, (unsigned long long)s->self,
+			(unsigned long long)(s->total / s->calls), (unsigned long long)s->min, (unsigned long long)s->max);
+	}
+	printf("\n%-40s %10s %14s %14s\n", "isr", "count", "worst entry", "worst body");
+	for (unsigned i = 0; i < ISR_WATCH_COUNT; i++) {
+		isr_watch_t *w = &isr_watch[i];
+		printf("%-40s %10llu %10llu cyc %10llu cyc (%.2f us)\n", w->name, (unsigned long long)w->count,
+			(unsigned long long)w->worst_entry, (unsigned long long)w->worst_body, w->worst_body / cycles_per_us);
+	}
+	printf("\ncpu: %.1f%% of cycles in idle sleep, %llu wake-ups\n", avr->cycle ? 100.0 * sleep_cycles / avr->cycle : 0.0,
+		(unsigned long long)sleep_wakes);
+	printf("\nesp: %llu sends, %llu payload bytes\n", (unsigned long long)esp.sends, (unsigned long long)esp.send_bytes);
+	printf("\n%-40s %10s %14s %14s %14s\n", "telemetry", "messages", "bytes/msg", "avg send", "max send");
+	for (int i = 0; i < 2; i++) {
+		telemetry_stats_t *t = &telemetry[i];
+		if (!t->messages && !t->sends)
+			continue;
+		printf("%-40s %10llu %14.1f %11.2f ms %11.2f ms\n", telemetry_names[i], (unsigned long long)t->messages,
+			t->messages ? t->bytes / (double)t->messages : 0.0,
+			t->sends ? t->send_cycles / (double)t->sends / (cycles_per_us * 1000) : 0.0,
+			t->send_max / (cycles_per_us * 1000));
+	}
+	if (state_messages)
+		printf("\nstate: %llu DS_STATE messages, %.1f bytes/msg\n", (unsigned long long)state_messages,
+			state_bytes / (double)state_messages);
+	if (unbalanced_markers)
+		printf("warning: %llu unbalanced profile markers\n", (unsigned long long)unbalanced_markers);
+}
+
+int main(int argc, char *argv[])
+{
+	elf_firmware_t firmware = { { 0 } };
+	unsigned long run_seconds = 60;
+	unsigned long esp_latency_us = 2000;
+	const char *stimuli_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:l:")) != -1) {
+		switch (opt) {
+		case 't': run_seconds = strtoul(optarg, NULL, 10); break;
+		case 's': stimuli_path = optarg; break;
+		case 'l': esp_latency_us = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-s stimuli] [-l esp_latency_us] firmware.elf\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "firmware ELF is required\n");
+		return 2;
+	}
+	if (elf_read_firmware(argv[optind], &firmware)) {
+		fprintf(stderr, "can't read %s\n", argv[optind]);
+		return 1;
+	}
+	if (stimuli_path && load_stimuli(stimuli_path))
+		return 1;
+
+	avr = avr_make_mcu_by_name(MCU_NAME);
+	if (!avr) {
+		fprintf(stderr, "simavr has no %s core\n", MCU_NAME);
+		return 1;
+	}
+	avr_init(avr);
+	firmware.frequency = MCU_FREQUENCY;
+	avr_load_firmware(avr, &firmware);
+
+	avr_register_io_write(avr, GPIOR0_DATA_ADDR, on_marker, NULL);
+	for (unsigned i = 0; i < ISR_WATCH_COUNT; i++) {
+		avr_irq_t *irq = avr_get_interrupt_irq(avr, isr_watch[i].vector);
+		avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, on_vector_pending, &isr_watch[i]);
+		avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, on_vector_running, &isr_watch[i]);
+	}
+	esp.latency_cycles = esp_latency_us * (MCU_FREQUENCY / 1000000);
+	esp_attach();
+
+	uint64_t end_cycle = ms_to_cycles(run_seconds * 1000);
+	int state = cpu_Running;
+	while (avr->cycle < end_cycle && state != cpu_Done && state != cpu_Crashed) {
+		apply_stimuli();
+		esp_pump();
+		uint64_t before = avr->cycle;
+		int was_sleeping = state == cpu_Sleeping;
+		state = avr_run(avr);
+		if (state == cpu_Sleeping)
+			sleep_cycles += avr->cycle - before;
+		else if (was_sleeping)
+			sleep_wakes++;
+	}
+
+	report();
+	return state == cpu_Crashed ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Builds the firmware with profiling markers and runs it under simavr.
+# Needs arduino-cli (arduino:avr core + sketch libraries) and simavr/libelf.
+#   STIMULI=stimuli.txt RUN_SECONDS=60 ESP_LATENCY_US=2000 ./run_profile.sh
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SKETCH="$HERE/../../Arduino_ESP8266_CStation_Client"
+OUT="$HERE/build"
+
+mkdir -p "$OUT"
+arduino-cli compile --fqbn arduino:avr:mega:cpu=atmega2560 \
+  --build-property "compiler.cpp.extra_flags=-DCSTATION_PROFILE" \
+  --output-dir "$OUT" "$SKETCH"
+${CC:-cc} -O2 -Wall -o "$OUT/cstation_profile" "$HERE/cstation_profile.c" -lsimavr -lelf
+
+"$OUT/cstation_profile" -t "${RUN_SECONDS:-60}" -l "${ESP_LATENCY_US:-2000}" \
+  -s "${STIMULI:-$HERE/stimuli.txt}" "$OUT/Arduino_ESP8266_CStation_Client.ino.elf"
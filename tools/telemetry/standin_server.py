@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the CStation server: accepts the station's link on
+SERVER_PORT, learns the sensors from its DS_INFO descriptors, checks every
+telemetry message with the reference codec and reports bytes per frame.
+
+After --text-frames text telemetry messages it answers the station's
+DS_FORMAT offer with SET_FORMAT=1 and then checks the binary frames the same
+way. Commands go back over the same link when the station announced
+DS_LINK=PT, otherwise to its command server on CLIENT_PORT. DIAG_REQUEST=1
+is sent along with the switch and every --states frames; the DS_DIAG parts
+of the reply are joined, so the station's own TELEMETRY_BYTES/TELEMETRY_SEND_MS
+figures show up in the log as well.
+With --subscribe the station is sent STATES_SUBSCRIBE=1 after DS_READY and
+the changed fields it pushes are logged as they come. DS_GETTIME is answered
+with SET_TIME=<unix>.<ms> so the station can measure its clock drift, and
+DS_GETFORECAST with --forecast, or with SET_FORECAST=#<hash> when the station
+already shows that text. With --rules the rules file is compiled by
+tools/rules/rules_asm.py and uploaded with SET_RULES after DS_READY.
+
+  standin_server.py [--port 51015] [--text-frames 3] [--states 5] [--subscribe] [--rules FILE]
+"""
+
+import argparse
+import json
+import os
+import socket
+import sys
+import time
+
+import telemetry_frame as tf
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'rules'))
+import rules_asm
+
+SERVER_PORT = 51015
+CLIENT_PORT = 51016
+
+
+class Stats:
+    def __init__(self):
+        self.frames = 0
+        self.bytes = 0
+        self.errors = 0
+
+    def add(self, size):
+        self.frames += 1
+        self.bytes += size
+
+    def __str__(self):
+        average = self.bytes / self.frames if self.frames else 0
+        return '%d frames, %.1f bytes/frame, %d errors' % (self.frames, average, self.errors)
+
+
+class StationLink:
+    def __init__(self, conn, address, args):
+        self.conn = conn
+        self.address = address
+        self.args = args
+        self.stream = conn.makefile('rb')
+        self.sensors = []
+        self.station = None
+        self.passthrough = False
+        self.binary_offered = False
+        self.binary = False
+        self.diag = {}
+        self.text = Stats()
+        self.frames = Stats()
+        self.last_arrival = None
+
+    def log(self, message):
+        print('%.3f %s' % (time.time(), message))
+        sys.stdout.flush()
+
+    def command(self, text):
+        self.log('>> ' + text)
+        data = (text + '\r\n').encode()
+        if self.passthrough:
+            self.conn.sendall(data)
+            return
+        try:
+            with socket.create_connection((self.address[0], CLIENT_PORT), timeout=5) as cmd:
+                cmd.sendall(data)
+        except OSError as e:
+            self.log('command link: %s' % e)
+
+    def arrival(self):
+        now = time.time()
+        gap = now - self.last_arrival if self.last_arrival else 0
+        self.last_arrival = now
+        return gap
+
+    def telemetry_done(self):
+        count = self.text.frames + self.frames.frames
+        if self.binary_offered and not self.binary and self.text.frames >= self.args.text_frames:
+            self.binary = True
+            self.command('SET_FORMAT=1')
+            self.command('DIAG_REQUEST=1')
+        elif self.args.states and count % self.args.states == 0:
+            self.command('DIAG_REQUEST=1')
+
+    def on_text(self, line):
+        if line.startswith('DS_V='):
+            try:
+                values = tf.parse_text(line)
+                frame = tf.check_round_trip(self.sensors, values, self.station or 0)
+                self.text.add(len(line) + 2)
+                self.log('text  %3d bytes (binary would be %d) +%.1fs %s' % (len(line) + 2, len(frame), self.arrival(), line))
+            except (tf.FrameError, KeyError, ValueError) as e:
+                self.text.errors += 1
+                self.log('text telemetry error: %s: %s' % (e, line))
+            self.telemetry_done()
+            return
+        descriptor = tf.parse_descriptor(line)
+        if descriptor is not None:
+            self.sensors.append(tf.Sensor(descriptor))
+        elif line.startswith('DS='):
+            self.station = int(line[3:])
+            self.sensors = []
+            self.binary = self.binary_offered = False
+        elif line == 'DS_LINK=PT':
+            self.passthrough = True
+        elif line.startswith('DS_FORMAT=B'):
+            self.binary_offered = int(line[len('DS_FORMAT=B'):]) == tf.FRAME_VERSION
+        elif line.startswith('DS_GETTIME='):
+            self.log('<< ' + line)
+            self.command('SET_TIME=%.3f' % time.time())
+            return
+        elif line.startswith('DS_GETFORECAST='):
+            self.log('<< ' + line)
+            shown = line[len('DS_GETFORECAST='):]
+            current = '%x' % tf.crc16(self.args.forecast.encode())
+            if shown.startswith('#') and int(shown[1:], 16) == int(current, 16):
+                self.command('SET_FORECAST=#' + current)
+            else:
+                self.command('SET_FORECAST=' + self.args.forecast)
+            return
+        elif line == 'DS_READY=1' and (self.args.subscribe or self.args.rules):
+            self.log('<< ' + line)
+            if self.args.subscribe:
+                self.command('STATES_SUBSCRIBE=1')
+            for command in self.args.rules_commands:
+                self.command(command)
+            return
+        elif line.startswith('DS_STATE='):
+            states = json.loads(line[len('DS_STATE='):])
+            self.log('state push %3d bytes: %s' % (len(line) + 2, ', '.join('%s=%s' % f for f in states.items())))
+            return
+        elif line.startswith('DS_DIAG='):
+            # The reply comes in several parts, the one with the rules counters is the last
+            self.diag.update(json.loads(line[len('DS_DIAG='):]))
+            if 'RULES_COUNT' not in self.diag:
+                return
+            diag, self.diag = self.diag, {}
+            self.log('station: format %s, last telemetry %s bytes in %s ms, %s state pushes, %s rules fired %s times, '
+                     'boot to link %s ms, to telemetry %s ms' % (
+                diag.get('TELEMETRY_FORMAT'), diag.get('TELEMETRY_BYTES'), diag.get('TELEMETRY_SEND_MS'),
+                diag.get('STATE_PUSHES'), diag.get('RULES_COUNT'), diag.get('RULES_FIRED'),
+                diag.get('BOOT_LINK_MS'), diag.get('BOOT_TELEMETRY_MS')))
+            return
+        self.log('<< ' + line)
+
+    def on_frame(self, data):
+        try:
+            station, sequence, values = tf.decode(self.sensors, data)
+            # Canonical encoding: decoding and encoding again gives the same bytes
+            if tf.encode(self.sensors, station, sequence, values) != data:
+                raise tf.FrameError('re-encoded frame differs')
+            self.frames.add(len(data))
+            self.log('frame %3d bytes seq %3d +%.1fs %s' % (len(data), sequence, self.arrival(), tf.format_text(self.sensors, values)))
+        except (tf.FrameError, IndexError) as e:
+            self.frames.errors += 1
+            self.log('binary frame error: %s: %s' % (e, data.hex()))
+        self.telemetry_done()
+
+    def run(self):
+        self.log('station connected from %s:%d' % self.address)
+        while True:
+            first = self.stream.read(1)
+            if not first:
+                break
+            if first[0] == tf.FRAME_MAGIC:
+                header = first + self.stream.read(2)
+                try:
+                    length = tf.frame_length(header)
+                except tf.FrameError as e:
+                    self.frames.errors += 1
+                    self.log('binary frame error: %s' % e)
+                    continue
+                self.on_frame(header + self.stream.read(length - 3))
+                continue
+            line = (first + self.stream.readline()).decode('utf-8', 'replace').strip()
+            if line:
+                self.on_text(line)
+        self.log('station disconnected')
+        self.log('text:   %s' % self.text)
+        self.log('binary: %s' % self.frames)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--port', type=int, default=SERVER_PORT)
+    parser.add_argument('--text-frames', type=int, default=3, help='text telemetry messages before switching to binary')
+    parser.add_argument('--states', type=int, default=5, help='request the station states every N messages, 0 to disable')
+    parser.add_argument('--subscribe', action='store_true', help='subscribe to state pushes after the handshake')
+    parser.add_argument('--forecast', default='Cloudy +12*C', help='forecast text sent on DS_GETFORECAST')
+    parser.add_argument('--rules', help='rules text to upload after the handshake')
+    args = parser.parse_args()
+
+    args.rules_commands = []
+    if args.rules:
+        assembler = rules_asm.Assembler(rules_asm.sensors_from_header(), rules_asm.states_from_sketch())
+        with open(args.rules, encoding='utf-8') as f:
+            args.rules_commands = rules_asm.commands(assembler.program(f.read().splitlines()), rules_asm.DEFAULT_CHUNK)
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('', args.port))
+    server.listen(1)
+    print('listening on %d' % args.port)
+    while True:
+        conn, address = server.accept()
+        with conn:
+            StationLink(conn, address, args).run()
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
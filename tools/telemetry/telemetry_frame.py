@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+"""
+Reference codec for the CStation telemetry, text DS_V={...} and binary frames.
+
+The binary layout is documented in telemetry_frame.h. Sensor indices, codes,
+enum values and decimals come from the DS_INFO descriptors the station sends
+at handshake, in the order it sends them; for offline use they can also be
+read straight from descriptors.h.
+
+  telemetry_frame.py --self-test
+  telemetry_frame.py --decode C5011D...
+"""
+
+import argparse
+import ast
+import os
+import re
+import sys
+from decimal import Decimal
+
+FRAME_MAGIC = 0xC5
+FRAME_VERSION = 1
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DESCRIPTORS_H = os.path.join(HERE, '..', '..', 'Arduino_ESP8266_CStation_Client', 'descriptors.h')
+
+TEXT_VALUE = re.compile(r"'(\w+)':('[^']*'|-?\d+(?:\.\d+)?)")
+
+
+class FrameError(Exception):
+    pass
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, same as avr-libc _crc_xmodem_update() from 0xFFFF."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def put_varint(out, value):
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def get_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise FrameError('truncated varint')
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def zigzag(value):
+    return (value << 1) ^ (value >> 31)
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+class Sensor:
+    def __init__(self, descriptor):
+        self.code = descriptor['CODE']
+        self.type = descriptor.get('TYPE', 'FLOAT')
+        self.enums = descriptor.get('ENUMS', [])
+        self.decimals = int(descriptor.get('DEC', 0))
+
+    def to_raw(self, text):
+        """Text value as sent in DS_V ("'on'", "23.45") to the integer in the frame."""
+        if text.startswith("'"):
+            return self.enums.index(text.strip("'"))
+        return int(Decimal(text).scaleb(self.decimals).to_integral_value())
+
+    def to_text(self, raw):
+        if self.type == 'ENUM':
+            return "'%s'" % self.enums[raw]
+        if not self.decimals:
+            return str(raw)
+        return str(Decimal(raw).scaleb(-self.decimals).quantize(Decimal(1).scaleb(-self.decimals)))
+
+
+def parse_descriptor(line):
+    """DS_INFO={'CODE':'T',...} to a dict, None for other lines."""
+    if not line.startswith('DS_INFO='):
+        return None
+    return ast.literal_eval(line[len('DS_INFO='):])
+
+
+def sensors_from_header(path=DESCRIPTORS_H):
+    """Sensor table from SENSORS_TABLE in descriptors.h, as the station would announce it."""
+    sensors = []
+    with open(path, encoding='utf-8') as f:
+        for match in re.finditer(r'X\(SENSOR_\w+,\s*"(\w+)",\s*(\d+),\s*"(.*)"\)', f.read()):
+            code, decimals, fields = match.groups()
+            descriptor = ast.literal_eval("{'CODE':'%s',%s}" % (code, fields))
+            if int(decimals):
+                descriptor['DEC'] = int(decimals)
+            sensors.append(Sensor(descriptor))
+    return sensors
+
+
+def parse_text(line):
+    """DS_V={'A':'on','T':23.45,...} to {code: text value}."""
+    if not line.startswith('DS_V={'):
+        raise FrameError('not a DS_V line')
+    return dict(TEXT_VALUE.findall(line))
+
+
+def format_text(sensors, values):
+    """{code: text value} back to a DS_V line, in sensor index order."""
+    fields = ["'%s':%s" % (s.code, values[s.code]) for s in sensors if s.code in values]
+    return 'DS_V={' + ','.join(fields) + '}'
+
+
+def encode(sensors, station, sequence, values):
+    """{code: text value} to a binary frame."""
+    index = {s.code: i for i, s in enumerate(sensors)}
+    presence = 0
+    for code in values:
+        presence |= 1 << index[code]
+    out = bytearray([FRAME_MAGIC, FRAME_VERSION, 0, station & 0xFF, sequence & 0xFF])
+    put_varint(out, presence)
+    for i, sensor in enumerate(sensors):
+        if presence & (1 << i):
+            put_varint(out, zigzag(sensor.to_raw(values[sensor.code])) & 0xFFFFFFFF)
+    out[2] = len(out) + 2
+    crc = crc16(out)
+    out += bytes([crc & 0xFF, crc >> 8])
+    return bytes(out)
+
+
+def frame_length(header):
+    """Whole frame length from its first three bytes."""
+    if header[0] != FRAME_MAGIC:
+        raise FrameError('bad magic 0x%02X' % header[0])
+    if header[1] != FRAME_VERSION:
+        raise FrameError('unknown version %d' % header[1])
+    return header[2]
+
+
+def decode(sensors, data):
+    """Binary frame to (station, sequence, {code: text value})."""
+    if len(data) < 7 or frame_length(data) != len(data):
+        raise FrameError('bad length')
+    crc = data[-2] | (data[-1] << 8)
+    if crc16(data[:-2]) != crc:
+        raise FrameError('CRC mismatch')
+    station, sequence = data[3], data[4]
+    presence, pos = get_varint(data, 5)
+    values = {}
+    for i, sensor in enumerate(sensors):
+        if presence & (1 << i):
+            raw, pos = get_varint(data, pos)
+            values[sensor.code] = sensor.to_text(unzigzag(raw))
+    if presence >> len(sensors):
+        raise FrameError('presence names unknown sensors')
+    if pos != len(data) - 2:
+        raise FrameError('trailing bytes')
+    return station, sequence, values
+
+
+def check_round_trip(sensors, values, station=1, sequence=0):
+    """Text values -> frame -> text values must give the same strings back."""
+    frame = encode(sensors, station, sequence, values)
+    _, _, decoded = decode(sensors, frame)
+    if decoded != values:
+        raise FrameError('round trip mismatch: %r != %r' % (decoded, values))
+    return frame
+
+
+SELF_TEST_LINES = [
+    "DS_V={'A':'on','E':0,'T':23.45,'P':745.123,'H':41.2,'L':120,'R':'no','NL':3,'Mx':-212,'My':48,'Mz':-405}",
+    "DS_V={'A':'on','E':3,'T':-0.05,'P':512.000,'H':100.0,'L':65535,'R':'yes','N':'yes','NL':100,'Mx':10000,'My':-10000,'Mz':0,'Ma':'yes'}",
+    "DS_V={'A':'on','O':'no'}",
+    "DS_V={'A':'on','R':'yes','B':'yes','Ma':'yes','O':'yes'}",
+]
+
+
+def self_test():
+    if crc16(b'123456789') != 0x29B1:
+        raise FrameError('CRC check value')
+    sensors = sensors_from_header()
+    for line in SELF_TEST_LINES:
+        values = parse_text(line)
+        frame = check_round_trip(sensors, values, station=7, sequence=200)
+        if format_text(sensors, values) != format_text(sensors, decode(sensors, frame)[2]):
+            raise FrameError('text rendering differs')
+        print('%3d text bytes -> %2d frame bytes  %s' % (len(line) + 2, len(frame), frame.hex().upper()))
+    corrupt = bytearray(frame)
+    corrupt[5] ^= 1
+    try:
+        decode(sensors, bytes(corrupt))
+    except FrameError:
+        pass
+    else:
+        raise FrameError('corrupted frame accepted')
+    print('self-test passed')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--self-test', action='store_true', help='round-trip the sample frames')
+    parser.add_argument('--decode', metavar='HEX', help='decode one frame given in hex')
+    parser.add_argument('--descriptors', default=DESCRIPTORS_H, help='descriptors.h to take the sensors from')
+    args = parser.parse_args()
+
+    if args.self_test:
+        self_test()
+    if args.decode:
+        station, sequence, values = decode(sensors_from_header(args.descriptors), bytes.fromhex(args.decode))
+        print('station %d seq %d %s' % (station, sequence, format_text(sensors_from_header(args.descriptors), values)))
+    if not args.self_test and not args.decode:
+        parser.print_help()
+        return 2
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())